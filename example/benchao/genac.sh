@@ -0,0 +1,21 @@
+#!/bin/sh
+
+# generate the acoustic field shared by the benchmarks, next to this script:
+# a focused ultrasound beam along z, |P| decays from the axis x=y=30,
+# the phase advances with z
+
+cd `dirname $0`
+
+if [ -f ac60x60x60.bin ]; then
+   exit 0
+fi
+
+perl -e '
+  $n=60;
+  for $c (0..3){
+    for $z (0..$n-1){ for $y (0..$n-1){ for $x (0..$n-1){
+      $r2=($x-30)**2+($y-30)**2;
+      $p=($r2<100) ? 1e5*exp(-$r2/25.0) : 0;
+      print pack("f", $c==2 ? $p : ($c==3 ? 0.3*$z : 0));
+    }}}
+  }' > ac60x60x60.bin
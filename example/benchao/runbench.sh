@@ -0,0 +1,31 @@
+#!/bin/sh
+
+# compare the simulation speed with the AO terms folded on the fly (-k 0)
+# and with the precomputed per-voxel AO table (-k 1)
+
+# generate a 60x60x60 homogeneous medium filled with index 1
+
+dd if=/dev/zero of=seg60x60x60.bin bs=1000 count=216
+perl -pi -e 's/\x0/\x1/g' seg60x60x60.bin
+
+# the focused acoustic field, see genac.sh
+
+./genac.sh
+
+if [ $# = 0 ]; then
+   options=""
+else
+   options=$*    # for example, "-c 1" to benchmark the CPU engine
+fi
+
+mcxbin="../../bin/mcx"
+
+for table in 0 1
+do
+   echo "<mcx_session aotable='$table'>"
+   echo "<cmd>$mcxbin -f benchao.inp -s benchao -k $table -d 0 -S 0 $options</cmd>"
+   echo "<output>"
+   $mcxbin -f benchao.inp -s benchao -k $table -d 0 -S 0 $options | grep -E 'speed|simulated'
+   echo "</output>"
+   echo "</mcx_session>"
+done
@@ -0,0 +1,67 @@
+/*******************************************************************************
+**
+**  besselspeed.c: accuracy and speed of mcx_besselj01() in mcx_bessel.h
+**                 against the single precision j0f()/j1f() of libm
+**
+**  usage: besselspeed <number of evaluations> <max argument>
+**
+*******************************************************************************/
+
+#define _GNU_SOURCE          /* j0f/j1f are GNU extensions of libm */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "mcx_bessel.h"
+
+#define ERR_SAMPLES  2000001
+
+static double walltime(void){
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC,&ts);
+      return ts.tv_sec*1e3+ts.tv_nsec*1e-6;
+}
+
+int main(int argc, char *argv[]){
+      int i,n=10000000;
+      float xmax=MCX_BESSEL_XMAX,*x,b0,b1,w0,w1;
+      double err0=0.,err1=0.,libm0=0.,libm1=0.,t0,tfast,tlibm,sum=0.;
+
+      if(argc>1) n=atoi(argv[1]);
+      if(argc>2) xmax=atof(argv[2]);
+
+      /* max absolute error, reference is the double precision libm */
+      for(i=0;i<ERR_SAMPLES;i++){
+           float xi=xmax*i/(ERR_SAMPLES-1);
+           mcx_besselj01(xi,&b0,&b1);
+           err0=fmax(err0,fabs(b0-j0(xi)));
+           err1=fmax(err1,fabs(b1-j1(xi)));
+           libm0=fmax(libm0,fabs(j0f(xi)-j0(xi)));
+           libm1=fmax(libm1,fabs(j1f(xi)-j1(xi)));
+      }
+      printf("max abs. error on [0,%g]: J0 %e (libm j0f %e), J1 %e (libm j1f %e)\n",
+             xmax,err0,libm0,err1,libm1);
+
+      /* speed of the two fluence weights of one deposit */
+      x=(float *)malloc(sizeof(float)*n);
+      srand(1);
+      for(i=0;i<n;i++)
+           x[i]=xmax*rand()/(float)RAND_MAX;
+
+      t0=walltime();
+      for(i=0;i<n;i++){
+           mcx_aoweights(x[i],&w0,&w1);
+           sum+=w0+w1;
+      }
+      tfast=walltime()-t0;
+      t0=walltime();
+      for(i=0;i<n;i++)
+           sum-=j0f(x[i])*j0f(x[i])+2.f*j1f(x[i])*j1f(x[i]);
+      tlibm=walltime()-t0;
+
+      printf("%d deposits: mcx_aoweights %.2f ms, libm %.2f ms, speedup %.2fx (checksum %e)\n",
+             n,tfast,tlibm,tlibm/tfast,sum);
+      free(x);
+      return 0;
+}
@@ -0,0 +1,14 @@
+#!/bin/sh
+make clean all
+
+echo ============================================================
+echo "modulation depth range of typical AO simulations, [0,1]"
+../../bin/besselspeed 10000000 1
+
+echo ============================================================
+echo "full range of the series, [0,2]"
+../../bin/besselspeed 10000000 2
+
+echo ============================================================
+echo "beyond the series, falls back to libm for x>2"
+../../bin/besselspeed 10000000 4
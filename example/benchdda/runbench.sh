@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# compare the speed and the output of the fixed unit steps (-j 0) with the
+# voxel face to face traversal (-j 1) on the validation and sphbox domains
+
+# the focused acoustic field and the AO validation domain are shared with
+# example/benchao
+
+../benchao/genac.sh
+
+if [ $# = 0 ]; then
+   options=""
+else
+   options=$*    # for example, "-c 1" to benchmark the CPU engine
+fi
+
+mcxbin="../../bin/mcx"
+
+for domain in validation spherebox
+do
+   inp=$domain.inp
+   if [ $domain = validation ]; then
+      inp=../benchao/validation.inp
+   fi
+   for dda in 0 1
+   do
+      echo "<mcx_session domain='$domain' dda='$dda'>"
+      echo "<cmd>$mcxbin -f $inp -s ${domain}_j$dda -j $dda -g 50 -b 1 -d 1 $options</cmd>"
+      echo "<output>"
+      $mcxbin -f $inp -s ${domain}_j$dda -j $dda -g 50 -b 1 -d 1 $options | grep -E 'speed|simulated|absorbed'
+      echo "</output>"
+      echo "</mcx_session>"
+   done
+done
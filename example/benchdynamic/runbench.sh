@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# compare a fixed share of photons per thread (-V 0) with threads claiming
+# photons from a shared counter (-V 1) on the homogeneous validation domain
+
+# the focused acoustic field and the AO validation domain are shared with
+# example/benchao
+
+../benchao/genac.sh
+
+if [ $# = 0 ]; then
+   options=""
+else
+   options=$*    # for example, "-c 1" to benchmark the CPU engine
+fi
+
+mcxbin="../../bin/mcx"
+
+for np in 1e5 1e7
+do
+   for dyn in 0 1
+   do
+      echo "<mcx_session photon='$np' dynamic='$dyn'>"
+      echo "<cmd>$mcxbin -f ../benchao/validation.inp -s validation_v$dyn -n $np -V $dyn -g 50 -b 1 -d 1 $options</cmd>"
+      echo "<output>"
+      $mcxbin -f ../benchao/validation.inp -s validation_v$dyn -n $np -V $dyn -g 50 -b 1 -d 1 $options | grep -E 'speed|simulated|utilization'
+      echo "</output>"
+      echo "</mcx_session>"
+   done
+done
@@ -0,0 +1,29 @@
+#!/bin/sh
+
+# compare the speed and the output of the analytic scattering angles (-Q 0)
+# with the per-medium lookup tables (-Q 1) on a forward scattering medium
+
+# the focused acoustic field and the AO validation domain are shared with
+# example/benchao, the medium is made forward scattering (g=0.9) and the
+# scattering coefficient raised to keep a reduced one of 1/mm
+
+../benchao/genac.sh
+sed 's|^1.0101010101 0.01 0.005 1.37  #|10.101010101 0.9 0.005 1.37   #|' ../benchao/validation.inp > validation.inp
+
+if [ $# = 0 ]; then
+   options=""
+else
+   options=$*    # for example, "-c 1" to benchmark the CPU engine
+fi
+
+mcxbin="../../bin/mcx"
+
+for lut in 0 1
+do
+   echo "<mcx_session lut='$lut'>"
+   echo "<cmd>$mcxbin -f validation.inp -s validation_q$lut -Q $lut -g 50 -b 1 -d 1 $options</cmd>"
+   echo "<output>"
+   $mcxbin -f validation.inp -s validation_q$lut -Q $lut -g 50 -b 1 -d 1 $options | grep -E 'speed|simulated|absorbed|angle tables'
+   echo "</output>"
+   echo "</mcx_session>"
+done
@@ -15,7 +15,11 @@
 #define USE_OS_TIMER  /* use MT19937 RNG */
 #include "tictoc.c"
 
-#define RAND_TEST_LEN 5
+#ifdef USE_PHILOX_RAND
+  #define RAND_TEST_LEN 4
+#else
+  #define RAND_TEST_LEN 5
+#endif
 
 #ifdef USE_MT_RAND  /* use MT19937 RNG */
 
@@ -48,6 +52,39 @@ kernel void bench_rng(uint seed[],float output[],int loop){
 #endif     
 }
 
+#elif defined(USE_PHILOX_RAND)  /* use Philox4x32-10 RNG */
+
+//===================================================================
+// GPU kernels for the counter-based Philox4x32-10
+//===================================================================
+
+#include "philox_rand.cu"
+
+kernel void bench_rng(uint seed[],float output[],int loop){
+     int idx= blockDim.x * blockIdx.x + threadIdx.x;
+     int base=idx*loop;
+     int i;
+     float c=0.f;
+
+     RandType t[RAND_BUF_LEN],tnew[RAND_BUF_LEN];
+     gpu_rng_init(t,tnew,seed,idx);
+     rand_photon_start(t,tnew,idx);
+
+     for(i=0;i<loop;i+=4){
+          rand_need_more(t,tnew); /*create 4 random numbers*/
+	  c+=rand_uniform01(t[0]);
+#ifdef GLOBAL_WRITE
+	  output[base+i]=  rand_uniform01(t[0]);
+	  output[base+i+1]=rand_uniform01(t[1]);
+	  output[base+i+2]=rand_uniform01(t[2]);
+	  output[base+i+3]=rand_uniform01(t[3]);
+#endif
+     }
+#ifndef GLOBAL_WRITE  /*to prevent the compiler from optimizing the rand*/
+     output[base]=  c;
+#endif
+}
+
 #else   /* use Logistic-map lattice RNG */
 
 //===================================================================
@@ -0,0 +1,111 @@
+/////////////////////////////////////////////////////////////////////
+//
+//  Monte-Carlo Extreme (MCX) - a GPU accelerated Monte-Carlo Simulation
+//  Random Number Generator Benchmark, host version
+//
+//  History:
+//     the throughput of the RNGs of the multi-threaded CPU engine,
+//     built with -DUSE_PHILOX_RAND for Philox4x32-10, without for LL5
+//
+/////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+typedef unsigned int uint;
+
+/* the RNGs are plain C, compile the GPU versions for the host */
+#define __device__
+
+#ifdef USE_PHILOX_RAND
+  #include "philox_rand.cu"
+  #define RAND_BLOCK_LEN 4   /*numbers per rand_need_more()*/
+#else
+  #include "logistic_rand.cu"
+  #define RAND_BLOCK_LEN 5
+#endif
+
+#define USE_OS_TIMER
+#include "tictoc.c"
+
+//===================================================================
+// utility functions
+//===================================================================
+
+void usage(char *exename){
+	printf("usage: %s <num_thread|all cores> <rand_per_thread|10000000> <num_repeat|10>\n",exename);
+}
+
+//===================================================================
+// main program
+//===================================================================
+
+int main(int argc, char *argv[]){
+    int threadnum=1,count=10000000,repeat=10,tic,toc;
+    uint   *Pseed;
+    double *Poutput;
+    double totalrand;
+    int i;
+
+    // parse arguments
+
+    if(argc==1){
+	usage(argv[0]);
+	exit(0);
+    }
+#ifdef _OPENMP
+    threadnum=omp_get_max_threads();
+#endif
+    if(argc>=2 && atoi(argv[1])>0) threadnum=atoi(argv[1]);
+    if(argc>=3) count=atoi(argv[2]);
+    if(argc>=4) repeat=atoi(argv[3]);
+
+    count=(count/RAND_BLOCK_LEN)*RAND_BLOCK_LEN; // make count modulo of the block length
+
+    Pseed=(uint*)malloc(sizeof(uint)*threadnum*RAND_SEED_LEN);
+    Poutput=(double*)calloc(threadnum,sizeof(double));
+
+    // initialize seeds, the same as the CPU engine does for one launch
+
+    srand(time(0));
+    rand_launch_seeds(Pseed,threadnum,(uint)rand(),0,0);
+
+    totalrand=(double)threadnum*count*repeat;
+    printf("RNG [%s], total thread=%d, total rand num=%f\n",MCX_RNG_NAME,threadnum,totalrand);
+
+    // begin benchmark, each thread draws the numbers of one photon stream per repetition
+
+    tic=StartTimer();
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(threadnum) schedule(static,1)
+#endif
+    for(i=0;i<threadnum;i++){
+        RandType t[RAND_BUF_LEN],tnew[RAND_BUF_LEN];
+        double c=0.0;
+        int j,k,r;
+        gpu_rng_init(t,tnew,Pseed,i);
+        for(r=0;r<repeat;r++){
+            rand_photon_start(t,tnew,(uint)(i*repeat+r));
+            for(j=0;j<count;j+=RAND_BLOCK_LEN){
+                rand_need_more(t,tnew);
+                for(k=0;k<RAND_BLOCK_LEN;k++)
+                    c+=rand_uniform01(t[k]);
+            }
+        }
+        Poutput[i]=c; /*to prevent the compiler from optimizing the rand*/
+    }
+    toc=GetTimeMillis()-tic;
+
+    printf("complete: %d ms\nspeed: %f random numbers per second\nmean: %f\n",\
+        toc, (1000./(toc>0 ? toc : 1))*totalrand, Poutput[0]/((double)count*repeat));
+
+    // memory clean-up
+
+    free(Pseed);
+    free(Poutput);
+    return 0;
+}
@@ -9,6 +9,21 @@ echo "running LL5 RNG using only registers"
 make clean logistic
 ../../bin/rngspeed 128 128 100000
 
+echo ============================================================
+echo "running Philox RNG using only registers"
+make clean philox
+../../bin/rngspeed 128 128 100000
+
+echo ============================================================
+echo "running LL5 RNG on the CPU, all cores"
+make clean cpulogistic
+../../bin/rngspeed_cpu 0 10000000 10
+
+echo ============================================================
+echo "running Philox RNG on the CPU, all cores"
+make clean cpu
+../../bin/rngspeed_cpu 0 10000000 10
+
 #echo ============================================================
 #echo "running MT RNG with global write (bottleneck)"
 #make clean mtw
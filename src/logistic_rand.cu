@@ -96,6 +96,9 @@ __device__ RandType rand_uniform01(RandType v){
 __device__ void gpu_rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN],uint *n_seed,int idx){
     logistic_init(t,tnew,n_seed,idx);
 }
+// one stream per thread, a new photon continues it
+__device__ void rand_photon_start(RandType t[RAND_BUF_LEN],RandType tnew[RAND_BUF_LEN],uint photonid){
+}
 // generate [0,1] random number for the next scattering length
 __device__ float rand_next_scatlen(RandType t[RAND_BUF_LEN]){
     RandType ran=rand_uniform01(t[0]);
@@ -119,4 +122,18 @@ __device__ float rand_next_reflect(RandType t[RAND_BUF_LEN]){
 __device__ float rand_do_roulette(RandType t[RAND_BUF_LEN]){
     return rand_uniform01(t[1]);
 }
+
+// host side: draws the seeds of one launch of nthread threads, returns the number of rand() values used
+static unsigned int rand_launch_seeds(uint seed[],uint nthread,uint runseed,uint src,uint launch){
+    uint i;
+    for(i=0;i<nthread*RAND_SEED_LEN;i++)
+        seed[i]=rand();
+    return nthread*RAND_SEED_LEN;
+}
+// host side: new seeds for a relaunch of the same repetition, without using rand()
+static inline void rand_relaunch_seeds(uint seed[],uint nthread){
+    uint i;
+    for(i=0;i<nthread*RAND_SEED_LEN;i++)
+        seed[i]=(seed[i]*1103515245u+12345u)%((uint)RAND_MAX+1u);
+}
 #endif
@@ -30,9 +30,9 @@ int main (int argc, char *argv[]) {
      // parse command line options to initialize the configurations
      mcx_parsecmd(argc,argv,&mcxconfig);
      
-     // identify gpu number and set one gpu active
-     if(!mcx_set_gpu(&mcxconfig)){
-         mcx_error(-1,"No GPU device found\n",__FILE__,__LINE__);
+     // identify gpu number and set one gpu active, the CPU engine needs no GPU
+     if(!mcxconfig.iscpu && !mcx_set_gpu(&mcxconfig)){
+         mcx_error(-1,"No GPU device found, use -c 1 to run on the CPU\n",__FILE__,__LINE__);
      }
           
      // this launches the MC simulation
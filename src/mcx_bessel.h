@@ -0,0 +1,100 @@
+/*******************************************************************************
+**
+**  Acousto-Optic MCX (AO-MCX) - Matt Adams <adamsm2@bu.edu>
+**
+**  mcx_bessel.h: Jn Bessel functions for the range of the AO modulation
+**                depth, shared by the GPU kernel, the CPU engine and the
+**                host-side post-processing
+**
+**  The modulation depth of a photon is far below the first zero of J0
+**  (2.405), so for |x|<=MCX_BESSEL_XMAX both functions are evaluated from
+**  the power series in u=(x/2)^2 truncated after the u^7 term with Horner's
+**  scheme; larger arguments fall back to j0f()/j1f() of libm/CUDA.
+**
+**  The truncation error is below the first omitted term, 1/(8!)^2=6.2e-10
+**  for J0 and 1/(8!9!)=6.8e-11 for J1. Measured against the double precision
+**  libm over [0,2] (example/benchbessel), the max absolute error is 8.8e-8 for
+**  J0 and 1.1e-7 for J1, on par with j0f()/j1f() themselves. The higher
+**  sidebands (-J) use the same number of terms of the general series, whose
+**  truncation error 1/(8!(8+n)!) only decreases with the order n.
+**
+**  License: GNU General Public License v3, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#ifndef _MCEXTREME_BESSEL_H
+#define _MCEXTREME_BESSEL_H
+
+#include <math.h>
+
+#ifdef __CUDACC__
+  #define MCX_BESSEL_FUN __device__ __host__ inline
+#else
+  #define MCX_BESSEL_FUN static inline
+#endif
+
+#define MCX_BESSEL_XMAX  2.f   /*upper bound of the series, u=(x/2)^2<=1*/
+
+/**
+   evaluates J0(x) and J1(x) together, both share u=(x/2)^2
+*/
+MCX_BESSEL_FUN void mcx_besselj01(float x,float *b0,float *b1){
+      float u;
+      if(fabsf(x)>MCX_BESSEL_XMAX){
+           *b0=j0f(x);
+           *b1=j1f(x);
+           return;
+      }
+      u=x*x*0.25f;
+      /* J0: sum_k (-u)^k/(k!)^2 */
+      *b0=1.f-u*(1.f-u*(0.25f-u*(2.7777778e-2f-u*(1.7361111e-3f-u*(6.9444444e-5f
+           -u*(1.9290123e-6f-u*3.9367599e-8f))))));
+      /* J1: x/2*sum_k (-u)^k/(k!(k+1)!) */
+      *b1=x*0.5f*(1.f-u*(0.5f-u*(8.3333333e-2f-u*(6.9444444e-3f-u*(3.4722222e-4f
+           -u*(1.1574074e-5f-u*(2.7557319e-7f-u*4.9209499e-9f)))))));
+}
+
+/**
+   the two fluence weights of a deposit, J0(x)^2 for field0 and 2*J1(x)^2
+   for field1
+*/
+MCX_BESSEL_FUN void mcx_aoweights(float x,float *w0,float *w1){
+      float j0,j1;
+      mcx_besselj01(x,&j0,&j1);
+      *w0=j0*j0;
+      *w1=2.f*j1*j1;
+}
+
+/**
+   evaluates Jn(x) for n>=2: (x/2)^n/n!*sum_k (-u)^k/(k!(k+n)!), the terms
+   are built from the previous one
+*/
+MCX_BESSEL_FUN float mcx_besseljn(int n,float x){
+      float u,t=1.f,s;
+      int k;
+      if(fabsf(x)>MCX_BESSEL_XMAX)
+           return jnf(n,x);
+      for(k=1;k<=n;k++)
+           t*=x*0.5f/k;
+      u=x*x*0.25f;
+      s=t;
+      for(k=1;k<=7;k++){
+           t*=-u/(float)(k*(k+n));
+           s+=t;
+      }
+      return s;
+}
+
+/**
+   fluence weight of the n-th sideband, J0(x)^2 for the carrier and
+   2*Jn(x)^2 for n>=1; j0/j1 are the values from mcx_besselj01(x)
+*/
+MCX_BESSEL_FUN float mcx_aoweight(int n,float x,float j0,float j1){
+      float jn;
+      if(n==0)
+           return j0*j0;
+      jn=(n==1) ? j1 : mcx_besseljn(n,x);
+      return 2.f*jn*jn;
+}
+
+#endif
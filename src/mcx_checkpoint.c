@@ -0,0 +1,106 @@
+/*******************************************************************************
+**
+**  Acousto-Optic MCX (AO-MCX) - Matt Adams <adamsm2@bu.edu>
+**
+**	Written based on:
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated 3D Monte Carlo transport simulation
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcx_checkpoint.c: checkpoint file of a run (-K), read back by --resume (-Z)
+**
+**  License: GNU General Public License v3, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "mcx_checkpoint.h"
+
+/*the part of the header that identifies the run*/
+#define CKPT_RUNLEN   offsetof(Checkpoint,isrc)
+
+void mcx_checkpoint_init(Checkpoint *ck,Config *cfg,unsigned int engine,unsigned int nthread,unsigned int nlane,
+                         unsigned int respin,unsigned int fieldlen,unsigned int parkreclen){
+     memset(ck,0,sizeof(Checkpoint));
+     memcpy(ck->magic,"MCXK",4);
+     ck->version=MCX_CKPT_VERSION;
+     ck->engine=engine;
+     ck->nthread=nthread;
+     ck->nlane=nlane;
+     ck->nphoton=cfg->nphoton;
+     ck->respin=respin;
+     ck->maxgate=cfg->maxgate;
+     ck->srcnum=cfg->srcnum;
+     ck->fieldlen=fieldlen;
+     ck->colcount=cfg->his.colcount;
+     ck->parkreclen=parkreclen;
+}
+
+/**
+   starts a new checkpoint in <session>.ckpt.tmp, the previous checkpoint
+   stays valid until mcx_checkpoint_commit() replaces it
+*/
+FILE *mcx_checkpoint_create(const char *session,Checkpoint *ck){
+     char name[MAX_PATH_LENGTH];
+     FILE *fp;
+     sprintf(name,"%s.ckpt.tmp",session);
+     if((fp=fopen(name,"wb"))==NULL)
+          mcx_error(-2,"can not save the checkpoint to disk",__FILE__,__LINE__);
+     mcx_checkpoint_write(fp,ck,sizeof(Checkpoint));
+     return fp;
+}
+
+void mcx_checkpoint_write(FILE *fp,const void *buf,size_t len){
+     if(len && fwrite(buf,len,1,fp)!=1)
+          mcx_error(-2,"can not save the checkpoint to disk",__FILE__,__LINE__);
+}
+
+void mcx_checkpoint_commit(FILE *fp,const char *session){
+     char name[MAX_PATH_LENGTH],tmpname[MAX_PATH_LENGTH];
+     sprintf(name,"%s.ckpt",session);
+     sprintf(tmpname,"%s.ckpt.tmp",session);
+     if(fclose(fp))
+          mcx_error(-2,"can not save the checkpoint to disk",__FILE__,__LINE__);
+     if(rename(tmpname,name)){  /*atomic on POSIX, rename does not replace an existing file on Windows*/
+          remove(name);
+          if(rename(tmpname,name))
+               mcx_error(-2,"can not save the checkpoint to disk",__FILE__,__LINE__);
+     }
+}
+
+/**
+   opens <session>.ckpt and reads its header, the sections are read by the
+   engine that wrote them
+*/
+FILE *mcx_checkpoint_open(const char *session,Checkpoint *ck){
+     char name[MAX_PATH_LENGTH];
+     FILE *fp;
+     sprintf(name,"%s.ckpt",session);
+     if((fp=fopen(name,"rb"))==NULL)
+          mcx_error(-2,"can not open the checkpoint file",__FILE__,__LINE__);
+     mcx_checkpoint_read(fp,ck,sizeof(Checkpoint));
+     if(memcmp(ck->magic,"MCXK",4) || ck->version!=MCX_CKPT_VERSION)
+          mcx_error(-2,"the checkpoint file is of an unknown format or version",__FILE__,__LINE__);
+     return fp;
+}
+
+void mcx_checkpoint_read(FILE *fp,void *buf,size_t len){
+     if(len && fread(buf,len,1,fp)!=1)
+          mcx_error(-2,"the checkpoint file is truncated",__FILE__,__LINE__);
+}
+
+/**
+   a checkpoint can only be resumed by the same engine with the same
+   photon, thread, repetition and output settings
+*/
+void mcx_checkpoint_verify(const Checkpoint *ck,const Checkpoint *run){
+     if(memcmp(ck,run,CKPT_RUNLEN))
+          mcx_error(-2,"the checkpoint was written by a different engine or settings (-n/-t/-r/-g/-d/-D)",__FILE__,__LINE__);
+}
+
+void mcx_checkpoint_remove(const char *session){
+     char name[MAX_PATH_LENGTH];
+     sprintf(name,"%s.ckpt",session);
+     remove(name);
+}
@@ -0,0 +1,74 @@
+#ifndef _MCEXTREME_CHECKPOINT_H
+#define _MCEXTREME_CHECKPOINT_H
+
+#include <stdio.h>
+#include "mcx_utils.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define MCX_CKPT_VERSION   2
+
+/*
+   header of the checkpoint file <session>.ckpt (-K), written after a
+   completed launch, a repetition on the GPU or one of the photon chunks of
+   a repetition on the CPU engine; at that point no photon is in flight
+   except the ones parked by the streaming mode (-D), so the header and the
+   sections below describe the whole run:
+     fields  only inside a time window (iter>0): the GPU writes the dense
+             accumulated fields, the CPU engine writes per worker its tile
+             count, then the index and content of each allocated tile
+     energy  loss/absorbed, 2 floats per thread on the GPU, 2 doubles per
+             worker on the CPU engine
+     parked  nparkgroup photon counts (one for the GPU, one per CPU worker)
+             followed by the records, parkreclen floats each
+   A checkpoint at a source boundary (window=iter=0) has no sections. The
+   per-thread seeds are not stored: every launch draws them from the
+   host RNG, restoring srand(seed) and the number of draws made reproduces
+   the uninterrupted run. On resume, the .mc2 files are cut back to the
+   saved windows and the .mch file to detsaved records.
+*/
+typedef struct MCXCheckpoint{
+	char magic[4];              /*"MCXK"*/
+	unsigned int version;
+	/*the run the checkpoint belongs to, must match on resume*/
+	unsigned int engine;        /*0 for the GPU, 1 for the CPU engine*/
+	unsigned int nthread;       /*GPU threads or CPU workers*/
+	unsigned int nlane;         /*SIMD lanes per CPU worker, 1 on the GPU*/
+	unsigned int nphoton;
+	unsigned int respin;        /*launches of a window, repetitions x chunks on the CPU*/
+	unsigned int maxgate;
+	unsigned int srcnum;
+	unsigned int fieldlen;      /*floats of the dense fields*/
+	unsigned int colcount;
+	unsigned int parkreclen;
+	/*progress*/
+	unsigned int isrc;          /*source of the list (-W) being run*/
+	unsigned int window;        /*time windows completed and saved*/
+	unsigned int iter;          /*launches of the current window completed*/
+	unsigned int seed;          /*seed of the host RNG*/
+	unsigned long long ndraw;   /*rand() calls since srand(seed)*/
+	unsigned int photoncount;
+	unsigned int detected;      /*detected photons, including the ones beyond the device buffer*/
+	unsigned long long detsaved;/*records in the .mch file*/
+	double eabsorp;             /*absorbed energy near the source of the current window*/
+	unsigned int nparkgroup;
+	int reserved[8];
+} Checkpoint;
+
+void  mcx_checkpoint_init(Checkpoint *ck,Config *cfg,unsigned int engine,unsigned int nthread,unsigned int nlane,
+                          unsigned int respin,unsigned int fieldlen,unsigned int parkreclen);
+FILE *mcx_checkpoint_create(const char *session,Checkpoint *ck);
+void  mcx_checkpoint_write(FILE *fp,const void *buf,size_t len);
+void  mcx_checkpoint_commit(FILE *fp,const char *session);
+FILE *mcx_checkpoint_open(const char *session,Checkpoint *ck);
+void  mcx_checkpoint_read(FILE *fp,void *buf,size_t len);
+void  mcx_checkpoint_verify(const Checkpoint *ck,const Checkpoint *run);
+void  mcx_checkpoint_remove(const char *session);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
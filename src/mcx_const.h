@@ -12,10 +12,13 @@
 #define VERY_BIG           1e10f                   //a big number
 #define JUST_ABOVE_ONE     1.0001f                 //test for boundary
 #define SAME_VOXEL         -9999.f                 //scatter within a voxel
+#define DDA_NUDGE          1e-4f                   //step past a voxel face in the DDA mode (-j), unit=grid
+#define SCAT_LUT_LEN       4096                    //intervals of a scattering angle table (-Q), a row has SCAT_LUT_LEN+1 entries
+#define DYNAMIC_QUOTA      0x7FFFFF00              //photon quota of a thread with -V, cut when the shared counter runs out
 #define MAX_PROP           255                     //maximum property number.  If you change this, you must change the medium type from uchar to ushort //MTA changed 6/26/12
 #define MAX_DETECTORS      256
-//#define MAX_VOXELS		   217081801			   //equal to 601x601x601 voxels.  As of 2/4/13, this doesn't compile
-#define MAX_VOXELS		   125751501				//equal to 501x501x501 voxels.
+#define MAX_PHASES         64                      //maximum ultrasound phase offsets of a sweep (-x)
+#define MAX_FREQS          16                      //maximum acoustic frequencies of one run (-F)
 
 #define DET_MASK           0x80					   //128 in ascii
 #define MED_MASK           0x7F					   //127 in ascii
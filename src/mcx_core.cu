@@ -22,10 +22,16 @@
 #include "mcx_core.h"
 #include "tictoc.h"
 #include "mcx_const.h"
+#include "mcx_cpu.h"
+#include "mcx_bessel.h"
+#include "mcx_detwriter.h"
+#include "mcx_checkpoint.h"
 #include "/ad/eng/support/software/linux/all/x86_64/cuda/cuda-4.2/include/math_functions.h" //MTA
 
 #ifdef USE_MT_RAND
 #include "mt_rand_s.cu"     // use Mersenne Twister RNG (MT)
+#elif defined(USE_PHILOX_RAND)
+#include "philox_rand.cu"   // use the counter-based Philox4x32-10 RNG, one stream per photon
 #else
 #include "logistic_rand.cu" // use Logistic Lattice ring 5 RNG (LL5)
 #endif
@@ -33,9 +39,6 @@
 // Optical properties saved in the constant memory
 // {x}:mua,{y}:mus,{z}:anisotropy (g),{w}:refractive index (n)
 __constant__ float4 gproperty[MAX_PROP];
-// Acoustic field saved in global memory
-// {x}:Px,{y}:Py,{z}:Pz,{w}:Ultrasound Phase (Phi)
-__device__ float4 gmedia_acous[MAX_VOXELS]; //MTA
 // Acoustic constants saved in constant memory
 // {x}:rho,{y}:speed of sound (va),{z}:Acoustic frequency (f)
 __constant__ float3 gAcon; //MTA
@@ -44,6 +47,10 @@ __constant__ float3 gAcon; //MTA
 __constant__ float2 gOcon; //MTA
 // {x,y,z,radius}
 __constant__ float4 gdetpos[MAX_DETECTORS];
+// {x,y}: cos/sin of the ultrasound phase offsets of a sweep (-x)
+__constant__ float2 gphase[MAX_PHASES];
+// Acon.f over each acoustic frequency of -F, scales the displacement terms
+__constant__ float gfreq[MAX_FREQS];
 
 // kernel constant parameters
 __constant__ MCXParam gcfg[1];
@@ -103,11 +110,92 @@ __device__ inline void savecache(float *data,float *cache){
 }
 #endif
 
+//MTA. Modulation depth and phase of the accumulated AO sums, only evaluated
+// where they are consumed (fluence deposit, detector, end of the kernel)
+__device__ inline void getmodulation(const MCXAO *ao_sums,Modulation *mod){
+      float re=ao_sums->Pncosi+ao_sums->Pdcosj;
+      float im=-ao_sums->Pnsini-ao_sums->Pdsinj;
+      float phi=(re!=0.f) ? atanf(im/re) : copysignf(ONE_PI/2.f,im);
+
+      if(re<0.f)
+          phi+=(im>=0.f) ? ONE_PI : -ONE_PI;
+      if((re==0.f && im==0.f) || phi!=phi){
+          *((float2*)mod)=float2(0.f,0.f);
+          return;
+      }
+      *((float2*)mod)=float2(sqrtf(re*re+im*im),phi);
+}
+
+/*
+   modulation of the v-th variant, the phase v/freqnum of the sweep at the
+   frequency v%freqnum: the AO terms are linear in P*cos(USphase) and
+   P*sin(USphase), shifting the ultrasound phase by an offset rotates
+   Pncosi/Pnsini, Pdcosj and the rotating part of Pdsinj; the displacement
+   terms scale with aokj~1/f, Pdsinj0 and the index terms do not
+*/
+__device__ inline void phasemodulation(const MCXAO *ao_sums,const MCXAOSweep *ao_sweep,uint v,Modulation *mod){
+      MCXAO ao;
+      float2 cs=float2(1.f,0.f);
+      float r=1.f;
+      if(!gcfg->issweep){
+          getmodulation(ao_sums,mod);
+          return;
+      }
+      if(gcfg->freqnum){
+          r=gfreq[v%gcfg->freqnum];
+          v/=gcfg->freqnum;
+      }
+      if(gcfg->phasenum)
+          cs=gphase[v];
+      ao.Pncosi=ao_sums->Pncosi*cs.x+ao_sums->Pnsini*cs.y;
+      ao.Pnsini=ao_sums->Pnsini*cs.x-ao_sums->Pncosi*cs.y;
+      ao.Pdcosj=(ao_sums->Pdcosj*cs.x+ao_sweep->Pdcosjq*cs.y)*r;
+      ao.Pdsinj=(ao_sweep->Pdsinjr*cs.x-ao_sweep->Pdsinjq*cs.y)*r+ao_sweep->Pdsinj0;
+      getmodulation(&ao,mod);
+}
+
+/*
+   deposits the weight w at fieldidx, J0^2 to the carrier and 2*Jn^2 to the
+   n-th sideband (see mcx_bessel.h) for each sideband of gcfg->sidebands at a
+   stride of gcfg->bandstride, once per variant at a stride of gcfg->fieldstride
+*/
+__device__ inline void savefield(float field[],uint fieldidx,float w,const MCXAO *ao_sums,const MCXAOSweep *ao_sweep){
+      Modulation mod;
+      float j0,j1;
+      uint v=0,n,bands,idx;
+      do{
+          phasemodulation(ao_sums,ao_sweep,v,&mod);
+          mcx_besselj01(mod.magnitude,&j0,&j1);
+          for(bands=gcfg->sidebands,n=0,idx=fieldidx;bands;bands>>=1,n++){
+              if(!(bands&1))
+                  continue;
+#ifdef USE_ATOMIC
+              atomicadd(field+idx,w*mcx_aoweight(n,mod.magnitude,j0,j1));
+#else
+              field[idx]+=w*mcx_aoweight(n,mod.magnitude,j0,j1);
+#endif
+              idx+=gcfg->bandstride;
+          }
+          fieldidx+=gcfg->fieldstride;
+      }while(++v<gcfg->variantnum);
+}
+
 //MTA. This sets every detector voxel equal to the detector number. (Others are 0)
 #ifdef SAVE_DETECTORS
-__device__ inline uint finddetector(MCXpos *p0){
-      uint i;
-      for(i=0;i<gcfg->detnum;i++){
+/*
+   only the detectors listed in the lookup cell of p0 are tested, the list
+   is in ascending order so the first match is the same as a scan over all
+*/
+__device__ inline uint finddetector(MCXpos *p0,const uint detgrid[]){
+      uint i,j,end;
+      float cx=(p0->x-gcfg->detgridorig.x)*gcfg->detgridscale;
+      float cy=(p0->y-gcfg->detgridorig.y)*gcfg->detgridscale;
+      float cz=(p0->z-gcfg->detgridorig.z)*gcfg->detgridscale;
+      if(!(cx>=0.f && cy>=0.f && cz>=0.f && cx<gcfg->detgriddim.x && cy<gcfg->detgriddim.y && cz<gcfg->detgriddim.z))
+          return 0;   /*outside of the grid, not in any detector*/
+      j=((uint)cz*gcfg->detgriddim.y+(uint)cy)*gcfg->detgriddim.x+(uint)cx;
+      for(end=detgrid[j+1],j=detgrid[j];j<end;j++){
+        i=detgrid[j];
       	if((gdetpos[i].x-p0->x)*(gdetpos[i].x-p0->x)+
 	   (gdetpos[i].y-p0->y)*(gdetpos[i].y-p0->y)+
 	   (gdetpos[i].z-p0->z)*(gdetpos[i].z-p0->z) < gdetpos[i].w*gdetpos[i].w){
@@ -118,18 +206,23 @@ __device__ inline uint finddetector(MCXpos *p0){
 }
 
 //MTA. Saves photon variables when they reach a detector
-__device__ inline void savedetphoton(float n_det[],uint *detectedphoton,float weight,Modulation *Modulations, float *ppath,MCXpos *p0){  //MTA Changed 6/18/12,6/20/12
-      uint j,baseaddr=0;
-      j=finddetector(p0);
+__device__ inline void savedetphoton(float n_det[],uint *detectedphoton,float weight,const MCXAO *ao_sums,const MCXAOSweep *ao_sweep,
+                                     float *ppath,MCXpos *p0,const uint detgrid[]){  //MTA Changed 6/18/12,6/20/12
+      uint j,k=0,baseaddr=0;
+      Modulation mod;
+      j=finddetector(p0,detgrid);
       if(j){
 	 baseaddr=atomicAdd(detectedphoton,1);
 	 // MTA. These parameters are variables carried by the photon the whole way
 	 if(baseaddr<gcfg->maxdetphoton){
-	    baseaddr*=gcfg->maxmedia+4;  //MTA. Change the last integer to be the # of photon specific variables you need to save
+	    baseaddr*=gcfg->reclen;  //MTA. maxmedia+2+2*phases, the # of photon specific variables you need to save
 	    n_det[baseaddr++]=j;		// MTA. This is the detector number
 	    n_det[baseaddr++]=weight;  //MTA. The "weight" variable here is actually total number of scattering events.
-		n_det[baseaddr++]=Modulations->magnitude;  //MTA Magnitude of phase modulations
-		n_det[baseaddr++]=Modulations->phi;  	//MTA Phase angle of phase modulations
+		do{  //MTA one pair per phase and frequency
+		    phasemodulation(ao_sums,ao_sweep,k,&mod);
+		    n_det[baseaddr++]=mod.magnitude;  //MTA Magnitude of phase modulations
+		    n_det[baseaddr++]=mod.phi;  	//MTA Phase angle of phase modulations
+		}while(++k<gcfg->variantnum);
 		//MTA. Photon parameter for each media type
 	    for(j=0;j<gcfg->maxmedia;j++){
 		n_det[baseaddr+j]=ppath[j]; // save partial pathlength to the memory
@@ -141,10 +234,203 @@ __device__ inline void savedetphoton(float n_det[],uint *detectedphoton,float we
 #endif
 
 
-//MTA. Launches a new photon
-__device__ inline void launchnewphoton(MCXpos *p,MCXdir *v,MCXtime *f,MCXAO *ao_sums, Modulation *mod, 
-		Medium *prop,Acoustics *pressure, Aconstants *Acon, Oconstants *Ocon, uint *idx1d,		//MTA
-        uchar *mediaid,uchar isdet, float ppath[],float energyloss[],float n_det[],uint *dpnum) {		//MTA
+/*
+   fold one acoustic record into the AO terms used by the transport loop,
+   same as mcx_aocoef() on the host
+*/
+__device__ inline void aocoef(Acoustics *pressure,AOCoef *aoc){
+      float Pmag,sphase,cphase;
+      if(pressure->Px>EPS || pressure->Py>EPS || pressure->Pz>EPS){
+          Pmag=sqrtf(pressure->Px*pressure->Px + pressure->Py*pressure->Py + pressure->Pz*pressure->Pz);
+          sincosf(pressure->USphase,&sphase,&cphase);
+          *((float4*)(aoc))=float4(pressure->Px*sphase,pressure->Py*sphase,pressure->Pz*sphase,Pmag*cphase);
+          *((float4*)(aoc)+1)=float4(pressure->Px*cphase,pressure->Py*cphase,pressure->Pz*cphase,-Pmag*sphase);
+      }else{
+          *((float4*)(aoc))=float4(0.f,0.f,0.f,0.f);
+          *((float4*)(aoc)+1)=float4(0.f,0.f,0.f,0.f);
+      }
+}
+
+/*
+   AO terms of the voxel at p. the acoustic field only stores the bounding
+   box of the insonified voxels, media_acous[] is indexed relative to
+   gcfg->acorig; voxels outside of the box see no pressure. media_acous[]
+   holds 2 float4 per voxel if gcfg->aotable is set (precomputed AOCoef),
+   8-byte quantized records (short4) if gcfg->acscale>0, float4 otherwise
+*/
+__device__ inline void getacoustics(const float4 media_acous[],MCXpos *p,uchar mediaid,AOCoef *aoc){
+      uint ix=int(floorf(p->x))-gcfg->acorig.x;
+      uint iy=int(floorf(p->y))-gcfg->acorig.y;
+      uint iz=int(floorf(p->z))-gcfg->acorig.z;
+      if(mediaid!=0 && ix<gcfg->acdim.x && iy<gcfg->acdim.y && iz<gcfg->acdim.z){
+        Acoustics pressure;
+        ix=(iz*gcfg->acdim.y+iy)*gcfg->acdim.x+ix;
+        if(gcfg->aotable){
+            *((float4*)(aoc))=media_acous[ix<<1];
+            *((float4*)(aoc)+1)=media_acous[(ix<<1)+1];
+            return;
+        }
+        if(gcfg->acscale>0.f){
+            short4 q=((const short4 *)media_acous)[ix];
+            pressure.Px=q.x*gcfg->acscale;
+            pressure.Py=q.y*gcfg->acscale;
+            pressure.Pz=q.z*gcfg->acscale;
+            pressure.USphase=(ushort)q.w*(TWO_PI/65536.f);
+        }else
+     	    *((float4*)(&pressure))=media_acous[ix];
+        aocoef(&pressure,aoc);
+      }else{
+        *((float4*)(aoc))=float4(0.f,0.f,0.f,0.f);
+        *((float4*)(aoc)+1)=float4(0.f,0.f,0.f,0.f);
+      }
+}
+
+/*
+   fluence deposit of the current step, at most one per minaccumtime*n of
+   photon time; the weight near the source is tallied in the cachebox or in
+   accumweight when gcfg->skipradius2 is set, cc counts the deposits with
+   TEST_RACING
+*/
+__device__ inline void savefluence(float field[],float cachebox[],float *accumweight,float *energyabsorbed,int *cc,
+        MCXpos *p,MCXtime *f,Medium *prop,uint idx1d,const MCXAO *ao_sums,const MCXAOSweep *ao_sweep){
+	  if(f->t>=f->tnext){
+             GPUDEBUG(("field add to %d->%f(%d)  t(%e)>t0(%e)\n",idx1d,p->w,(int)f->ndone,f->t,f->tnext));
+             // if t is within the time window, which spans cfg->maxgate*cfg->tstep wide
+             if(gcfg->save2pt && f->t>=gcfg->twin0 && f->t<gcfg->twin1){
+                  *energyabsorbed+=p->w*prop->mua;
+#ifdef TEST_RACING
+                  // enable TEST_RACING to determine how many missing accumulations due to race
+                  if( (p->x-gcfg->ps.x)*(p->x-gcfg->ps.x)+(p->y-gcfg->ps.y)*(p->y-gcfg->ps.y)+(p->z-gcfg->ps.z)*(p->z-gcfg->ps.z)>gcfg->skipradius2) {
+                      field[idx1d+(int)(floorf((f->t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=1.f;
+		      (*cc)++;
+                  }
+#else
+  #ifndef USE_ATOMIC
+                  // set gcfg->skipradius2 to only start depositing energy when dist^2>gcfg->skipradius2 
+                  if(gcfg->skipradius2>EPS){
+  #ifdef  USE_CACHEBOX
+                      if(p->x<gcfg->cp1.x+1.f && p->x>=gcfg->cp0.x &&
+		         p->y<gcfg->cp1.y+1.f && p->y>=gcfg->cp0.y &&
+			 p->z<gcfg->cp1.z+1.f && p->z>=gcfg->cp0.z){
+                         atomicadd(cachebox+(int(p->z-gcfg->cp0.z)*gcfg->cachebox.y
+			      +int(p->y-gcfg->cp0.y)*gcfg->cachebox.x+int(p->x-gcfg->cp0.x)),p->w);
+  #else
+                      if((p->x-gcfg->ps.x)*(p->x-gcfg->ps.x)+(p->y-gcfg->ps.y)*(p->y-gcfg->ps.y)+(p->z-gcfg->ps.z)*(p->z-gcfg->ps.z)<=gcfg->skipradius2){
+                          *accumweight+=p->w*prop->mua; // weight*absorption
+  #endif
+                      }else{
+                          savefield(field,idx1d+(int)(floorf((f->t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z,p->w,ao_sums,ao_sweep);
+                      }
+                  }else{
+                      savefield(field,idx1d+(int)(floorf((f->t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z,p->w,ao_sums,ao_sweep);
+                  }
+  #else
+                  // ifndef CUDA_NO_SM_11_ATOMIC_INTRINSICS, savefield() adds atomically
+		  savefield(field,idx1d+(int)(floorf((f->t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z,p->w,ao_sums,ao_sweep);
+  #endif
+#endif
+	     }
+             f->tnext+=gcfg->minaccumtime*prop->n; // fluence is a temporal-integration, unit=s
+	  }
+}
+
+/*
+   fluence deposits of a straight step ending at p in the DDA mode (-j): a
+   step may pass several sampling times before tlim, each one is deposited
+   at the position and weight traced back along v, in the voxel it lies in
+*/
+__device__ inline void savesegment(float field[],float cachebox[],float *accumweight,float *energyabsorbed,int *cc,
+        MCXpos *p,MCXdir *v,MCXtime *f,Medium *prop,float tlim,const MCXAO *ao_sums,const MCXAOSweep *ao_sweep){
+	  MCXpos p1;
+	  MCXtime f1=*f;
+	  float back;
+	  while(f->tnext<=f->t && f->tnext<tlim){
+	     back=(f->t-f->tnext)/(prop->n*gcfg->oneoverc0); // unit=grid
+	     *((float4*)(&p1))=float4(p->x-v->x*back,p->y-v->y*back,p->z-v->z*back,p->w*expf(prop->mua*back));
+	     f1.t=f1.tnext=f->tnext;
+	     if(p1.x>=0.f&&p1.y>=0.f&&p1.z>=0.f&&p1.x<gcfg->maxidx.x&&p1.y<gcfg->maxidx.y&&p1.z<gcfg->maxidx.z)
+	         savefluence(field,cachebox,accumweight,energyabsorbed,cc,&p1,&f1,prop,
+	               int(floorf(p1.z))*gcfg->dimlen.y+int(floorf(p1.y))*gcfg->dimlen.x+int(floorf(p1.x)),ao_sums,ao_sweep);
+	     f->tnext+=gcfg->minaccumtime*prop->n;
+	  }
+}
+
+/*
+   a (cos,sin) pair from a row of the scattering angle tables (-Q): the
+   uniform number u falls between two entries, the interpolated pair is put
+   back on the unit circle, see mcx_buildscattable()
+*/
+__device__ inline void scatlut(const float2 table[],float u,float *c,float *s){
+      float x=u*SCAT_LUT_LEN,r;
+      int i=min((int)x,SCAT_LUT_LEN-1);
+      float2 a=table[i],b=table[i+1];
+      x-=i;
+      *c=a.x+x*(b.x-a.x);
+      *s=a.y+x*(b.y-a.y);
+      r=rsqrtf((*c)*(*c)+(*s)*(*s));
+      *c*=r;
+      *s*=r;
+}
+
+/*
+   stores a photon that outlived the time window (-D) for the next window,
+   the caller relaunches the thread with launchnewphoton() which books the
+   parked weight as lost; the photon index takes the place of f.ndone
+*/
+__device__ inline void parkphoton(float n_park[],uint *parkcount,MCXpos *p,MCXdir *v,MCXtime *f,
+        MCXAO *ao_sums,MCXAOSweep *ao_sweep,float ppath[],uint photonid){
+      uint i,base=atomicAdd(parkcount,1)*gcfg->parkreclen;
+      float4 *rec=(float4 *)(n_park+base);
+      rec[0]=*((float4*)p);
+      rec[1]=*((float4*)v);
+      rec[2]=float4(f->pscat,f->t,f->tnext,__int_as_float((int)photonid));
+      rec[3]=*((float4*)ao_sums);
+      rec[4]=*((float4*)ao_sweep);
+      if(gcfg->savedet)
+          for(i=0;i<gcfg->maxmedia;i++)
+              n_park[base+(sizeof(MCXParked)>>2)+i]=ppath[i];
+}
+
+/*
+   loads a parked photon in a resumed window (-D), the medium is looked up
+   from its position and the weight taken back from the loss tally
+*/
+__device__ inline void resumephoton(const float rec[],MCXpos *p,MCXdir *v,MCXtime *f,MCXAO *ao_sums,MCXAOSweep *ao_sweep,
+        Modulation *mod,Medium *prop,AOCoef *aoc,const float4 media_acous[],const uchar media[],uint *idx1d,uchar *mediaid,
+        float ppath[],float *energyloss,uint *photonid){
+      uint i;
+      float ndone=f->ndone;
+      *((float4*)p)=((const float4 *)rec)[0];
+      *((float4*)v)=((const float4 *)rec)[1];
+      *((float4*)f)=((const float4 *)rec)[2];
+      *((float4*)ao_sums)=((const float4 *)rec)[3];
+      *((float4*)ao_sweep)=((const float4 *)rec)[4];
+      *photonid=(uint)__float_as_int(f->ndone);
+      f->ndone=ndone;
+      *((float2*)mod)=float2(0.f,0.f);
+      if(gcfg->savedet)
+          for(i=0;i<gcfg->maxmedia;i++)
+              ppath[i]=rec[(sizeof(MCXParked)>>2)+i];
+      *energyloss-=p->w;
+      *idx1d=(int(floorf(p->z))*gcfg->dimlen.y+int(floorf(p->y))*gcfg->dimlen.x+int(floorf(p->x)));
+      *mediaid=(media[*idx1d] & MED_MASK);
+      *((float4*)(prop))=gproperty[*mediaid];
+      getacoustics(media_acous,p,*mediaid,aoc);
+}
+
+/*
+   MTA. Launches a new photon, or in a resumed window (-D) loads the next parked one of this thread;
+   with -V the next photon or parked record is the one claimed from photonpool, and nquota is
+   cut to the photons done so far once the launch is used up, or once the detected photon
+   buffer reaches detlimit, the host then saves the buffer and relaunches the rest
+*/
+__device__ inline void launchnewphoton(MCXpos *p,MCXdir *v,MCXtime *f,MCXAO *ao_sums,MCXAOSweep *ao_sweep, Modulation *mod, 
+		Medium *prop,AOCoef *aoc, const float4 media_acous[], Aconstants *Acon, Oconstants *Ocon, uint *idx1d,		//MTA
+        uchar *mediaid,uchar isdet, float ppath[],float energyloss[],float n_det[],uint *dpnum,const uint detgrid[],
+        const uchar media[],const float n_parkin[],int *nquota,uint photonpool[],RandType t[RAND_BUF_LEN],RandType tnew[RAND_BUF_LEN],
+        uint *photonid) {		//MTA
+
+      uint next=*photonid+1;  // index of the next photon
 
       *energyloss+=p->w;  // sum all the remaining energy
       
@@ -152,27 +438,46 @@ __device__ inline void launchnewphoton(MCXpos *p,MCXdir *v,MCXtime *f,MCXAO *ao_
 #ifdef SAVE_DETECTORS
       // let's handle detectors here
       if(gcfg->savedet){
-         if(*mediaid==0 && isdet)
-	     savedetphoton(n_det,dpnum,v->nscat,mod,ppath,p);  //MTA
+         if(*mediaid==0 && isdet){
+	     savedetphoton(n_det,dpnum,v->nscat,ao_sums,ao_sweep,ppath,p,detgrid);  //MTA
+	 }
 	 clearpath(ppath,gcfg->maxmedia);			
       }
+      // each thread has one photon in flight, the rest of the buffer above detlimit holds them all
+      if(gcfg->savedet && *((volatile uint *)dpnum)>=gcfg->detlimit)
+          *nquota=(int)f->ndone+1;
+      else
 #endif
+      if(gcfg->dynamic){
+          next=atomicAdd(photonpool,1);
+          if(next>=photonpool[1])  // the launch is used up, this thread stops after the current photon
+              *nquota=(int)f->ndone+1;
+      }
+
+      if(gcfg->resume && f->ndone+1.f<*nquota){
+          f->ndone++;
+          resumephoton(n_parkin+(gcfg->dynamic ? next :
+                (blockDim.x*blockIdx.x+threadIdx.x)+(uint)f->ndone*blockDim.x*gridDim.x)*gcfg->parkreclen,
+                p,v,f,ao_sums,ao_sweep,mod,prop,aoc,media_acous,media,idx1d,mediaid,ppath,energyloss,photonid);
+          rand_photon_start(t,tnew,*photonid);
+          return;
+      }
 
  	  *((float4*)p)=gcfg->ps;
       *((float4*)v)=gcfg->c0;
       *((float4*)f)=float4(0.f,0.f,gcfg->minaccumtime,f->ndone+1);
       *((float2*)mod)=float2(0.f,0.f);  		//MTA
 	  *((float4*)ao_sums)=float4(0.f,0.f,0.f,0.f);  //MTA
+	  *((float4*)ao_sweep)=float4(0.f,0.f,0.f,0.f);
       *idx1d=gcfg->idx1dorig;
       *mediaid=gcfg->mediaidorig;
       *((float4*)(prop))=gproperty[*mediaid]; //always use mediaid to read gproperty[]
 	  //MTA added all below
-	  if(mediaid!=0){
-     	*((float4*)(pressure))=gmedia_acous[*idx1d]; 
-      }else{*((float4*)(pressure))=float4(0.f,0.f,0.f,0.f);}	
+	  getacoustics(media_acous,p,*mediaid,aoc);
 	  *((float3*)(Acon))=gAcon;
   	  *((float2*)(Ocon))=gOcon;
-	
+      *photonid=next;
+      rand_photon_start(t,tnew,*photonid);
 }
 
 
@@ -182,16 +487,22 @@ __device__ inline void launchnewphoton(MCXpos *p,MCXdir *v,MCXtime *f,MCXAO *ao_
    everything in the GPU kernels is in grid-unit. To convert back to length, use
    cfg->unitinmm (scattering/absorption coeff, T, speed etc)
 */
-kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_acous[], float field0[],		//MTA
-     float field1[], float genergy[],uint n_seed[],float4 n_pos[],float4 n_dir[],float4 n_len[],
-     float n_det[], float4 n_AO_sums[], float2 n_mod[], uint *detectedphoton){		//MTA
+kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_acous[], float field[],		//MTA
+     float genergy[],uint n_seed[],float4 n_pos[],float4 n_dir[],float4 n_len[],
+     float n_det[], float4 n_AO_sums[], float4 n_AO_sweep[], float2 n_mod[], uint *detectedphoton,const uint detgrid[],
+     const float n_parkin[], float n_parkout[], uint *parkcount,const float2 scattable[],uint photonpool[],uint n_steps[],
+     int relaunch){		//MTA
 
      int idx= blockDim.x * blockIdx.x + threadIdx.x;
+     int nquota=(idx<ophoton?nphoton+1:nphoton);  //photons of this thread, parked ones in a resumed window
+     uint photonid=idx*nphoton+MIN(idx,ophoton);   //index of the photon in this launch, the stream of a counter-based RNG
+     uint nstep=0;   //loop iterations of this thread, for the utilization report
 
      MCXpos  p,p0;//{x,y,z}: coordinates in grid unit, w:packet weight
      MCXdir  v;   //{x,y,z}: unitary direction vector in grid unit, nscat:total scat event
      MCXtime f;   //pscat: remaining scattering probability,t: photon elapse time, 
 	 MCXAO	ao_sums;  //MTA AO properties for each photon
+	 MCXAOSweep ao_sweep;  //MTA extra sums of the phase/frequency sweep, only updated if gcfg->issweep
 	 Modulation mod;	//MTA Tracks AO phase modulation terms
 
      float  energyloss=genergy[idx<<1];
@@ -199,10 +510,9 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 
      uint idx1d, idx1dold;   //idx1dold is related to reflection
      float3 htime;            //reflection var
+     float  ddalen=0.f,ddaflip=0.f;  //distance to the voxel face or end of the last step and the axis of that face, -j
 
-#ifdef TEST_RACING
-     int cc=0;
-#endif
+     int cc=0;   //deposits outside of skipradius, only counted with TEST_RACING
 
      uchar  mediaid,mediaidold;	//MTA changed 6/26/12 to accomodate more medium types
      char   medid=-1;		
@@ -212,12 +522,12 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
      //for MT RNG, these will be zero-length arrays and be optimized out
      RandType t[RAND_BUF_LEN],tnew[RAND_BUF_LEN];
      Medium prop;    //can become float2 if no reflection (mua/musp is in 1/grid unit)
-	 Acoustics pressure;  //MTA
+	 AOCoef aoc;  //MTA per-voxel AO terms, see getacoustics()
  	 Aconstants Acon;	//MTA
 	 Oconstants Ocon;	//MTA
 
      float len,cphi,sphi,theta,stheta,ctheta,tmp0,tmp1;
-	 float rPmag,Pmag,xdiff,ydiff,zdiff, dot_a_o, cosj_inc, sinj_inc, cosi_inc, sini_inc; //MTA
+	 float xdiff,ydiff,zdiff, cosj_inc, sinj_inc, cosi_inc, sini_inc; //MTA
 
      float *ppath=sharedmem;
 
@@ -230,8 +540,9 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
   #endif
      if(gcfg->skipradius2>EPS) clearcache(cachebox,(gcfg->cp1.x-gcfg->cp0.x+1)*(gcfg->cp1.y-gcfg->cp0.y+1)*(gcfg->cp1.z-gcfg->cp0.z+1));
 #else
-     float accumweight=0.f;
+     float *cachebox=NULL;
 #endif
+     float accumweight=0.f;
 
 
 #ifdef  SAVE_DETECTORS
@@ -239,11 +550,19 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 #endif
 
 
-     *((float4*)(&p))=n_pos[idx];
-     *((float4*)(&v))=n_dir[idx];
-     *((float4*)(&f))=n_len[idx];
-	 *((float4*)(&ao_sums))=n_AO_sums[idx];  //MTA
-	 *((float2*)(&mod))=n_mod[idx];  //MTA
+     // every thread starts from the source, n_pos etc. only return the final states
+     *((float4*)(&p))=gcfg->ps;
+     *((float4*)(&v))=gcfg->c0;
+     *((float4*)(&f))=float4(0.f,0.f,gcfg->minaccumtime,0.f);
+	 *((float4*)(&ao_sums))=float4(0.f,0.f,0.f,0.f);  //MTA
+	 *((float4*)(&ao_sweep))=float4(0.f,0.f,0.f,0.f);
+	 *((float2*)(&mod))=float2(0.f,0.f);  //MTA
+
+     // a relaunch after a full detected photon buffer continues from the photons this thread has done
+     if(relaunch){
+          f.ndone=n_len[idx].w;
+          photonid+=(uint)f.ndone;
+     }
 
 
      gpu_rng_init(t,tnew,n_seed,idx);
@@ -260,11 +579,26 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 	
      *((float4*)(&prop))=gproperty[mediaid]; //always use mediaid to read gproperty - MTA. This sets the prop equal to the medium properties.
      //MTA Added all below
-     if(mediaid!=0){
-     	*((float4*)(&pressure))=gmedia_acous[idx1d];
-     }else{*((float4*)(&pressure))=float4(0.f,0.f,0.f,0.f);}
+     getacoustics(media_acous,&p,mediaid,&aoc);
 	 *((float3*)(&Acon))=gAcon;
   	 *((float2*)(&Ocon))=gOcon;
+
+     // with -V, photonpool={next photon, photons of the launch} hands out photons until none is left
+     if(gcfg->dynamic){
+          photonid=atomicAdd(photonpool,1);
+          nquota=(photonid<photonpool[1] ? DYNAMIC_QUOTA : 0);
+     }
+
+     // a resumed window (-D) starts from the first parked photon of this thread, which owes the deposit of its last step
+     if(gcfg->resume && f.ndone<nquota){
+          resumephoton(n_parkin+(gcfg->dynamic ? photonid : idx+(uint)f.ndone*blockDim.x*gridDim.x)*gcfg->parkreclen,&p,&v,&f,&ao_sums,&ao_sweep,&mod,&prop,&aoc,media_acous,media,
+                &idx1d,&mediaid,ppath,&energyloss,&photonid);
+          if(gcfg->dda)
+              savesegment(field,cachebox,&accumweight,&energyabsorbed,&cc,&p,&v,&f,&prop,VERY_BIG,&ao_sums,&ao_sweep);
+          else
+              savefluence(field,cachebox,&accumweight,&energyabsorbed,&cc,&p,&f,&prop,idx1d,&ao_sums,&ao_sweep);
+     }
+     rand_photon_start(t,tnew,photonid);
      
 	/*
       using a while-loop to terminate a thread by np will cause MT RNG to be 3.5x slower
@@ -275,8 +609,8 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
      */
 
 //MTA. This is the main loop that executes the photon propagation through the medium.
-     while(f.ndone<(idx<ophoton?nphoton+1:nphoton)) {
-	
+     while(f.ndone<nquota) {
+          nstep++;
 	
           GPUDEBUG(("*i= (%d) L=%f w=%e a=%f\n",(int)f.ndone,f.pscat,p.w,f.t));
 
@@ -288,6 +622,10 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 
                GPUDEBUG(("next scat len=%20.16e \n",f.pscat));
 	       if(p.w<1.f){ // if this is not my first jump
+                       if(gcfg->scatlut){  // both angles from the tables, row 0 is the azimuth, row mediaid+1 the medium
+                           scatlut(scattable,rand_next_aangle(t),&cphi,&sphi);
+                           scatlut(scattable+(mediaid+1)*(SCAT_LUT_LEN+1),rand_next_zangle(t),&ctheta,&stheta);
+                       }else{
                        //random azimuthal angle
                        tmp0=TWO_PI*rand_next_aangle(t); //next azimuth angle
                        sincosf(tmp0,&sphi,&cphi);  //MTA sphi is sin of azimuthal angle, cphi is cosine
@@ -314,6 +652,7 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
                            sincosf(theta,&stheta,&ctheta);
                        }
                        GPUDEBUG(("next scat angle theta %20.16e\n",theta));
+                       }
                        
                        
 		       if( v.z>-1.f+EPS && v.z<1.f-EPS ) {
@@ -325,26 +664,27 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 		           
 		           
 				//	MTA This is where phase modulations due to scatterer displacement are calculated
-				rPmag = rsqrtf(pressure.Px*pressure.Px + pressure.Py*pressure.Py + pressure.Pz*pressure.Pz);
-				Pmag = sqrtf(pressure.Px*pressure.Px + pressure.Py*pressure.Py + pressure.Pz*pressure.Pz); 
 				xdiff = v.x - (tmp1*(v.x*v.z*cphi - v.y*sphi) + v.x*ctheta);		
 				ydiff = v.y - (tmp1*(v.y*v.z*cphi + v.x*sphi) + v.y*ctheta);		
 				zdiff = v.z - (-tmp1*tmp0*cphi + v.z*ctheta);						
-				dot_a_o = pressure.Px*rPmag*xdiff + pressure.Py*rPmag*ydiff + pressure.Pz*rPmag*zdiff;		
 			
 				// MTA phase modulation terms			
-				cosj_inc = TWO_PI/(Ocon.lambda) * prop.n / (TWO_PI*Acon.f*(Acon.rho)*(Acon.va)) * dot_a_o * Pmag * sinf(pressure.USphase);
-				sinj_inc = TWO_PI/(Ocon.lambda) * prop.n; 
+				cosj_inc = gcfg->aokj * prop.n * (aoc.Sx*xdiff + aoc.Sy*ydiff + aoc.Sz*zdiff);
+				sinj_inc = gcfg->aosinj * prop.n; 
 				
 				
 				// MTA sum phase modulation terms						
-				if(pressure.Px>EPS || pressure.Py>EPS || pressure.Pz>EPS){											
+				if(aoc.Ci!=0.f || aoc.Si!=0.f){											
 						*((float4*)(&ao_sums))=float4(
 											ao_sums.Pncosi,
 											ao_sums.Pnsini,
 											ao_sums.Pdcosj + cosj_inc,
 											ao_sums.Pdsinj + sinj_inc
 											);
+						if(gcfg->issweep){
+							ao_sweep.Pdcosjq+=gcfg->aokj * prop.n * (aoc.Cx*xdiff + aoc.Cy*ydiff + aoc.Cz*zdiff);
+							ao_sweep.Pdsinj0+=sinj_inc;
+						}
 				 }					
 						// MTA New scattering direction				
 		        		*((float4*)(&v))=float4(
@@ -359,22 +699,24 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 				       		xdiff = v.x - stheta*cphi;		
 							ydiff = v.y - stheta*sphi;		
 							zdiff = (v.z>0.f)?(v.z-ctheta):(v.z+ctheta);
-							rPmag = rsqrtf(pressure.Px*pressure.Px + pressure.Py*pressure.Py + pressure.Pz*pressure.Pz);
-							Pmag = sqrtf(pressure.Px*pressure.Px + pressure.Py*pressure.Py + pressure.Pz*pressure.Pz) + EPS;
-							dot_a_o = pressure.Px*rPmag*xdiff + pressure.Py*rPmag*ydiff + pressure.Pz*rPmag*zdiff;		
-							
 
-							cosj_inc = TWO_PI/(Ocon.lambda) * prop.n / (TWO_PI*Acon.f*(Acon.rho)*(Acon.va)) * dot_a_o * Pmag * sinf(pressure.USphase);
-							sinj_inc = TWO_PI/(Ocon.lambda) * prop.n / (TWO_PI*Acon.f*(Acon.rho)*(Acon.va)) * dot_a_o * Pmag * cosf(pressure.USphase);
+
+							cosj_inc = gcfg->aokj * prop.n * (aoc.Sx*xdiff + aoc.Sy*ydiff + aoc.Sz*zdiff);
+							sinj_inc = gcfg->aokj * prop.n * (aoc.Cx*xdiff + aoc.Cy*ydiff + aoc.Cz*zdiff);
 
 						
-				if(pressure.Px>EPS || pressure.Py>EPS || pressure.Pz>EPS){		
+				if(aoc.Ci!=0.f || aoc.Si!=0.f){		
 						*((float4*)(&ao_sums))=float4(
 											ao_sums.Pncosi,
 											ao_sums.Pnsini,
 											ao_sums.Pdcosj + cosj_inc,
 											ao_sums.Pdsinj + sinj_inc
 											);	
+						if(gcfg->issweep){  // the C-terms rotate into Pdcosj, the S-terms into Pdsinj
+							ao_sweep.Pdcosjq+=sinj_inc;
+							ao_sweep.Pdsinjq+=cosj_inc;
+							ao_sweep.Pdsinjr+=sinj_inc;
+						}
 					}						
 							
 					   *((float4*)(&v))=float4(stheta*cphi,stheta*sphi,(v.z>0.f)?ctheta:-ctheta,v.nscat);
@@ -390,16 +732,36 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
           n1=prop.n;
 	  *((float4*)(&prop))=gproperty[mediaid];
 	  // MTA Added all below
-  	  if(mediaid!=0){
-     	*((float4*)(&pressure))=gmedia_acous[idx1d]; 
-     }else{*((float4*)(&pressure))=float4(0.f,0.f,0.f,0.f);}
+  	  getacoustics(media_acous,&p,mediaid,&aoc);
 	  len=gcfg->minstep*prop.mus; //unitless (minstep=grid, mus=1/grid)
-	  Pmag = sqrtf(pressure.Px*pressure.Px + pressure.Py*pressure.Py + pressure.Pz*pressure.Pz);
 
           // dealing with absorption
 
           p0=p;
-	  if(len>f.pscat){  //scattering ends in this voxel: mus*gcfg->minstep > s 
+	  if(gcfg->dda){  //step to the nearest voxel face, or to the scattering site if it comes first
+               htime.x=(v.x>EPS||v.x<-EPS)?(floorf(p.x)+(v.x>0.f)-p.x)/v.x:VERY_BIG;
+               htime.y=(v.y>EPS||v.y<-EPS)?(floorf(p.y)+(v.y>0.f)-p.y)/v.y:VERY_BIG;
+               htime.z=(v.z>EPS||v.z<-EPS)?(floorf(p.z)+(v.z>0.f)-p.z)/v.z:VERY_BIG;
+               ddalen=fminf(fminf(htime.x,htime.y),htime.z);
+               ddaflip=(ddalen==htime.x?1.f:(ddalen==htime.y?2.f:3.f));
+               tmp0=f.pscat/prop.mus; // unit=grid
+               if(tmp0<=ddalen){  //scattering ends in this voxel
+                    ddalen=tmp0;
+                    f.pscat=SAME_VOXEL;
+               }else{              //cross the face, the nudge keeps the next voxel index exact
+                    tmp0=ddalen+DDA_NUDGE;
+                    f.pscat-=tmp0*prop.mus;
+               }
+   	       *((float4*)(&p))=float4(p.x+v.x*tmp0,p.y+v.y*tmp0,p.z+v.z*tmp0,p.w*expf(-prop.mua*tmp0));
+               *((float4*)(&ao_sums))=float4(ao_sums.Pncosi+gcfg->aoki*prop.n*tmp0*aoc.Ci,
+                                             ao_sums.Pnsini+gcfg->aoki*prop.n*tmp0*aoc.Si,ao_sums.Pdcosj,ao_sums.Pdsinj);
+               f.t+=tmp0*prop.n*gcfg->oneoverc0;  //propagation time (unit=s)
+               if(gcfg->savedet) ppath[mediaid-1]+=tmp0; //(unit=grid)
+               // the whole step lies in the current medium, deposit it before the boundary changes prop or v
+               savesegment(field,cachebox,&accumweight,&energyabsorbed,&cc,&p,&v,&f,&prop,
+                     (gcfg->streamgate ? gcfg->twin1 : VERY_BIG),&ao_sums,&ao_sweep);
+               GPUDEBUG((">>dda step %f axis %d [%d] %e %e\n",tmp0,(int)ddaflip,idx1d,f.t,f.tnext));
+	  }else if(len>f.pscat){  //scattering ends in this voxel: mus*gcfg->minstep > s 
                tmp0=f.pscat/prop.mus; // unit=grid			//MTA this is the pathlength.
 		//MTA. This is where position and packet weight are updated 
    	       *((float4*)(&p))=float4(p.x+v.x*tmp0,p.y+v.y*tmp0,p.z+v.z*tmp0,
@@ -408,17 +770,16 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 
 				//MTA REFRACTIVE INDEX MODULATION ACCUMULATIONS HERE
 
-				cosi_inc = gcfg->gridunit/1000.f*TWO_PI/(Ocon.lambda) * prop.n * tmp0 * Ocon.nu / ((Acon.rho)*(Acon.va)*(Acon.va)) * Pmag * cosf(pressure.USphase);
-				sini_inc = -1.f*gcfg->gridunit/1000.f*TWO_PI/(Ocon.lambda) * prop.n * tmp0 * Ocon.nu / ((Acon.rho)*(Acon.va)*(Acon.va)) * Pmag * sinf(pressure.USphase);
+				// the AO terms are zero outside of the acoustic field, no test is needed
+				cosi_inc = gcfg->aoki * prop.n * tmp0 * aoc.Ci;
+				sini_inc = gcfg->aoki * prop.n * tmp0 * aoc.Si;
 					
-				if(pressure.Px>EPS || pressure.Py>EPS || pressure.Pz>EPS){
 				*((float4*)(&ao_sums))=float4(
 					ao_sums.Pncosi + cosi_inc,		
 					ao_sums.Pnsini + sini_inc,		
 					ao_sums.Pdcosj,	
 					ao_sums.Pdsinj		
 		   			);		//MTA added 6/29/12, changed 7/2/12
-		   			}
 
 			
 	       f.pscat=SAME_VOXEL;
@@ -435,17 +796,15 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
    	       *((float4*)(&p))=float4(p.x+v.x,p.y+v.y,p.z+v.z,p.w*atten);
    	 
 				// MTA calculate and add phase modulations
-				cosi_inc = gcfg->gridunit/1000.f*TWO_PI/(Ocon.lambda) * prop.n * gcfg->minstep * Ocon.nu / ((Acon.rho)*(Acon.va)*(Acon.va)) * Pmag * cosf(pressure.USphase);
-				sini_inc = -1.f*gcfg->gridunit/1000.f*TWO_PI/(Ocon.lambda) * prop.n * gcfg->minstep * Ocon.nu / ((Acon.rho)*(Acon.va)*(Acon.va)) * Pmag * sinf(pressure.USphase);
+				cosi_inc = gcfg->aoki * prop.n * gcfg->minstep * aoc.Ci;
+				sini_inc = gcfg->aoki * prop.n * gcfg->minstep * aoc.Si;
 				
-			if(pressure.Px>EPS || pressure.Py>EPS || pressure.Pz>EPS){
 				*((float4*)(&ao_sums))=float4(
 					ao_sums.Pncosi + cosi_inc,		
 					ao_sums.Pnsini + sini_inc,	
 					ao_sums.Pdcosj,		
 					ao_sums.Pdsinj	
 	   				);  //MTA Added 6/29/12, changed 7/2/12
-	   				}
 	
                medid=mediaid;
 	       f.pscat-=len;     //remaining probability: sum(s_i*mus_i), unit-less
@@ -454,43 +813,6 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
                GPUDEBUG((">>keep going %f<%f %f [%d] %e %e\n",f.pscat,len,prop.mus,idx1d,f.t,f.tnext));
 	  }
 
-		 //Find magnitude and phase of modulations 
-//if(f.pscat<=0.f){		 
-		if((ao_sums.Pncosi+ao_sums.Pdcosj)>0.f){		
-			*((float2*)(&mod))=float2(
-				sqrtf((ao_sums.Pncosi+ao_sums.Pdcosj)*(ao_sums.Pncosi+ao_sums.Pdcosj)+(-ao_sums.Pnsini-ao_sums.Pdsinj)*(-ao_sums.Pnsini-ao_sums.Pdsinj)), 
-				atanf((-ao_sums.Pdsinj - ao_sums.Pnsini) / (ao_sums.Pdcosj + ao_sums.Pncosi))		
-			);
-		}else if((ao_sums.Pncosi+ao_sums.Pdcosj)<0.f && (-ao_sums.Pnsini-ao_sums.Pdsinj)>=0.f){
-			*((float2*)(&mod))=float2(
-				sqrtf((ao_sums.Pncosi+ao_sums.Pdcosj)*(ao_sums.Pncosi+ao_sums.Pdcosj)+(-ao_sums.Pnsini-ao_sums.Pdsinj)*(-ao_sums.Pnsini-ao_sums.Pdsinj)), 
-				atanf((-ao_sums.Pdsinj - ao_sums.Pnsini) / (ao_sums.Pdcosj + ao_sums.Pncosi)) + ONE_PI		
-			);
-		}else if((ao_sums.Pncosi+ao_sums.Pdcosj)<0.f && (-ao_sums.Pnsini-ao_sums.Pdsinj)<0.f){
-			*((float2*)(&mod))=float2(
-				sqrtf((ao_sums.Pncosi+ao_sums.Pdcosj)*(ao_sums.Pncosi+ao_sums.Pdcosj)+(-ao_sums.Pnsini-ao_sums.Pdsinj)*(-ao_sums.Pnsini-ao_sums.Pdsinj)), 
-				atanf((-ao_sums.Pdsinj - ao_sums.Pnsini) / (ao_sums.Pdcosj + ao_sums.Pncosi)) - ONE_PI		
-			);
-		}else if((ao_sums.Pncosi+ao_sums.Pdcosj)==0.f && (-ao_sums.Pnsini-ao_sums.Pdsinj)>0.f){
-			*((float2*)(&mod))=float2(
-				sqrtf((ao_sums.Pncosi+ao_sums.Pdcosj)*(ao_sums.Pncosi+ao_sums.Pdcosj)+(-ao_sums.Pnsini-ao_sums.Pdsinj)*(-ao_sums.Pnsini-ao_sums.Pdsinj)), 
-				ONE_PI/2.f		
-			);
-		}else if((ao_sums.Pncosi+ao_sums.Pdcosj)==0.f && (-ao_sums.Pnsini-ao_sums.Pdsinj)<0.f){
-			*((float2*)(&mod))=float2(
-				sqrtf((ao_sums.Pncosi+ao_sums.Pdcosj)*(ao_sums.Pncosi+ao_sums.Pdcosj)+(-ao_sums.Pnsini-ao_sums.Pdsinj)*(-ao_sums.Pnsini-ao_sums.Pdsinj)), 
-				-ONE_PI/2.f		
-			);
-		}else{						
-			*((float2*)(&mod))=float2(
-				0,
-				0
-			);
-		}	
-//}
-		
-		
-						
           mediaidold=media[idx1d];
           idx1dold=idx1d;
           idx1d=(int(floorf(p.z))*gcfg->dimlen.y+int(floorf(p.y))*gcfg->dimlen.x+int(floorf(p.x)));
@@ -506,10 +828,17 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 		
 
           //if it hits the boundary, exceeds the max time window or exits the domain, rebound or launch a new one
-	  if(mediaid==0||f.t>gcfg->tmax||f.t>gcfg->twin1||(gcfg->dorefint && n1!=gproperty[mediaid].w) ){
+          //in the streaming mode (-D) the end of the window is not a boundary, the photon is parked below
+	  if(mediaid==0||f.t>gcfg->tmax||(!gcfg->streamgate && f.t>gcfg->twin1)||(gcfg->dorefint && n1!=gproperty[mediaid].w) ){
 	      float flipdir=0.f;
 
-              if(gcfg->doreflect) {
+              if(gcfg->dda) {
+                //the step ended on the face it crossed, no trial intersections are needed
+                flipdir=(idx1d!=idx1dold ? ddaflip : 0.f);
+                htime.x=p0.x+ddalen*v.x; /*htime is the exact exit position*/
+                htime.y=p0.y+ddalen*v.y;
+                htime.z=p0.z+ddalen*v.z;
+              }else if(gcfg->doreflect) {
                 //time-of-flight to hit the wall in each direction
                 htime.x=(v.x>EPS||v.x<-EPS)?(floorf(p0.x)+(v.x>0.f)-p0.x)/v.x:VERY_BIG;
                 htime.y=(v.y>EPS||v.y<-EPS)?(floorf(p0.y)+(v.y>0.f)-p0.y)/v.y:VERY_BIG;
@@ -582,9 +911,7 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 
 			 
               *((float4*)(&prop))=gproperty[mediaid]; // optical property across the interface
-              if(mediaid!=0){
-     				*((float4*)(&pressure))=gmedia_acous[idx1d]; 
-     		  }else{*((float4*)(&pressure))=float4(0.f,0.f,0.f,0.f);}
+              getacoustics(media_acous,&p,mediaid,&aoc);
 
               GPUDEBUG(("->ID%d J%d C%d tlen %e flip %d %.1f!=%.1f dir=%f %f %f pos=%f %f %f\n",idx,(int)v.nscat,
                   (int)f.ndone,f.t, (int)flipdir, n1,prop.n,v.x,v.y,v.z,p.x,p.y,p.z));
@@ -592,7 +919,7 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
               //recycled some old register variables to save memory
 	      //if hit boundary within the time window and is n-mismatched, rebound
 
-              if(gcfg->doreflect&&f.t<gcfg->tmax&&f.t<gcfg->twin1&& flipdir>0.f && n1!=prop.n &&p.w>gcfg->minenergy){
+              if(gcfg->doreflect&&f.t<gcfg->tmax&&(gcfg->streamgate||f.t<gcfg->twin1)&& flipdir>0.f && n1!=prop.n){
 	          float Rtotal=1.f;
 
                   tmp0=n1*n1;
@@ -623,27 +950,34 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
                   } // else, total internal reflection
 	          if(Rtotal<1.f && rand_next_reflect(t)>Rtotal){ // do transmission
                         if(mediaid==0){ // transmission to external boundary
-                            p.x=htime.x;p.y=htime.y;p.z=htime.z;p.w=p0.w;
-		    	    launchnewphoton(&p,&v,&f,&ao_sums,&mod,&prop,&pressure,&Acon,&Ocon,&idx1d,&mediaid,(mediaidold & DET_MASK),  //MTA changed 6/18/12, 6/20/12, 6/29/12, 7/2/12
-			        ppath,&energyloss,n_det,detectedphoton);  //MTA changed 6/18/12
-			    continue;
+                            p.x=htime.x;p.y=htime.y;p.z=htime.z;p.w=(gcfg->dda ? p.w : p0.w);
+		    	    launchnewphoton(&p,&v,&f,&ao_sums,&ao_sweep,&mod,&prop,&aoc,media_acous,&Acon,&Ocon,&idx1d,&mediaid,(mediaidold & DET_MASK),  //MTA changed 6/18/12, 6/20/12, 6/29/12, 7/2/12
+			        ppath,&energyloss,n_det,detectedphoton,detgrid,media,n_parkin,&nquota,photonpool,t,tnew,&photonid);  //MTA changed 6/18/12
+			    if(!gcfg->resume) continue;  // a resumed photon makes its owed deposit below
+			}else{ // refract, a relaunched/resumed photon must not inherit the old interface
+			    tmp0=n1/prop.n;
+                	    if(flipdir>=3.f) { //transmit through z plane
+                	       v.x=tmp0*v.x;
+                	       v.y=tmp0*v.y;
+                	    }else if(flipdir>=2.f){ //transmit through y plane
+                	       v.x=tmp0*v.x;
+                	       v.z=tmp0*v.z;
+                	    }else if(flipdir>=1.f){ //transmit through x plane
+                	       v.y=tmp0*v.y;
+                	       v.z=tmp0*v.z;
+                	    }
+			    tmp0=rsqrtf(v.x*v.x+v.y*v.y+v.z*v.z);
+			    v.x=v.x*tmp0;
+			    v.y=v.y*tmp0;
+			    v.z=v.z*tmp0;
 			}
-			tmp0=n1/prop.n;
-                	if(flipdir>=3.f) { //transmit through z plane
-                	   v.x=tmp0*v.x;
-                	   v.y=tmp0*v.y;
-                	}else if(flipdir>=2.f){ //transmit through y plane
-                	   v.x=tmp0*v.x;
-                	   v.z=tmp0*v.z;
-                	}else if(flipdir>=1.f){ //transmit through x plane
-                	   v.y=tmp0*v.y;
-                	   v.z=tmp0*v.z;
-                	}
-			tmp0=rsqrtf(v.x*v.x+v.y*v.y+v.z*v.z);
-			v.x=v.x*tmp0;
-			v.y=v.y*tmp0;
-			v.z=v.z*tmp0;
 		  }else{ //do reflection
+                        if(gcfg->dda){  //back off the face into the old voxel, the weight keeps the absorption on the way
+                            tmp0=fmaxf(ddalen-DDA_NUDGE,0.f);
+                            p.x=p0.x+tmp0*v.x;p.y=p0.y+tmp0*v.y;p.z=p0.z+tmp0*v.z;
+                        }else{
+                            p=p0;   //move to the reflection point
+                        }
                 	if(flipdir>=3.f) { //flip in z axis
                 	   v.z=-v.z;
                 	}else if(flipdir>=2.f){ //flip in y axis
@@ -651,68 +985,48 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
                 	}else if(flipdir>=1.f){ //flip in x axis
                 	   v.x=-v.x;
                 	}
-                        p=p0;   //move to the reflection point
                 	idx1d=idx1dold;
 		 	mediaid=(media[idx1d] & MED_MASK);
 	
         	  	*((float4*)(&prop))=gproperty[mediaid];
-				if(mediaid!=0){
-     				*((float4*)(&pressure))=gmedia_acous[idx1d]; 
-     			}else{*((float4*)(&pressure))=float4(0.f,0.f,0.f,0.f);}
+				getacoustics(media_acous,&p,mediaid,&aoc);
                   n1=prop.n;
 		  }
               }else{  // launch a new photon
-                  p.x=htime.x;p.y=htime.y;p.z=htime.z;p.w=p0.w;
-		  launchnewphoton(&p,&v,&f,&ao_sums,&mod,&prop,&pressure,&Acon,&Ocon,&idx1d,&mediaid,(mediaidold & DET_MASK),ppath,  //MTA changed 6/18/12, 6/20/12, 6/29/12
-		      &energyloss,n_det,detectedphoton);
-		  continue;
+                  p.x=htime.x;p.y=htime.y;p.z=htime.z;p.w=(gcfg->dda ? p.w : p0.w);
+		  launchnewphoton(&p,&v,&f,&ao_sums,&ao_sweep,&mod,&prop,&aoc,media_acous,&Acon,&Ocon,&idx1d,&mediaid,(mediaidold & DET_MASK),ppath,  //MTA changed 6/18/12, 6/20/12, 6/29/12
+		      &energyloss,n_det,detectedphoton,detgrid,media,n_parkin,&nquota,photonpool,t,tnew,&photonid);
+		  if(!gcfg->resume) continue;
               }
 	  }
 
-          // saving fluence to the memory
+          // the photon outlived the window (-D), carry it over to the next one before its deposit
+          if(gcfg->streamgate && f.t>gcfg->twin1){
+	      parkphoton(n_parkout,parkcount,&p,&v,&f,&ao_sums,&ao_sweep,ppath,photonid);
+	      launchnewphoton(&p,&v,&f,&ao_sums,&ao_sweep,&mod,&prop,&aoc,media_acous,&Acon,&Ocon,&idx1d,&mediaid,0,ppath,
+		      &energyloss,n_det,detectedphoton,detgrid,media,n_parkin,&nquota,photonpool,t,tnew,&photonid);
+	      if(!gcfg->resume) continue;
+          }
 
-	  if(f.t>=f.tnext){
-             GPUDEBUG(("field add to %d->%f(%d)  t(%e)>t0(%e)\n",idx1d,p.w,(int)f.ndone,f.t,f.tnext));
-             // if t is within the time window, which spans cfg->maxgate*cfg->tstep wide
-             if(gcfg->save2pt && f.t>=gcfg->twin0 && f.t<gcfg->twin1){
-                  energyabsorbed+=p.w*prop.mua;
-#ifdef TEST_RACING
-                  // enable TEST_RACING to determine how many missing accumulations due to race
-                  if( (p.x-gcfg->ps.x)*(p.x-gcfg->ps.x)+(p.y-gcfg->ps.y)*(p.y-gcfg->ps.y)+(p.z-gcfg->ps.z)*(p.z-gcfg->ps.z)>gcfg->skipradius2) {
-                      field0[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=1.f;
-		      cc++;
-                  }
-#else
-  #ifndef USE_ATOMIC
-                  // set gcfg->skipradius2 to only start depositing energy when dist^2>gcfg->skipradius2 
-                  if(gcfg->skipradius2>EPS){
-  #ifdef  USE_CACHEBOX
-                      if(p.x<gcfg->cp1.x+1.f && p.x>=gcfg->cp0.x &&
-		         p.y<gcfg->cp1.y+1.f && p.y>=gcfg->cp0.y &&
-			 p.z<gcfg->cp1.z+1.f && p.z>=gcfg->cp0.z){
-                         atomicadd(cachebox+(int(p.z-gcfg->cp0.z)*gcfg->cachebox.y
-			      +int(p.y-gcfg->cp0.y)*gcfg->cachebox.x+int(p.x-gcfg->cp0.x)),p.w);
-  #else
-                      if((p.x-gcfg->ps.x)*(p.x-gcfg->ps.x)+(p.y-gcfg->ps.y)*(p.y-gcfg->ps.y)+(p.z-gcfg->ps.z)*(p.z-gcfg->ps.z)<=gcfg->skipradius2){
-                          accumweight+=p.w*prop.mua; // weight*absorption
-  #endif
-                      }else{
-                          field0[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=p.w*j0f(mod.magnitude)*j0f(mod.magnitude);
-                          field1[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=p.w*2.f*j1f(mod.magnitude)*j1f(mod.magnitude);
-                      }
-                  }else{
-                      field0[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=p.w*j0f(mod.magnitude)*j0f(mod.magnitude);
-                      field1[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z]+=p.w*2.f*j1f(mod.magnitude)*j1f(mod.magnitude);
-                  }
-  #else
-                  // ifndef CUDA_NO_SM_11_ATOMIC_INTRINSICS
-		  atomicadd(& field0[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z], p.w*j0f(mod.magnitude)*j0f(mod.magnitude));
-		  atomicadd(& field1[idx1d+(int)(floorf((f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z], p.w*2.f*j1f(mod.magnitude)*j1f(mod.magnitude));
-  #endif
-#endif
-	     }
-             f.tnext+=gcfg->minaccumtime*prop.n; // fluence is a temporal-integration, unit=s
-	  }
+          // Russian roulette (-e/-X): the expected weight is kept, a dropped packet is not booked as lost
+          if(p.w<gcfg->minenergy){
+              rand_need_more(t,tnew);  // the buffer is only refreshed per scattering, do not reuse its numbers
+              if(rand_do_roulette(t)*gcfg->roulettesize<=1.f){
+                  p.w*=gcfg->roulettesize;
+              }else{
+                  p.w=0.f;
+                  launchnewphoton(&p,&v,&f,&ao_sums,&ao_sweep,&mod,&prop,&aoc,media_acous,&Acon,&Ocon,&idx1d,&mediaid,0,ppath,
+                      &energyloss,n_det,detectedphoton,detgrid,media,n_parkin,&nquota,photonpool,t,tnew,&photonid);
+                  if(!gcfg->resume) continue;
+              }
+          }
+
+          // saving fluence to the memory, a DDA step (-j) has made its deposits, except those a resumed photon owes
+
+	  if(gcfg->dda)
+	      savesegment(field,cachebox,&accumweight,&energyabsorbed,&cc,&p,&v,&f,&prop,VERY_BIG,&ao_sums,&ao_sweep);
+	  else
+	      savefluence(field,cachebox,&accumweight,&energyabsorbed,&cc,&p,&f,&prop,idx1d,&ao_sums,&ao_sweep);
      }
      // cachebox saves the total absorbed energy of all time in the sphere r<sradius.
      // in non-atomic mode, cachebox is more accurate than saving to the grid
@@ -721,7 +1035,7 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
 #ifdef  USE_CACHEBOX
      if(gcfg->skipradius2>EPS){
      	f.tnext=0.f;
-        savecache(field0,cachebox);
+        savecache(field,cachebox);
      }
 #else
      f.tnext=accumweight;
@@ -737,7 +1051,10 @@ kernel void mcx_main_loop(int nphoton,int ophoton,uchar media[],float4 media_aco
      n_dir[idx]=*((float4*)(&v));
      n_len[idx]=*((float4*)(&f));
 	 n_AO_sums[idx]=*((float4*)(&ao_sums));		//MTA added 6/29/12
+	 n_AO_sweep[idx]=*((float4*)(&ao_sweep));
+	 getmodulation(&ao_sums,&mod);
 	 n_mod[idx]=*((float2*)(&mod));		//MTA added 6/29/12, removed 1/28/13
+	 n_steps[idx]=nstep;
 }
 
 // I'm not sure what's going on here. //////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -792,9 +1109,9 @@ int mcx_set_gpu(Config *cfg){
 		if(cfg->autopilot==1){
 			cfg->nblocksize=64;
 			cfg->nthread=256*dp.multiProcessorCount*dp.multiProcessorCount;
-			needmem+=cfg->nthread*sizeof(float4)*5+cfg->nthread*sizeof(float2)+sizeof(float)*cfg->maxdetphoton*(cfg->medianum+3)+10*1024*1024; /*keep 10M for other things*/ //MTA changed 6/20/12
+			needmem+=cfg->nthread*sizeof(float4)*5+cfg->nthread*sizeof(float2)+sizeof(float)*cfg->maxdetphoton*cfg->his.colcount+10*1024*1024; /*keep 10M for other things*/ //MTA changed 6/20/12
 			needmem+=cfg->dim.x*cfg->dim.y*cfg->dim.z*sizeof(float4);
-			cfg->maxgate=((unsigned int)dp.totalGlobalMem-needmem)/(cfg->dim.x*cfg->dim.y*cfg->dim.z);
+			cfg->maxgate=((unsigned int)dp.totalGlobalMem-needmem)/(cfg->dim.x*cfg->dim.y*cfg->dim.z*mcx_variantnum(cfg)*mcx_sidebandnum(cfg));
 			cfg->maxgate=MIN((int)((cfg->tend-cfg->tstart)/cfg->tstep+0.5),cfg->maxgate);
 			fprintf(cfg->flog,"autopilot mode: setting thread number to %d, block size to %d and time gates to %d\n",cfg->nthread,cfg->nblocksize,cfg->maxgate);
 		}else if(cfg->autopilot==2){
@@ -831,6 +1148,57 @@ Shared Memory:\t\t%u B\nRegisters:\t\t%u\nClock Speed:\t\t%.2f GHz\n",
 #endif
 }
 
+/**
+   writes the checkpoint of a completed repetition (-K), see mcx_checkpoint.h;
+   field is only used as a staging buffer for the fields inside a window
+*/
+void mcx_savecheckpoint(const char *session,Checkpoint *ck,float *gfield,float *field,float *genergy,float *energy,
+                        float *gpark,uint nparked){
+     FILE *fp;
+     float *park;
+
+     ck->nparkgroup=1;
+     fp=mcx_checkpoint_create(session,ck);
+     if(ck->iter){
+          cudaMemcpy(field,gfield,sizeof(float)*ck->fieldlen,cudaMemcpyDeviceToHost);
+          mcx_checkpoint_write(fp,field,sizeof(float)*ck->fieldlen);
+     }
+     cudaMemcpy(energy,genergy,sizeof(float)*ck->nthread*2,cudaMemcpyDeviceToHost);
+     mcx_checkpoint_write(fp,energy,sizeof(float)*ck->nthread*2);
+     mcx_checkpoint_write(fp,&nparked,sizeof(uint));
+     if(nparked){
+          park=(float *)malloc(sizeof(float)*ck->parkreclen*nparked);
+          cudaMemcpy(park,gpark,sizeof(float)*ck->parkreclen*nparked,cudaMemcpyDeviceToHost);
+          mcx_checkpoint_write(fp,park,sizeof(float)*ck->parkreclen*nparked);
+          free(park);
+     }
+     mcx_checkpoint_commit(fp,session);
+}
+
+/**
+   reloads the sections written by mcx_savecheckpoint(), the parked photons
+   go to gpark as if the previous window had just ended
+*/
+void mcx_loadcheckpoint(FILE *fp,const Checkpoint *ck,float *gfield,float *field,float *genergy,float *energy,
+                        float *gpark,uint *nparked){
+     float *park;
+
+     if(ck->iter){
+          mcx_checkpoint_read(fp,field,sizeof(float)*ck->fieldlen);
+          cudaMemcpy(gfield,field,sizeof(float)*ck->fieldlen,cudaMemcpyHostToDevice);
+     }
+     mcx_checkpoint_read(fp,energy,sizeof(float)*ck->nthread*2);
+     cudaMemcpy(genergy,energy,sizeof(float)*ck->nthread*2,cudaMemcpyHostToDevice);
+     mcx_checkpoint_read(fp,nparked,sizeof(uint));
+     if(*nparked){
+          if(gpark==NULL || ck->nparkgroup!=1)
+               mcx_error(-2,"the checkpoint file is corrupted",__FILE__,__LINE__);
+          park=(float *)malloc(sizeof(float)*ck->parkreclen*(*nparked));
+          mcx_checkpoint_read(fp,park,sizeof(float)*ck->parkreclen*(*nparked));
+          cudaMemcpy(gpark,park,sizeof(float)*ck->parkreclen*(*nparked),cudaMemcpyHostToDevice);
+          free(park);
+     }
+}
 
 /**
    host code for MCX kernels
@@ -839,7 +1207,13 @@ Shared Memory:\t\t%u B\nRegisters:\t\t%u\nClock Speed:\t\t%.2f GHz\n",
 //MTA. This is the CPU code that executes the GPU MC kernels
 void mcx_run_simulation(Config *cfg){
 
-     int i,iter;
+     int i,iter,iter0;
+     unsigned int isrc,iwin,ckseed,ckclock;
+     unsigned long long ndraw;
+     unsigned int nseeddraw=0;  //rand() values used by the seeds of the next repetition
+     char session[MAX_SESSION_LENGTH];
+     Checkpoint ck,ckrun;
+     FILE *ckin=NULL;
      float  minstep=MIN(MIN(cfg->steps.x,cfg->steps.y),cfg->steps.z);
      float4 p0=float4(cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,1.f);
      float4 c0=float4(cfg->srcdir.x,cfg->srcdir.y,cfg->srcdir.z,0.f);
@@ -848,6 +1222,10 @@ void mcx_run_simulation(Config *cfg){
      float energyloss=0.f,energyabsorbed=0.f;
      float *energy;
      int threadphoton, oddphotons;
+     int respin=(cfg->isstreamgate ? 1 : cfg->respin);  //a streamed run (-D) simulates all photons in one pass
+     uint nparked=0,nstepmax;
+     uint photonpool[2]={0,0};  //next photon and photons of a launch, handed out by the kernel with -V
+     double stepsum,stepspan;   //loop iterations of all threads, and nthread x those of the busiest one
 
      unsigned int photoncount=0,printnum;
      unsigned int tic,tic0,tic1,toc=0,fieldlen;
@@ -860,10 +1238,14 @@ void mcx_run_simulation(Config *cfg){
      dim3 clgrid, clblock;
      
      int dimxyz=cfg->dim.x*cfg->dim.y*cfg->dim.z;
+     int nfield=mcx_variantnum(cfg)*mcx_sidebandnum(cfg);  //MTA one field per sideband (-J) of each phase (-x) and frequency (-F)
+     float2 phase[MAX_PHASES];
+     float  freq[MAX_FREQS];
+     size_t acouslen=(size_t)cfg->acdim.x*cfg->acdim.y*cfg->acdim.z; //MTA only the insonified box is stored
+     size_t acousrec=(cfg->aotable ? sizeof(AOCoef) : (cfg->qpressure ? sizeof(AcousticsQ) : sizeof(Acoustics)));
      
      uchar  	*media=(uchar *)(cfg->vol);		//MTA changed 6/26/12
-     float  	*field0;			//MTA unmodulated fluence
-     float  	*field1;			//MTA modulated fluence
+     float  	*field;			//MTA carrier (J0^2) and sideband (2*Jn^2) fluences
 	 //MTA.  I'll probably want to add an option in the MCXParam here to ask if you want to do an AO simulation or just an optical simulation. //////////////////////
      MCXParam param={cfg->unitinmm,cfg->steps,minstep,0,0,cfg->tend,R_C0*cfg->unitinmm,cfg->isrowmajor,
                      cfg->issave2pt,cfg->isreflect,cfg->isrefint,cfg->issavedet,1.f/cfg->tstep,
@@ -871,28 +1253,33 @@ void mcx_run_simulation(Config *cfg){
                      cfg->sradius*cfg->sradius,minstep*R_C0*cfg->unitinmm,cfg->maxdetphoton,
 		     cfg->medianum-1,cfg->detnum,0,0};
 
-     if(cfg->respin>1){
-         field0=(float *)calloc(sizeof(float)*dimxyz,cfg->maxgate*2);	//MTA
-         field1=(float *)calloc(sizeof(float)*dimxyz,cfg->maxgate*2);	//MTA
-     }else{
-         field0=(float *)calloc(sizeof(float)*dimxyz,cfg->maxgate);		//MTA
-         field1=(float *)calloc(sizeof(float)*dimxyz,cfg->maxgate);		//MTA
+     if(cfg->iscpu){   // run the multi-threaded host engine instead, see mcx_cpu.c
+         mcx_cpu_run_simulation(cfg);
+         return;
      }
 
+     field=(float *)calloc(sizeof(float)*dimxyz,cfg->maxgate*nfield);		//MTA the repetitions accumulate in gfield
+
      float4 *Ppos;
      float4 *Pdir;
      float4 *Plen,*Plen0;
-     uint   *Pseed;
+     uint   *Pseed;      //page-locked, the seeds of the next repetition are uploaded while the kernel runs
+     uint   *Psteps;     //loop iterations per thread of the last launch
      float  *Pdet;
-     uint    detected=0,sharedbuf=0;
+     uint    detected=0,detected0,totaldetected=0,sharedbuf=0;
+     uint    detbuflen;  //records of the device buffer, nthread above the relaunch threshold
+     int     relaunch;
+     DetWriter *detw=NULL;
 	 float4 *Pao_sums;		// MTA
+	 float4 *Pao_sweep;
 	 float2 *Pmod;			//MTA
 
 
      if(cfg->nthread%cfg->nblocksize)
      	cfg->nthread=(cfg->nthread/cfg->nblocksize)*cfg->nblocksize;
-     threadphoton=cfg->nphoton/cfg->nthread/cfg->respin;
-     oddphotons=cfg->nphoton/cfg->respin-threadphoton*cfg->nthread;
+     threadphoton=cfg->nphoton/cfg->nthread/respin;
+     oddphotons=cfg->nphoton/respin-threadphoton*cfg->nthread;
+     detbuflen=MAX(cfg->maxdetphoton,2*cfg->nthread);
 
      mcgrid.x=cfg->nthread/cfg->nblocksize;
      mcblock.x=cfg->nblocksize;
@@ -905,21 +1292,20 @@ void mcx_run_simulation(Config *cfg){
      Pdir=(float4*)malloc(sizeof(float4)*cfg->nthread);
      Plen=(float4*)malloc(sizeof(float4)*cfg->nthread);
      Plen0=(float4*)malloc(sizeof(float4)*cfg->nthread);
+     Psteps=(uint*)malloc(sizeof(uint)*cfg->nthread);
 	 Pao_sums=(float4*)malloc(sizeof(float4)*cfg->nthread);		//MTA
+	 Pao_sweep=(float4*)malloc(sizeof(float4)*cfg->nthread);
 	 Pmod=(float2*)malloc(sizeof(float2)*cfg->nthread);		//MTA
-     Pseed=(uint*)malloc(sizeof(uint)*cfg->nthread*RAND_SEED_LEN);
+     mcx_cu_assess(cudaMallocHost((void **) &Pseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN),__FILE__,__LINE__);
      energy=(float*)calloc(cfg->nthread*2,sizeof(float));
-     Pdet=(float*)calloc(cfg->maxdetphoton,sizeof(float)*(cfg->medianum+3));  //MTA Changed medianum+1 to medianum+3
 
 
      uchar *gmedia;	//MTA changed 6/26/12
      mcx_cu_assess(cudaMalloc((void **) &gmedia, sizeof(uchar)*(dimxyz)),__FILE__,__LINE__);		//MTA Changed 6/26/12. changed sizeof(uchar) to sizeof(ushort)
-     /*Acoustics *gmedia_acous;	//MTA changed 6/26/12
-     mcx_cu_assess(cudaMalloc((void **) &gmedia_acous, sizeof(Acoustics)*(dimxyz)),__FILE__,__LINE__);*/
-     float *gfield0;
-     mcx_cu_assess(cudaMalloc((void **) &gfield0, sizeof(float)*(dimxyz)*cfg->maxgate),__FILE__,__LINE__);
-     float *gfield1;
-     mcx_cu_assess(cudaMalloc((void **) &gfield1, sizeof(float)*(dimxyz)*cfg->maxgate),__FILE__,__LINE__);     
+     float4 *gmedia_acous;	//MTA changed 6/26/12
+     mcx_cu_assess(cudaMalloc((void **) &gmedia_acous, acousrec*MAX(acouslen,1)),__FILE__,__LINE__);
+     float *gfield;
+     mcx_cu_assess(cudaMalloc((void **) &gfield, sizeof(float)*(dimxyz)*cfg->maxgate*nfield),__FILE__,__LINE__);
 
      //cudaBindTexture(0, texmedia, gmedia);
 	
@@ -931,18 +1317,51 @@ void mcx_run_simulation(Config *cfg){
      mcx_cu_assess(cudaMalloc((void **) &gPlen, sizeof(float4)*cfg->nthread),__FILE__,__LINE__);
 	 float4 *gPao_sums;
 	 mcx_cu_assess(cudaMalloc((void **) &gPao_sums, sizeof(float4)*cfg->nthread),__FILE__,__LINE__);
+	 float4 *gPao_sweep;
+	 mcx_cu_assess(cudaMalloc((void **) &gPao_sweep, sizeof(float4)*cfg->nthread),__FILE__,__LINE__);
 	 float2 *gPmod;
 	 mcx_cu_assess(cudaMalloc((void **) &gPmod, sizeof(float2)*cfg->nthread),__FILE__,__LINE__);
-     uint   *gPseed;
-     mcx_cu_assess(cudaMalloc((void **) &gPseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN),__FILE__,__LINE__);
+     uint   *gPseed[2];  //double-buffered, the kernel reads one while the other is filled
+     mcx_cu_assess(cudaMalloc((void **) &gPseed[0], sizeof(uint)*cfg->nthread*RAND_SEED_LEN),__FILE__,__LINE__);
+     mcx_cu_assess(cudaMalloc((void **) &gPseed[1], sizeof(uint)*cfg->nthread*RAND_SEED_LEN),__FILE__,__LINE__);
+     cudaStream_t kernelstream,copystream;
+     cudaStreamCreate(&kernelstream);
+     cudaStreamCreate(&copystream);
      float  *gPdet;
-     mcx_cu_assess(cudaMalloc((void **) &gPdet, sizeof(float)*cfg->maxdetphoton*(cfg->medianum+3)),__FILE__,__LINE__);  //MTA Changed 6/18/12.  Changed medianum+1 to medianum+3.
+     mcx_cu_assess(cudaMalloc((void **) &gPdet, sizeof(float)*detbuflen*cfg->his.colcount),__FILE__,__LINE__);  //MTA Changed 6/18/12.  medianum+1+2*phases per record.
      uint   *gdetected;
      mcx_cu_assess(cudaMalloc((void **) &gdetected, sizeof(uint)),__FILE__,__LINE__);
+     uint   *gphotonpool,*gPsteps;
+     mcx_cu_assess(cudaMalloc((void **) &gphotonpool, sizeof(uint)*2),__FILE__,__LINE__);
+     mcx_cu_assess(cudaMalloc((void **) &gPsteps, sizeof(uint)*cfg->nthread),__FILE__,__LINE__);
+     uint   *gdetgrid=NULL;
+     size_t detgridlen=0;
+     if(cfg->detgrid){
+         detgridlen=cfg->detgrid[cfg->detgriddim.x*cfg->detgriddim.y*cfg->detgriddim.z];
+         mcx_cu_assess(cudaMalloc((void **) &gdetgrid, sizeof(uint)*detgridlen),__FILE__,__LINE__);
+     }
 
      float *genergy;
      cudaMalloc((void **) &genergy, sizeof(float)*cfg->nthread*2);
 
+     float2 *gscattable=NULL;
+     float  scatlutmax=0.f;
+     if(cfg->isscatlut){
+         scatlutmax=mcx_buildscattable(cfg);
+         mcx_cu_assess(cudaMalloc((void **) &gscattable, sizeof(float2)*(SCAT_LUT_LEN+1)*(cfg->medianum+1)),__FILE__,__LINE__);
+     }
+
+     /*a window parks at most the photons it runs, i.e. nphoton; the two buffers swap roles per window*/
+     float *gparkin=NULL,*gparkout=NULL,*gparkswap;
+     uint  *gparkcount=NULL;
+     param.streamgate=cfg->isstreamgate;
+     param.parkreclen=(sizeof(MCXParked)>>2)+(cfg->issavedet ? ((cfg->medianum-1+3)&~3) : 0);  //whole float4 per record
+     if(cfg->isstreamgate){
+         mcx_cu_assess(cudaMalloc((void **) &gparkin, sizeof(float)*param.parkreclen*MAX(cfg->nphoton,1)),__FILE__,__LINE__);
+         mcx_cu_assess(cudaMalloc((void **) &gparkout, sizeof(float)*param.parkreclen*MAX(cfg->nphoton,1)),__FILE__,__LINE__);
+         mcx_cu_assess(cudaMalloc((void **) &gparkcount, sizeof(uint)),__FILE__,__LINE__);
+     }
+
      // MTA If you are worried about memory allocation, this was written a while ago to show the sizes of your variables
      
 	/* displaying memory allocations */
@@ -964,9 +1383,8 @@ void mcx_run_simulation(Config *cfg){
 	
 	printf("\nSize of GPU variables: \n");
 	printf("gmedia: %d bytes \n",sizeof(uchar)*(dimxyz));
-	printf("gmedia_acous: %d bytes \n",sizeof(Acoustics)*(dimxyz));
-	printf("gfield0: %d bytes \n",sizeof(float)*(dimxyz)*cfg->maxgate);	
-	printf("gfield1: %d bytes \n",sizeof(float)*(dimxyz)*cfg->maxgate);	
+	printf("gmedia_acous: %d bytes \n",acousrec*acouslen);
+	printf("gfield: %d bytes \n",sizeof(float)*(dimxyz)*cfg->maxgate*nfield);	
 	printf("gPpos: %d bytes \n",sizeof(float4)*cfg->nthread);
 	printf("gPdir: %d bytes \n",sizeof(float4)*cfg->nthread);
 	printf("gPlen: %d bytes \n",sizeof(float4)*cfg->nthread);
@@ -980,32 +1398,43 @@ void mcx_run_simulation(Config *cfg){
 	printf("======================  End GPU Memory Allocation  =========================\n");
 */
      /*volume is assumbed to be col-major*/
-     cachebox.x=(cp1.x-cp0.x+1);
-     cachebox.y=(cp1.y-cp0.y+1)*(cp1.x-cp0.x+1);
      dimlen.x=cfg->dim.x;
      dimlen.y=cfg->dim.y*cfg->dim.x;
 
      dimlen.z=cfg->dim.x*cfg->dim.y*cfg->dim.z;
      param.dimlen=dimlen;
-     param.cachebox=cachebox;
-     param.idx1dorig=(int(floorf(p0.z))*dimlen.y+int(floorf(p0.y))*dimlen.x+int(floorf(p0.x)));
-     param.mediaidorig=(cfg->vol[param.idx1dorig] & MED_MASK);
+     param.maxdetphoton=detbuflen;
+     param.detlimit=detbuflen-cfg->nthread;
+     param.acorig=cfg->acorig;	//MTA
+     param.acdim=cfg->acdim;	//MTA
+     param.acscale=(cfg->qpressure ? cfg->acscale : 0.f);
+     param.aotable=(cfg->aotable!=NULL);
+     // MTA fold the acoustic/optical constants of the modulation terms once
+     param.aoki=cfg->unitinmm/1000.f*TWO_PI/(cfg->Ocon->lambda) * cfg->Ocon->nu / ((cfg->Acon->rho)*(cfg->Acon->va)*(cfg->Acon->va));
+     param.aokj=TWO_PI/(cfg->Ocon->lambda) / (TWO_PI*cfg->Acon->f*(cfg->Acon->rho)*(cfg->Acon->va));
+     param.aosinj=TWO_PI/(cfg->Ocon->lambda);
+     param.detgridorig=cfg->detgridorig;
+     param.detgridscale=cfg->detgridscale;
+     param.detgriddim=cfg->detgriddim;
+     param.phasenum=cfg->phasenum;
+     param.freqnum=cfg->freqnum;
+     param.issweep=(cfg->phasenum || cfg->freqnum);
+     param.variantnum=mcx_variantnum(cfg);
+     param.sidebands=cfg->sidebands;
+     param.fieldstride=dimxyz*cfg->maxgate;
+     param.bandstride=param.fieldstride*param.variantnum;
+     param.reclen=cfg->his.colcount;
+     param.roulettesize=cfg->roulettesize;
+     param.dda=cfg->isdda;
+     param.scatlut=cfg->isscatlut;
+     param.dynamic=cfg->isdynamic;
+     for(i=0;i<(int)cfg->phasenum;i++)
+         phase[i]=float2(cosf(cfg->phaselist[i]),sinf(cfg->phaselist[i]));
+     for(i=0;i<(int)cfg->freqnum;i++)
+         freq[i]=cfg->Acon->f/cfg->freqlist[i];  // aokj~1/f
 
      Vvox=cfg->steps.x*cfg->steps.y*cfg->steps.z;
 
-     if(cfg->seed>0)
-     	srand(cfg->seed);
-     else
-        srand(time(0));
-	
-     for (i=0; i<cfg->nthread; i++) {
-	   Ppos[i]=p0;  // initial position
-           Pdir[i]=c0;
-           Plen[i]=float4(0.f,0.f,param.minaccumtime,0.f);
-		   Pao_sums[i]=float4(0.f,0.f,0.f,0.f);		//MTA
-		   Pmod[i]=float2(0.f,0.f);		//MTA
-     }
-
 
      fprintf(cfg->flog,"\
 ###############################################################################\n\
@@ -1035,10 +1464,21 @@ $MCX-AOI $Rev:: 2 $ Last Commit $Date:: 2014-03-21 $ by $Author:: adamsm2$\n\
      fprintf(cfg->flog,"- this version CAN NOT save photons at the detectors\n\n");
 #endif
      fprintf(cfg->flog,"threadph=%d oddphotons=%d np=%d nthread=%d repetition=%d\n",threadphoton,oddphotons,
-           cfg->nphoton,cfg->nthread,cfg->respin);
+           cfg->nphoton,cfg->nthread,respin);
+     if(cfg->isstreamgate)
+         fprintf(cfg->flog,"streaming time gates: photons alive at the end of a window continue in the next, %.1f MB\n",
+               2.0*sizeof(float)*param.parkreclen*cfg->nphoton/1048576.0);
+     if(cfg->minenergy>0.f)
+         fprintf(cfg->flog,"Russian roulette below weight %g, survivors carry x%g\n",cfg->minenergy,cfg->roulettesize);
+     if(cfg->isdda)
+         fprintf(cfg->flog,"voxel traversal: steps end at the next voxel face or scattering site\n");
+     if(cfg->isscatlut)
+         fprintf(cfg->flog,"scattering angle tables: %d entries per medium, max. cos(theta) error %.2e\n",SCAT_LUT_LEN+1,scatlutmax);
+     if(cfg->isdynamic)
+         fprintf(cfg->flog,"dynamic distribution: the threads claim the photons of a launch from a shared counter\n");
      fprintf(cfg->flog,"initializing streams ...\t");
      fflush(cfg->flog);
-     fieldlen=dimxyz*cfg->maxgate;
+     fieldlen=dimxyz*cfg->maxgate*nfield;
 
 
      cudaMemcpy(gmedia, media, sizeof(uchar) *dimxyz, cudaMemcpyHostToDevice);		//MTA changed sizeof(uchar) to sizeof(ushort) 6/26/12
@@ -1046,8 +1486,25 @@ $MCX-AOI $Rev:: 2 $ Last Commit $Date:: 2014-03-21 $ by $Author:: adamsm2$\n\
 	 cudaMemcpyToSymbol(gAcon, cfg->Acon, sizeof(Aconstants), 0, cudaMemcpyHostToDevice);	//MTA
 	 cudaMemcpyToSymbol(gOcon, cfg->Ocon, sizeof(Oconstants), 0, cudaMemcpyHostToDevice); //MTA
      cudaMemcpyToSymbol(gproperty, cfg->prop,  cfg->medianum*sizeof(Medium), 0, cudaMemcpyHostToDevice);
-	 cudaMemcpyToSymbol(gmedia_acous, cfg->pressure, sizeof(float4)*dimxyz, 0, cudaMemcpyHostToDevice);  //MTA
+     cudaMemset(gmedia_acous,0,acousrec);
+     if(acouslen)
+         cudaMemcpy(gmedia_acous, (cfg->aotable ? (void *)cfg->aotable : (cfg->qpressure ? (void *)cfg->qpressure : (void *)cfg->pressure)),
+                    acousrec*acouslen, cudaMemcpyHostToDevice);  //MTA
      cudaMemcpyToSymbol(gdetpos, cfg->detpos,  cfg->detnum*sizeof(float4), 0, cudaMemcpyHostToDevice);
+     if(cfg->phasenum){
+         cudaMemcpyToSymbol(gphase, phase, cfg->phasenum*sizeof(float2), 0, cudaMemcpyHostToDevice);
+         fprintf(cfg->flog,"ultrasound phase sweep: %u offsets per photon\n",cfg->phasenum);
+     }
+     if(cfg->freqnum){
+         cudaMemcpyToSymbol(gfreq, freq, cfg->freqnum*sizeof(float), 0, cudaMemcpyHostToDevice);
+         fprintf(cfg->flog,"acoustic frequencies: %u per photon\n",cfg->freqnum);
+     }
+     if(cfg->sidebands!=0x3)
+         fprintf(cfg->flog,"sideband fields: %d per variant\n",mcx_sidebandnum(cfg));
+     if(gdetgrid)
+         cudaMemcpy(gdetgrid, cfg->detgrid, sizeof(uint)*detgridlen, cudaMemcpyHostToDevice);
+     if(gscattable)
+         cudaMemcpy(gscattable, cfg->scattable, sizeof(float2)*(SCAT_LUT_LEN+1)*(cfg->medianum+1), cudaMemcpyHostToDevice);
 
      fprintf(cfg->flog,"init complete : %d ms\n",GetTimeMillis()-tic);
 
@@ -1059,10 +1516,85 @@ $MCX-AOI $Rev:: 2 $ Last Commit $Date:: 2014-03-21 $ by $Author:: adamsm2$\n\
 	 once. If the required memory is bigger than the video memory, set cfg->maxgate
 	 to a number which fits, and the snapshot will be saved with an increment of 
 	 cfg->maxgate snapshots. In this case, the later simulations will restart from
-	 photon launching and exhibit redundancies.
+	 photon launching and exhibit redundancies, unless the streaming mode (-D) is
+	 used: the photons alive at the end of a window are then parked in a device
+	 buffer and the next window only resumes them, so each photon is simulated once.
 	 
-	 The calculation of the energy conservation will only reflect the last simulation.
+	 The calculation of the energy conservation will only reflect the last simulation
+	 (the whole run in the streaming mode).
      */
+     fprintf(cfg->flog,"acoustic field: box [%d %d %d] at [%d %d %d], %.1f MB (full volume %.1f MB)\n",
+           cfg->acdim.x,cfg->acdim.y,cfg->acdim.z,cfg->acorig.x,cfg->acorig.y,cfg->acorig.z,
+           acouslen*acousrec/1048576.0,(double)dimxyz*sizeof(float4)/1048576.0);
+
+     /*
+         with a source list (-W), the domain above stays on the device and only
+	 the source dependent parameters are updated before each source is run
+	 into its own session; the checkpoint (-K) of all sources is named after
+	 the session of the list
+     */
+     strncpy(session,cfg->session,MAX_SESSION_LENGTH);
+     mcx_checkpoint_init(&ckrun,cfg,0,cfg->nthread,1,respin,fieldlen,param.parkreclen);
+     ckclock=GetTimeMillis();
+     isrc=0;
+     if(cfg->isresume){
+          ckin=mcx_checkpoint_open(session,&ck);
+          mcx_checkpoint_verify(&ck,&ckrun);
+          isrc=ck.isrc;
+          if(ck.window==0 && ck.iter==0){  // saved at a source boundary, nothing to restore
+               fclose(ckin);
+               ckin=NULL;
+          }
+     }
+     for(;isrc<MAX(cfg->srcnum,1);isrc++){
+
+     if(cfg->srcnum){
+          mcx_setsource(cfg,isrc,session);
+          fprintf(cfg->flog,"source %u of %u at [%f %f %f], saving to %s\n",isrc+1,cfg->srcnum,
+                cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,cfg->session);
+     }
+     p0=float4(cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,1.f);
+     c0=float4(cfg->srcdir.x,cfg->srcdir.y,cfg->srcdir.z,0.f);
+     cp0=cfg->crop0;
+     cp1=cfg->crop1;
+     cachebox.x=(cp1.x-cp0.x+1);
+     cachebox.y=(cp1.y-cp0.y+1)*(cp1.x-cp0.x+1);
+     param.ps=p0;
+     param.c0=c0;
+     param.cp0=cp0;
+     param.cp1=cp1;
+     param.cachebox=cachebox;
+     param.idx1dorig=(int(floorf(p0.z))*dimlen.y+int(floorf(p0.y))*dimlen.x+int(floorf(p0.x)));
+     param.mediaidorig=(cfg->vol[param.idx1dorig] & MED_MASK);
+
+     photoncount=0;
+     stepsum=0.0;
+     stepspan=0.0;
+     toc=0;
+     totaldetected=0;
+     energyloss=0.f;
+     energyabsorbed=0.f;
+     cudaMemset(genergy,0,sizeof(float)*cfg->nthread*2);
+     memset(field,0,sizeof(float)*fieldlen);
+
+     ndraw=0;
+     ckseed=(cfg->seed>0 ? (unsigned int)cfg->seed : (unsigned int)time(0));
+     if(ckin){  // replay the host RNG up to the seeds of the next repetition
+          ckseed=ck.seed;
+          srand(ckseed);
+          for(;ndraw<ck.ndraw;ndraw++)
+               rand();
+          photoncount=ck.photoncount;
+          totaldetected=ck.detected;
+          fprintf(cfg->flog,"resuming from %s.ckpt: time window %u, repetition %u, %u photons done\n",
+                session,ck.window+1,ck.iter+1,ck.photoncount);
+          if(cfg->issave2pt && !cfg->exportfield0 && ck.window)
+               mcx_truncatefields(param.fieldstride,ck.window,cfg);  // drop the windows saved after the checkpoint
+     }else{
+          srand(ckseed);
+     }
+	
+     sharedbuf=0;
 #ifdef  USE_CACHEBOX
      if(cfg->sradius>EPS || cfg->sradius<0.f)
         sharedbuf+=sizeof(float)*((cp1.x-cp0.x+1)*(cp1.y-cp0.y+1)*(cp1.z-cp0.z+1));
@@ -1073,97 +1605,152 @@ $MCX-AOI $Rev:: 2 $ Last Commit $Date:: 2014-03-21 $ by $Author:: adamsm2$\n\
         sharedbuf+=cfg->nblocksize*sizeof(float)*(cfg->medianum-1);
 
      fprintf(cfg->flog,"requesting %d bytes of shared memory\n",sharedbuf);
+#ifdef SAVE_DETECTORS
+     /*double-buffered host pages, one launch is written to disk while the next one runs*/
+     if(cfg->issavedet)
+          detw=mcx_detwriter_reopen(cfg,detbuflen,2,(ckin ? ck.detsaved : 0));
+#endif
 
      //simulate for all time-gates in maxgate groups per run
-     for(t=cfg->tstart;t<cfg->tend;t+=cfg->tstep*cfg->maxgate){
+     for(t=cfg->tstart,iwin=0;t<cfg->tend;t+=cfg->tstep*cfg->maxgate,iwin++){
+
+       if(ckin && iwin<ck.window)
+           continue;
 
        param.twin0=t;
        param.twin1=t+cfg->tstep*cfg->maxgate;
+       param.resume=(cfg->isstreamgate && t>cfg->tstart);
+
+       iter0=0;
+       if(ckin){  // the window the run was interrupted in
+           iter0=ck.iter;
+           mcx_loadcheckpoint(ckin,&ck,gfield,field,genergy,energy,gparkout,&nparked);
+           fclose(ckin);
+           ckin=NULL;
+       }
+       if(t>cfg->tstart && iter0==0){
+            if(cfg->isstreamgate){  // keep the loss tally, the parked weight moves between windows
+                cudaMemcpy(energy,genergy,sizeof(float)*cfg->nthread*2,cudaMemcpyDeviceToHost);
+                for(i=0;i<cfg->nthread;i++)
+                    energy[(i<<1)+1]=0.f;
+                cudaMemcpy(genergy,energy,sizeof(float)*cfg->nthread*2,cudaMemcpyHostToDevice);
+            }else{
+                cudaMemset(genergy,0,sizeof(float)*cfg->nthread*2);
+            }
+       }
+
+       if(param.resume){  // the photons parked by the last window are the input of this one
+           gparkswap=gparkin; gparkin=gparkout; gparkout=gparkswap;
+           threadphoton=nparked/cfg->nthread;
+           oddphotons=nparked-threadphoton*cfg->nthread;
+       }else if(cfg->isstreamgate){  // first window of a source
+           threadphoton=cfg->nphoton/cfg->nthread;
+           oddphotons=cfg->nphoton-threadphoton*cfg->nthread;
+       }
+       if(gparkcount)
+           cudaMemset(gparkcount,0,sizeof(uint));
+       photonpool[1]=threadphoton*cfg->nthread+oddphotons;
 
        cudaMemcpyToSymbol(gcfg,   &param,     sizeof(MCXParam), 0, cudaMemcpyHostToDevice);
 
        fprintf(cfg->flog,"lauching MCX simulation for time window [%.2ens %.2ens] ...\n"
            ,param.twin0*1e9,param.twin1*1e9);
 
+       /*
+          the repetitions of a window add to gfield on the device, the fields are
+          only copied back after the last one; the seeds of the next repetition
+          are generated and uploaded while the current kernel runs
+       */
+       if(iter0==0){
+           cudaMemset(gfield,0,sizeof(float)*fieldlen); // cost about 1 ms		//MTA
+           eabsorp=0.f;
+       }else{
+           eabsorp=ck.eabsorp;
+       }
+       ndraw+=rand_launch_seeds(Pseed,cfg->nthread,ckseed,isrc,iwin*respin+iter0);
+       cudaMemcpy(gPseed[iter0&1], Pseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN,  cudaMemcpyHostToDevice);
+
        //total number of repetition for the simulations, results will be accumulated to field
-       for(iter=0;iter<cfg->respin;iter++){
-           cudaMemset(gfield0,0,sizeof(float)*fieldlen); // cost about 1 ms		//MTA
-           cudaMemset(gfield1,0,sizeof(float)*fieldlen); // cost about 1 ms		//MTA
-           cudaMemset(gPdet,0,sizeof(float)*cfg->maxdetphoton*(cfg->medianum+3));  //MTA medianum+1 to medianum+3.
-           cudaMemset(gdetected,0,sizeof(float));
-
- 	   cudaMemcpy(gPpos,  Ppos,  sizeof(float4)*cfg->nthread,  cudaMemcpyHostToDevice);
-	   cudaMemcpy(gPdir,  Pdir,  sizeof(float4)*cfg->nthread,  cudaMemcpyHostToDevice);
-	   cudaMemcpy(gPlen,  Plen,  sizeof(float4)*cfg->nthread,  cudaMemcpyHostToDevice);
-	   cudaMemcpy(gPao_sums,  Pao_sums,  sizeof(float4)*cfg->nthread,  cudaMemcpyHostToDevice);		//MTA
-	   cudaMemcpy(gPmod,  Pmod,  sizeof(float2)*cfg->nthread,  cudaMemcpyHostToDevice);		//MTA
-           for (i=0; i<cfg->nthread*RAND_SEED_LEN; i++)
-		Pseed[i]=rand();
-	   cudaMemcpy(gPseed, Pseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN,  cudaMemcpyHostToDevice);
+       for(iter=iter0;iter<respin;iter++){
+           cudaMemset(gdetected,0,sizeof(uint));
+           cudaMemcpy(gphotonpool,photonpool,sizeof(uint)*2,cudaMemcpyHostToDevice);
+           detected0=totaldetected;
 
            tic0=GetTimeMillis();
            fprintf(cfg->flog,"simulation run#%2d ... \t",iter+1); fflush(cfg->flog);
 
+           /*
+              the kernel stops launching photons once param.detlimit are detected, the
+              buffer is then saved and the kernel relaunched to do the rest of the repetition
+           */
+           for(relaunch=0;;relaunch++){
+               mcx_main_loop<<<mcgrid,mcblock,sharedbuf,kernelstream>>>(threadphoton,oddphotons,gmedia,gmedia_acous,gfield,genergy,
+	                                                   gPseed[iter&1],gPpos,gPdir,gPlen,gPdet,gPao_sums,gPao_sweep,gPmod, gdetected,gdetgrid,
+	                                                   gparkin,gparkout,gparkcount,gscattable,gphotonpool,gPsteps,relaunch);			//MTA
+               if(relaunch==0 && iter+1<respin){
+                   nseeddraw=rand_launch_seeds(Pseed,cfg->nthread,ckseed,isrc,iwin*respin+iter+1);
+                   ndraw+=nseeddraw;
+                   cudaMemcpyAsync(gPseed[(iter+1)&1], Pseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN, cudaMemcpyHostToDevice, copystream);
+               }
 
-           mcx_main_loop<<<mcgrid,mcblock,sharedbuf>>>(threadphoton,oddphotons,gmedia,gmedia_acous,gfield0,gfield1,genergy,
-	                                               gPseed,gPpos,gPdir,gPlen,gPdet,gPao_sums,gPmod, gdetected);			//MTA
+               cudaThreadSynchronize();
+	       cudaMemcpy(&detected, gdetected,sizeof(uint),cudaMemcpyDeviceToHost);
+               cudaMemcpy(Plen0,  gPlen,  sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
+               for(i=0;i<cfg->nthread;i++)
+                  eabsorp+=Plen0[i].z;  // the accumulative absorpted energy near the source, of all repetitions
+               cudaMemcpy(Psteps, gPsteps, sizeof(uint)*cfg->nthread, cudaMemcpyDeviceToHost);
+               for(i=0,nstepmax=0;i<cfg->nthread;i++){
+                  stepsum+=Psteps[i];
+                  nstepmax=MAX(nstepmax,Psteps[i]);
+               }
+               stepspan+=(double)nstepmax*cfg->nthread;  // every thread is held until the busiest one is done
 
-           cudaThreadSynchronize();
-	   cudaMemcpy(&detected, gdetected,sizeof(uint),cudaMemcpyDeviceToHost);
+//MTA.  This is where detector data is saved.
+#ifdef SAVE_DETECTORS
+               if(cfg->issavedet){
+		    //MTA. only the filled part of the device buffer is copied, the page is written in the background
+		    Pdet=mcx_detwriter_getpage(detw);
+           	    cudaMemcpy(Pdet, gPdet,sizeof(float)*MIN(detected,detbuflen)*cfg->his.colcount,cudaMemcpyDeviceToHost);  //MTA
+		    mcx_detwriter_submit(detw,Pdet,MIN(detected,detbuflen));
+		    totaldetected+=detected;
+		    if(detected>=param.detlimit){  // some threads may have stopped early
+		        cudaMemset(gdetected,0,sizeof(uint));
+		        cudaMemcpy(Pseed, gPseed[iter&1], sizeof(uint)*cfg->nthread*RAND_SEED_LEN, cudaMemcpyDeviceToHost);
+		        rand_relaunch_seeds(Pseed,cfg->nthread);
+		        cudaMemcpy(gPseed[iter&1], Pseed, sizeof(uint)*cfg->nthread*RAND_SEED_LEN, cudaMemcpyHostToDevice);
+		        continue;
+		    }
+	       }
+#endif
+               break;
+           }
            tic1=GetTimeMillis();
 	   toc+=tic1-tic0;
            fprintf(cfg->flog,"kernel complete:  \t%d ms\nretrieving fields ... \t",tic1-tic);
 
-
            //mcx_cu_assess(cudaGetLastError(),__FILE__,__LINE__);
-           cudaMemcpy(Plen0,  gPlen,  sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
            cfg->his.totalphoton=0;
            for(i=0;i<cfg->nthread;i++)
-	      cfg->his.totalphoton+=int(Plen0[i].w+0.5f);
-           photoncount+=cfg->his.totalphoton;
-
-//MTA.  This is where detector data is saved.
+	      cfg->his.totalphoton+=int(Plen0[i].w+0.5f);  // the photons done count on across relaunches
+           if(!param.resume)  // resumed photons were counted by the window that launched them
+               photoncount+=cfg->his.totalphoton;
+           if(gparkcount){
+               cudaMemcpy(&nparked, gparkcount,sizeof(uint),cudaMemcpyDeviceToHost);
+               fprintf(cfg->flog,"carried %u photons over\t",nparked);
+           }
 #ifdef SAVE_DETECTORS
-           if(cfg->issavedet){
-           	cudaMemcpy(Pdet, gPdet,sizeof(float)*cfg->maxdetphoton*(cfg->medianum+3),cudaMemcpyDeviceToHost);  //MTA
-	        //mcx_cu_assess(cudaGetLastError(),__FILE__,__LINE__);
-		if(detected>cfg->maxdetphoton){
-			fprintf(cfg->flog,"WARNING: the detected photon (%d) \
-is more than what your have specified (%d), please use the -H option to specify a greater number\t"
-                           ,detected,cfg->maxdetphoton);
-		}else{
-			fprintf(cfg->flog,"detected %d photons\t",detected);
-		}
-		cfg->his.unitinmm=cfg->unitinmm;
-		cfg->his.detected=detected;
-		cfg->his.savedphoton=MIN(detected,cfg->maxdetphoton);
-		if(cfg->exportdetected) //you must allocate the buffer long enough
-	                memcpy(cfg->exportdetected,Pdet,cfg->his.savedphoton*(cfg->medianum+3)*sizeof(float));  //MTA
-		else
-			mcx_savedata(Pdet,cfg->his.savedphoton*(cfg->medianum+3),  //MTA
-		             photoncount>cfg->his.totalphoton,"mch",cfg,"none");
-	   }
+           if(cfg->issavedet)
+               fprintf(cfg->flog,"detected %d photons in %d launches\t",totaldetected-detected0,relaunch+1);
 #endif
 
 
 //MTA. 2 pt distribution is another word for Green's function. Below is where fluence is normalized and saved.
-// I edited these to account for unmodulated (field0) and modulated (field1) fluences
+// I edited these to account for unmodulated (carrier) and modulated (sideband) fluences
 	   //handling the 2pt distributions
            if(cfg->issave2pt){
-               cudaMemcpy(field0, gfield0,sizeof(float) *dimxyz*cfg->maxgate,cudaMemcpyDeviceToHost);
-               cudaMemcpy(field1, gfield1,sizeof(float) *dimxyz*cfg->maxgate,cudaMemcpyDeviceToHost);
-               fprintf(cfg->flog,"transfer complete:\t%d ms\n",GetTimeMillis()-tic);  fflush(cfg->flog);
-
-               if(cfg->respin>1){
-                   for(i=0;i<fieldlen;i++)  //accumulate field, can be done in the GPU
-                      field0[fieldlen+i]+=field0[i];
-                      field1[fieldlen+i]+=field1[i];
-               }
-               if(iter+1==cfg->respin){
-                   if(cfg->respin>1){  //copy the accumulated fields back
-                       memcpy(field0,field0+fieldlen,sizeof(float)*fieldlen);
-                       memcpy(field1,field1+fieldlen,sizeof(float)*fieldlen);
-                       }
+               if(iter+1==respin){  //only the accumulated fields of the last repetition are copied back
+                   cudaMemcpy(field, gfield,sizeof(float) *fieldlen,cudaMemcpyDeviceToHost);
+                   fprintf(cfg->flog,"transfer complete:\t%d ms\n",GetTimeMillis()-tic);  fflush(cfg->flog);
 
                    if(cfg->isnormalized){
                        //normalize field if it is the last iteration, temporarily do it in CPU
@@ -1173,47 +1760,61 @@ is more than what your have specified (%d), please use the -H option to specify
                        fprintf(cfg->flog,"normalizing raw data ...\t");
 
                        cudaMemcpy(energy,genergy,sizeof(float)*cfg->nthread*2,cudaMemcpyDeviceToHost);
-                       eabsorp=0.f;
                        for(i=1;i<cfg->nthread;i++){
                            energy[0]+=energy[i<<1];
        	       	       	   energy[1]+=energy[(i<<1)+1];
                        }
-		       for(i=0;i<cfg->nthread;i++)
-                           eabsorp+=Plen0[i].z;  // the accumulative absorpted energy near the source
                        eabsorp+=energy[1];
                        scale=(cfg->nphoton-energy[0])/(cfg->nphoton*Vvox*cfg->tstep*eabsorp);
 		       if(cfg->unitinmm!=1.f) 
 		          scale/=(cfg->unitinmm*cfg->unitinmm); /* Vvox (already in mm^3) * (Tstep) * (Eabsorp/U) */
                        fprintf(cfg->flog,"normalization factor alpha=%f\n",scale);  fflush(cfg->flog);
-                       mcx_normalize(field0,scale,fieldlen);
-                       mcx_normalize(field1,scale,fieldlen);
+                       mcx_normalize(field,scale,fieldlen);
                    }
                    fprintf(cfg->flog,"data normalization complete : %d ms\n",GetTimeMillis()-tic);
 
 		   if(cfg->exportfield0){ //you must allocate the buffer long enough
-	                   memcpy(cfg->exportfield0,field0,fieldlen*sizeof(float));
-	                   memcpy(cfg->exportfield1,field1,fieldlen*sizeof(float));
+	                   mcx_exportfields(field,param.fieldstride,cfg);
 		   }else{
                            fprintf(cfg->flog,"saving data to file ...\t");
-	                   mcx_savedata(field0,fieldlen,t>cfg->tstart,"mc2",cfg,"0");
-	                   mcx_savedata(field1,fieldlen,t>cfg->tstart,"mc2",cfg,"1");
+	                   mcx_savefields(field,param.fieldstride,t>cfg->tstart,cfg);
                            fprintf(cfg->flog,"saving data complete : %d ms\n\n",GetTimeMillis()-tic);
                            fflush(cfg->flog);
                    }
                }
            }
+           if(cfg->checkpoint && (iter+1<respin || param.twin1<cfg->tend)
+                 && GetTimeMillis()-ckclock>=cfg->checkpoint*1000u){
+               ck=ckrun;
+               ck.isrc=isrc;
+               ck.window=(iter+1<respin ? iwin : iwin+1);
+               ck.iter=(iter+1<respin ? iter+1 : 0);
+               ck.seed=ckseed;
+               ck.ndraw=ndraw-(iter+1<respin ? nseeddraw : 0);  // the next seeds are already drawn
+               ck.photoncount=photoncount;
+               ck.detected=totaldetected;
+               ck.detsaved=(detw ? mcx_detwriter_sync(detw) : 0);
+               ck.eabsorp=eabsorp;
+               mcx_savecheckpoint(session,&ck,gfield,field,genergy,energy,gparkout,nparked);
+               ckclock=GetTimeMillis();
+               fprintf(cfg->flog,"checkpoint saved to %s.ckpt\n",session);
+           }
        }
-       if(param.twin1<cfg->tend){
-            cudaMemset(genergy,0,sizeof(float)*cfg->nthread*2);
-       }
+     }
+
+     if(detw){
+          mcx_detwriter_close(detw,cfg,photoncount,totaldetected);
+          fprintf(cfg->flog,"saved %u detected photons\n",cfg->his.savedphoton);
+          detw=NULL;
      }
 
      cudaMemcpy(Ppos,  gPpos, sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
      cudaMemcpy(Pdir,  gPdir, sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
      cudaMemcpy(Plen,  gPlen, sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
   	 cudaMemcpy(Pao_sums,  gPao_sums, sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);		//MTA added 6/20/12
+  	 cudaMemcpy(Pao_sweep, gPao_sweep, sizeof(float4)*cfg->nthread, cudaMemcpyDeviceToHost);
 	 cudaMemcpy(Pmod,  gPmod, sizeof(float2)*cfg->nthread, cudaMemcpyDeviceToHost);		//MTA added 6/29/12, removed 1/28/13
-     cudaMemcpy(Pseed, gPseed,sizeof(uint)  *cfg->nthread*RAND_SEED_LEN,   cudaMemcpyDeviceToHost);
+     cudaMemcpy(Pseed, gPseed[(respin-1)&1],sizeof(uint)  *cfg->nthread*RAND_SEED_LEN,   cudaMemcpyDeviceToHost);
      cudaMemcpy(energy,genergy,sizeof(float)*cfg->nthread*2,cudaMemcpyDeviceToHost);
 
      for (i=0; i<cfg->nthread; i++) {
@@ -1225,7 +1826,7 @@ is more than what your have specified (%d), please use the -H option to specify
      {
        float totalcount=0.f,hitcount=0.f;
        for (i=0; i<fieldlen; i++)
-          hitcount+=field0[i];
+          hitcount+=field[i];
        for (i=0; i<cfg->nthread; i++)
 	  totalcount+=Pseed[i];
      
@@ -1242,23 +1843,47 @@ is more than what your have specified (%d), please use the -H option to specify
      }
      // total energy here equals total simulated photons+unfinished photons for all threads
      fprintf(cfg->flog,"simulated %d photons (%d) with %d threads (repeat x%d)\nMCX simulation speed: %.2f photon/ms\n",
-             photoncount,cfg->nphoton,cfg->nthread,cfg->respin,(double)photoncount/toc); fflush(cfg->flog);
+             photoncount,cfg->nphoton,cfg->nthread,respin,(double)photoncount/toc); fflush(cfg->flog);
+     fprintf(cfg->flog,"thread utilization: %.1f%% (mean/max loop iterations per thread, %s distribution)\n",
+             100.0*stepsum/(stepspan>0.0 ? stepspan : 1.0),(cfg->isdynamic ? "dynamic" : "static"));
      fprintf(cfg->flog,"exit energy:%16.8e + absorbed energy:%16.8e = total: %16.8e\n",
              energyloss,cfg->nphoton-energyloss,(float)cfg->nphoton);fflush(cfg->flog);
      fflush(cfg->flog);
 
+     if(cfg->checkpoint && isrc+1<cfg->srcnum && GetTimeMillis()-ckclock>=cfg->checkpoint*1000u){
+          ck=ckrun;  // the next source starts afresh
+          ck.isrc=isrc+1;
+          mcx_checkpoint_commit(mcx_checkpoint_create(session,&ck),session);
+          ckclock=GetTimeMillis();
+     }
+     } /*end of the source list*/
+     if(cfg->srcnum)
+          strncpy(cfg->session,session,MAX_SESSION_LENGTH);
+     if(cfg->checkpoint || cfg->isresume)
+          mcx_checkpoint_remove(session);  // the run is complete
+
      cudaFree(gmedia);
      cudaFree(gmedia_acous);	//MTA
-     cudaFree(gfield0);			//MTA
-     cudaFree(gfield1);			//MTA
+     cudaFree(gfield);			//MTA
      cudaFree(gPpos);
      cudaFree(gPdir);
      cudaFree(gPlen);
-     cudaFree(gPseed);
+     cudaFree(gPseed[0]);
+     cudaFree(gPseed[1]);
+     cudaStreamDestroy(kernelstream);
+     cudaStreamDestroy(copystream);
      cudaFree(genergy);
      cudaFree(gPdet);
      cudaFree(gdetected);
+     cudaFree(gphotonpool);
+     cudaFree(gPsteps);
+     cudaFree(gdetgrid);
+     cudaFree(gscattable);
+     cudaFree(gparkin);
+     cudaFree(gparkout);
+     cudaFree(gparkcount);
  	 cudaFree(gPao_sums);		//MTA
+ 	 cudaFree(gPao_sweep);
  	 cudaFree(gPmod);			//MTA
 
      cudaThreadExit();
@@ -1267,12 +1892,12 @@ is more than what your have specified (%d), please use the -H option to specify
      free(Pdir);
      free(Plen);
      free(Plen0);
-     free(Pseed);
-     free(Pdet);
+     free(Psteps);
+     cudaFreeHost(Pseed);
      free(energy);
-     free(field0);				//MTA
-     free(field1);				//MTA
+     free(field);				//MTA
 	 free(Pao_sums);			//MTA
+	 free(Pao_sweep);
 	 free(Pmod);				//MTA
 }
 
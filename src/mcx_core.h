@@ -29,6 +29,20 @@ typedef struct MCXAcoustO{
 	float Pdsinj;
 }MCXAO;
 
+/*
+   extra sums of the acoustic-phase sweep (-x); Pncosi/Pnsini and Pdcosj
+   rotate with the ultrasound phase, Pdsinj is a rotating part plus a
+   phase-free part, so one set of sums gives the modulation of every offset.
+   The displacement terms scale with aokj~1/f while Pdsinj0 and the index
+   terms do not, so the same sums also serve the frequencies of -F
+*/
+typedef struct MCXAOSweep{
+	float Pdcosjq;   // quadrature of Pdcosj, P*cos(USphase) terms of all scattering events
+	float Pdsinjq;   // quadrature of Pdsinjr
+	float Pdsinjr;   // rotating part of Pdsinj, events along the z axis
+	float Pdsinj0;   // phase-free part of Pdsinj, aosinj*n of the other events
+}MCXAOSweep;
+
 //MTA new structure
 typedef struct MCXModulation{
 	float magnitude;
@@ -73,6 +87,19 @@ typedef union GProperty{
 typedef unsigned char uchar;
 typedef unsigned short ushort;	//MTA Added 6/26/12
 
+/*
+   photon still alive at the end of a time window in the streaming mode (-D),
+   the next window resumes it instead of relaunching from the source; each
+   record is followed by maxmedia partial path lengths when saving detectors
+*/
+typedef struct MCXParked{
+	MCXpos p;
+	MCXdir v;
+	MCXtime f;        /*ndone holds the bits of the photon index, the stream of a counter-based RNG*/
+	MCXAO ao_sums;
+	MCXAOSweep ao_sweep;
+}MCXParked;
+
 typedef struct  __align__(16) KernelParams {
   float gridunit;
   float3 vsize;
@@ -93,6 +120,31 @@ typedef struct  __align__(16) KernelParams {
   unsigned int detnum;
   unsigned int idx1dorig;
   unsigned int mediaidorig;
+  unsigned int detlimit;  /*no new photon once this many are detected, the rest of maxdetphoton takes those in flight*/
+  uint3  acorig,acdim;   /*bounding box of the stored acoustic field*/
+  float  acscale;        /*>0: the field is stored as AcousticsQ with this pressure step*/
+  unsigned int aotable;  /*1: the field is stored as precomputed AOCoef records*/
+  float  aoki;           /*refractive index modulation per unit n*step, times AOCoef.Ci/Si*/
+  float  aokj;           /*scatterer displacement modulation per unit n, times AOCoef.S/C.d*/
+  float  aosinj;         /*Pdsinj increment per unit n of a regular scattering event*/
+  float3 detgridorig;    /*detector lookup grid, see mcx_builddetgrid*/
+  float  detgridscale;
+  uint3  detgriddim;
+  unsigned int phasenum;    /*phase offsets of the sweep in gphase[], 0 for none*/
+  unsigned int freqnum;     /*acoustic frequencies in gfreq[], 0 for Acon.f only*/
+  unsigned int issweep;     /*1 to accumulate MCXAOSweep, set by -x or -F*/
+  unsigned int variantnum;  /*phases x frequencies, one modulation per variant*/
+  unsigned int sidebands;   /*bit n set: deposit the n-th sideband, -J*/
+  unsigned int fieldstride; /*field elements per variant, dimlen.z*maxgate*/
+  unsigned int bandstride;  /*field elements per sideband, fieldstride*variantnum*/
+  unsigned int reclen;      /*floats per detected photon record*/
+  unsigned int streamgate;  /*1: park the photons alive at twin1 instead of terminating them, -D*/
+  unsigned int resume;      /*1: the photons of this window are the parked ones, no new launches*/
+  unsigned int parkreclen;  /*floats per parked photon, MCXParked plus the partial paths*/
+  float  roulettesize;      /*survivors of the roulette below minenergy carry this multiple of their weight*/
+  unsigned int dda;         /*1: step to the next voxel face or scattering site instead of minstep, -j*/
+  unsigned int scatlut;     /*1: sample the scattering angles from the tables of mcx_buildscattable(), -Q*/
+  unsigned int dynamic;     /*1: the threads claim photons (or parked records) from a shared counter, -V*/
 }MCXParam;
 
 void mcx_run_simulation(Config *cfg);
@@ -0,0 +1,1696 @@
+/*******************************************************************************
+**
+**  Acousto-Optic MCX (AO-MCX) - Matt Adams <adamsm2@bu.edu>
+**
+**	Written based on:
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated 3D Monte Carlo transport simulation
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  Reference (Fang2009):
+**        Qianqian Fang and David A. Boas, "Monte Carlo Simulation of Photon
+**        Migration in 3D Turbid Media Accelerated by Graphics Processing
+**        Units," Optics Express, vol. 17, issue 22, pp. 20178-20190 (2009)
+**
+**  mcx_cpu.c: multi-threaded CPU transport engine, a host port of
+**             mcx_main_loop() in mcx_core.cu for nodes without a GPU
+**
+**  License: GNU General Public License v3, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#define _GNU_SOURCE          /* j0f/j1f are GNU extensions of libm */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+#include "mcx_cpu.h"
+#include "mcx_core.h"
+#include "mcx_const.h"
+#include "mcx_bessel.h"
+#include "mcx_detwriter.h"
+#include "mcx_checkpoint.h"
+
+/* the Logistic-Lattice and Philox RNGs are plain C, reuse the GPU versions on the host */
+#ifndef __CUDACC__
+  #define __device__
+#endif
+#ifdef USE_PHILOX_RAND
+  #include "philox_rand.cu"
+#else
+  #include "logistic_rand.cu"
+#endif
+
+/*
+   read-only data shared by all workers, this mirrors the constant/global
+   memory of the GPU kernel (gcfg, gproperty, gmedia_acous, gdetpos, detgrid); the
+   acoustic constants are folded into param.aoki/aokj/aosinj
+*/
+typedef struct MCXCPUDomain{
+	MCXParam param;
+	const Medium *prop;
+	const Acoustics *pressure;
+	const AcousticsQ *qpressure;  /*used instead of pressure when param.acscale>0*/
+	const AOCoef *aotable;        /*used instead of both when param.aotable is set*/
+	const float4 *detpos;
+	const uint *detgrid;           /*detector lookup grid, see mcx_builddetgrid*/
+	const float2 *scattable;       /*scattering angle tables when param.scatlut is set, see mcx_buildscattable*/
+	const uchar *media;
+	const float2 *phase;   /*cos/sin of the sweep offsets, gphase[] of the kernel*/
+	const float *freq;     /*Acon.f over each frequency of -F, gfreq[] of the kernel*/
+	DetWriter *detw;       /*background .mch writer, owns the detected photon pages*/
+	uint  *detected;       /*shared detected photon counter*/
+	uint  *photonpool;     /*shared {next photon, photons of the launch} with -V, photonpool[] of the kernel*/
+	const size_t *parkstart;           /*first pooled index of the parked photons of each worker, -V with -D*/
+	const struct MCXCPUWorker *workers;
+} MCXCPUDomain;
+
+/*
+   the CPU kernel advances MCX_SIMD_LANES photons of one worker in lockstep;
+   the per-lane state is stored as structure-of-arrays so that the free-path
+   advance (the hot part of the loop) maps onto AVX2/AVX-512 registers
+*/
+#define MCX_SIMD_LANES     16
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+  #define MCX_SIMD_DISPATCH  1
+  #define MCX_SIMD_CLONES    __attribute__((target_clones("avx512f","avx2","default")))
+#else
+  #define MCX_SIMD_DISPATCH  0
+  #define MCX_SIMD_CLONES
+#endif
+
+#if MCX_SIMD_DISPATCH
+  /*the vector variant is provided by glibc's libmvec*/
+  __attribute__((simd("notinbranch"))) extern float expf(float);
+#endif
+
+typedef struct __attribute__((aligned(64))) MCXCPULanes{
+	float px[MCX_SIMD_LANES],py[MCX_SIMD_LANES],pz[MCX_SIMD_LANES],pw[MCX_SIMD_LANES];   /*MCXpos*/
+	float x0[MCX_SIMD_LANES],y0[MCX_SIMD_LANES],z0[MCX_SIMD_LANES],w0[MCX_SIMD_LANES];   /*p0, position before the step*/
+	float vx[MCX_SIMD_LANES],vy[MCX_SIMD_LANES],vz[MCX_SIMD_LANES],nscat[MCX_SIMD_LANES];/*MCXdir*/
+	float pscat[MCX_SIMD_LANES],t[MCX_SIMD_LANES],tnext[MCX_SIMD_LANES],ndone[MCX_SIMD_LANES]; /*MCXtime*/
+	float Pncosi[MCX_SIMD_LANES],Pnsini[MCX_SIMD_LANES],Pdcosj[MCX_SIMD_LANES],Pdsinj[MCX_SIMD_LANES]; /*MCXAO*/
+	float Pdcosjq[MCX_SIMD_LANES],Pdsinjq[MCX_SIMD_LANES],Pdsinjr[MCX_SIMD_LANES],Pdsinj0[MCX_SIMD_LANES]; /*MCXAOSweep*/
+	float mag[MCX_SIMD_LANES],phi[MCX_SIMD_LANES];                                      /*Modulation*/
+	float mua[MCX_SIMD_LANES],mus[MCX_SIMD_LANES],g[MCX_SIMD_LANES],n[MCX_SIMD_LANES];  /*Medium*/
+	float Sx[MCX_SIMD_LANES],Sy[MCX_SIMD_LANES],Sz[MCX_SIMD_LANES],Ci[MCX_SIMD_LANES];   /*AOCoef*/
+	float Cx[MCX_SIMD_LANES],Cy[MCX_SIMD_LANES],Cz[MCX_SIMD_LANES],Si[MCX_SIMD_LANES];
+	float n1[MCX_SIMD_LANES];
+	float steplen[MCX_SIMD_LANES];  /*path length of the last step, unit=grid*/
+	float ddalen[MCX_SIMD_LANES],ddaflip[MCX_SIMD_LANES];  /*face distance or end and the face axis of the last step, -j*/
+	uint  idx1d[MCX_SIMD_LANES];
+	uint  mediaid[MCX_SIMD_LANES];
+	int   active[MCX_SIMD_LANES];   /*0 once the lane has used up the photon budget*/
+	uint  photonid[MCX_SIMD_LANES]; /*index of the photon in the launch, its stream of a counter-based RNG*/
+	RandType rt[MCX_SIMD_LANES][RAND_BUF_LEN],rtnew[MCX_SIMD_LANES][RAND_BUF_LEN];
+} MCXCPULanes;
+
+/*
+   scalar view of one lane, the scattering and boundary phases of the
+   kernel are branchy and run lane-by-lane on this copy
+*/
+typedef struct MCXCPUPhoton{
+	MCXpos p,p0;
+	MCXdir v;
+	MCXtime f;
+	MCXAO ao_sums;
+	MCXAOSweep ao_sweep;
+	Modulation mod;
+	Medium prop;
+	AOCoef aoc;
+	float n1;
+	uint idx1d;
+	uchar mediaid;
+	uint photonid;
+} MCXCPUPhoton;
+
+/*
+   the per-thread field buffers are split into tiles of MCX_TILE_LEN voxels of
+   one variant (phase/frequency), a tile holds one section of MCX_TILE_LEN per
+   sideband of the set, and is only allocated when a photon of this thread
+   deposits inside it
+*/
+#define MCX_TILE_BITS   12
+#define MCX_TILE_LEN    (1<<MCX_TILE_BITS)
+
+#define MCX_CLAIM_LEN   16    /*photons a worker claims from the shared counter at a time, -V*/
+#define MCX_CKPT_CHUNKS 16    /*launches a repetition is split into with -K/-Z, a checkpoint may follow each*/
+
+/*
+   private state of one worker thread, each worker owns its RNG and a
+   private sparse copy of the sideband fields, so that the accumulation is race-free
+*/
+typedef struct MCXCPUWorker{
+	float **tiles;         /*ntile pointers, NULL if the tile was never touched*/
+	size_t tilelen;        /*MCX_TILE_LEN x sidebands*/
+	size_t ntouched;       /*number of allocated tiles*/
+	float *ppath;          /*MCX_SIMD_LANES x maxmedia partial path buffer*/
+	double energyloss;     /*double, float sums stop growing once they are ~1e7 times a deposit*/
+	double energyabsorbed;
+	double accumweight;    /*absorbed energy near the source (-R) of the last launch*/
+	uint  ndone;           /*photons this worker finished in the last launch*/
+	float4 pos,dir,len,ao;
+	float2 mod;
+	float *detpage;        /*detected photon page being filled, from dom->detw*/
+	unsigned int ndet;     /*records in detpage*/
+	float *parkin,*parkout;     /*photons parked by the previous/current time window, -D*/
+	size_t nparkin,nparkout;    /*records in parkin/parkout*/
+	size_t parkincap,parkoutcap;
+	size_t parknext;            /*next record of parkin to resume*/
+	uint  nextid;               /*index of the next new photon of this worker*/
+	uint  claimend;             /*end of the photons claimed by this worker, -V*/
+	int   quota;                /*photons this worker may still start without -V*/
+	int   drained;              /*1 once this worker has no photon left to start*/
+	double busy;                /*seconds from the start of the last launch until this worker was done*/
+	uint  seed[MCX_SIMD_LANES*RAND_SEED_LEN];
+} MCXCPUWorker;
+
+static double mcx_cpu_seconds(void){
+#ifdef _OPENMP
+     return omp_get_wtime();
+#else
+     return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+static unsigned int mcx_cpu_millis(void){
+     return (unsigned int)(mcx_cpu_seconds()*1000.0);
+}
+
+/**
+   number of photons advanced in lockstep, picked by the widest vector
+   unit of the host CPU; the matching clone of cpu_lane_advance() is
+   selected by the loader at the same time
+*/
+static int mcx_cpu_simdlanes(void){
+#if MCX_SIMD_DISPATCH
+     __builtin_cpu_init();
+     if(__builtin_cpu_supports("avx512f"))
+          return 16;
+     if(__builtin_cpu_supports("avx2"))
+          return 8;
+#endif
+     return 4;
+}
+
+static void cpu_clearpath(float *p,int maxmediatype){
+      int i;
+      for(i=0;i<maxmediatype;i++)
+           p[i]=0.f;
+}
+
+/*
+   AO terms of the voxel idx1d; the acoustic field only covers the box
+   [acorig,acorig+acdim), voxels outside of the box are not insonified.
+   without a precomputed table the terms are folded once per voxel visit
+*/
+static void cpu_loadaocoef(const MCXCPUDomain *dom,uchar mediaid,uint idx1d,AOCoef *coef){
+      const MCXParam *gcfg=&dom->param;
+      uint ix=idx1d%gcfg->dimlen.x-gcfg->acorig.x;
+      uint iy=idx1d%gcfg->dimlen.y/gcfg->dimlen.x-gcfg->acorig.y;
+      uint iz=idx1d/gcfg->dimlen.y-gcfg->acorig.z;
+      if(mediaid!=0 && ix<gcfg->acdim.x && iy<gcfg->acdim.y && iz<gcfg->acdim.z){
+           Acoustics pressure;
+           ix=(iz*gcfg->acdim.y+iy)*gcfg->acdim.x+ix;
+           if(gcfg->aotable){
+                *coef=dom->aotable[ix];
+                return;
+           }
+           if(gcfg->acscale>0.f){
+                const AcousticsQ *q=dom->qpressure+ix;
+                pressure.Px=q->Px*gcfg->acscale;
+                pressure.Py=q->Py*gcfg->acscale;
+                pressure.Pz=q->Pz*gcfg->acscale;
+                pressure.USphase=q->USphase*(TWO_PI/65536.f);
+           }else
+                pressure=dom->pressure[ix];
+           mcx_aocoef(&pressure,coef);
+      }else{
+           memset(coef,0,sizeof(AOCoef));
+      }
+}
+
+static void cpu_lane_setaocoef(MCXCPULanes *L,int i,const AOCoef *c){
+      L->Sx[i]=c->Sx; L->Sy[i]=c->Sy; L->Sz[i]=c->Sz; L->Ci[i]=c->Ci;
+      L->Cx[i]=c->Cx; L->Cy[i]=c->Cy; L->Cz[i]=c->Cz; L->Si[i]=c->Si;
+}
+
+static void cpu_lane_load(const MCXCPULanes *L,int i,MCXCPUPhoton *ph){
+      ph->p.x=L->px[i]; ph->p.y=L->py[i]; ph->p.z=L->pz[i]; ph->p.w=L->pw[i];
+      ph->p0.x=L->x0[i]; ph->p0.y=L->y0[i]; ph->p0.z=L->z0[i]; ph->p0.w=L->w0[i];
+      ph->v.x=L->vx[i]; ph->v.y=L->vy[i]; ph->v.z=L->vz[i]; ph->v.nscat=L->nscat[i];
+      ph->f.pscat=L->pscat[i]; ph->f.t=L->t[i]; ph->f.tnext=L->tnext[i]; ph->f.ndone=L->ndone[i];
+      ph->ao_sums.Pncosi=L->Pncosi[i]; ph->ao_sums.Pnsini=L->Pnsini[i];
+      ph->ao_sums.Pdcosj=L->Pdcosj[i]; ph->ao_sums.Pdsinj=L->Pdsinj[i];
+      ph->ao_sweep.Pdcosjq=L->Pdcosjq[i]; ph->ao_sweep.Pdsinjq=L->Pdsinjq[i];
+      ph->ao_sweep.Pdsinjr=L->Pdsinjr[i]; ph->ao_sweep.Pdsinj0=L->Pdsinj0[i];
+      ph->mod.magnitude=L->mag[i]; ph->mod.phi=L->phi[i];
+      ph->prop.mua=L->mua[i]; ph->prop.mus=L->mus[i]; ph->prop.g=L->g[i]; ph->prop.n=L->n[i];
+      ph->aoc.Sx=L->Sx[i]; ph->aoc.Sy=L->Sy[i]; ph->aoc.Sz=L->Sz[i]; ph->aoc.Ci=L->Ci[i];
+      ph->aoc.Cx=L->Cx[i]; ph->aoc.Cy=L->Cy[i]; ph->aoc.Cz=L->Cz[i]; ph->aoc.Si=L->Si[i];
+      ph->n1=L->n1[i];
+      ph->idx1d=L->idx1d[i];
+      ph->mediaid=L->mediaid[i];
+      ph->photonid=L->photonid[i];
+}
+
+static void cpu_lane_store(MCXCPULanes *L,int i,const MCXCPUPhoton *ph){
+      L->px[i]=ph->p.x; L->py[i]=ph->p.y; L->pz[i]=ph->p.z; L->pw[i]=ph->p.w;
+      L->x0[i]=ph->p0.x; L->y0[i]=ph->p0.y; L->z0[i]=ph->p0.z; L->w0[i]=ph->p0.w;
+      L->vx[i]=ph->v.x; L->vy[i]=ph->v.y; L->vz[i]=ph->v.z; L->nscat[i]=ph->v.nscat;
+      L->pscat[i]=ph->f.pscat; L->t[i]=ph->f.t; L->tnext[i]=ph->f.tnext; L->ndone[i]=ph->f.ndone;
+      L->Pncosi[i]=ph->ao_sums.Pncosi; L->Pnsini[i]=ph->ao_sums.Pnsini;
+      L->Pdcosj[i]=ph->ao_sums.Pdcosj; L->Pdsinj[i]=ph->ao_sums.Pdsinj;
+      L->Pdcosjq[i]=ph->ao_sweep.Pdcosjq; L->Pdsinjq[i]=ph->ao_sweep.Pdsinjq;
+      L->Pdsinjr[i]=ph->ao_sweep.Pdsinjr; L->Pdsinj0[i]=ph->ao_sweep.Pdsinj0;
+      L->mag[i]=ph->mod.magnitude; L->phi[i]=ph->mod.phi;
+      L->mua[i]=ph->prop.mua; L->mus[i]=ph->prop.mus; L->g[i]=ph->prop.g; L->n[i]=ph->prop.n;
+      cpu_lane_setaocoef(L,i,&ph->aoc);
+      L->n1[i]=ph->n1;
+      L->idx1d[i]=ph->idx1d;
+      L->mediaid[i]=ph->mediaid;
+      L->photonid[i]=ph->photonid;
+}
+
+static uint cpu_finddetector(const MCXCPUDomain *dom,MCXpos *p0){
+      uint i,j,end;
+      const float4 *gdetpos=dom->detpos;
+      const MCXParam *gcfg=&dom->param;
+      float cx=(p0->x-gcfg->detgridorig.x)*gcfg->detgridscale;
+      float cy=(p0->y-gcfg->detgridorig.y)*gcfg->detgridscale;
+      float cz=(p0->z-gcfg->detgridorig.z)*gcfg->detgridscale;
+      if(!(cx>=0.f && cy>=0.f && cz>=0.f && cx<gcfg->detgriddim.x && cy<gcfg->detgriddim.y && cz<gcfg->detgriddim.z))
+          return 0;
+      j=((uint)cz*gcfg->detgriddim.y+(uint)cy)*gcfg->detgriddim.x+(uint)cx;
+      for(end=dom->detgrid[j+1],j=dom->detgrid[j];j<end;j++){
+        i=dom->detgrid[j];
+      	if((gdetpos[i].x-p0->x)*(gdetpos[i].x-p0->x)+
+	   (gdetpos[i].y-p0->y)*(gdetpos[i].y-p0->y)+
+	   (gdetpos[i].z-p0->z)*(gdetpos[i].z-p0->z) < gdetpos[i].w*gdetpos[i].w){
+	        return i+1;
+	   }
+      }
+      return 0;
+}
+
+/**
+   magnitude and phase of the accumulated AO modulation, same quadrants as
+   in mcx_main_loop(); the CPU engine only evaluates it where it is consumed
+*/
+static void cpu_modulation(const MCXAO *ao_sums,Modulation *mod){
+      float re=ao_sums->Pncosi+ao_sums->Pdcosj;
+      float im=-ao_sums->Pnsini-ao_sums->Pdsinj;
+      float phi=(re!=0.f) ? atanf(im/re) : copysignf(ONE_PI/2.f,im);
+
+      if(re<0.f)
+           phi+=(im>=0.f) ? ONE_PI : -ONE_PI;
+      if((re==0.f && im==0.f) || phi!=phi){
+           mod->magnitude=0.f;
+           mod->phi=0.f;
+           return;
+      }
+      mod->magnitude=sqrtf(re*re+im*im);
+      mod->phi=phi;
+}
+
+/**
+   modulation of the v-th variant, the phase v/freqnum of the sweep (-x) at
+   the frequency v%freqnum (-F): the AO terms are linear in P*cos(USphase) and
+   P*sin(USphase), an offset of the ultrasound phase only rotates the sums,
+   and the displacement terms scale with 1/f, see mcx_main_loop()
+*/
+static void cpu_phasemodulation(const MCXCPUDomain *dom,const MCXAO *ao_sums,const MCXAOSweep *ao_sweep,uint v,Modulation *mod){
+      const MCXParam *gcfg=&dom->param;
+      MCXAO ao;
+      float c=1.f,s=0.f,r=1.f;
+      if(!gcfg->issweep){
+           cpu_modulation(ao_sums,mod);
+           return;
+      }
+      if(gcfg->freqnum){
+           r=dom->freq[v%gcfg->freqnum];
+           v/=gcfg->freqnum;
+      }
+      if(gcfg->phasenum){
+           c=dom->phase[v].x;
+           s=dom->phase[v].y;
+      }
+      ao.Pncosi=ao_sums->Pncosi*c+ao_sums->Pnsini*s;
+      ao.Pnsini=ao_sums->Pnsini*c-ao_sums->Pncosi*s;
+      ao.Pdcosj=(ao_sums->Pdcosj*c+ao_sweep->Pdcosjq*s)*r;
+      ao.Pdsinj=(ao_sweep->Pdsinjr*c-ao_sweep->Pdsinjq*s)*r+ao_sweep->Pdsinj0;
+      cpu_modulation(&ao,mod);
+}
+
+/*
+   return the private tile that holds the voxel fieldidx, allocate it on the
+   first deposit, a tile is only ever touched by its owner thread
+*/
+static float *cpu_fieldtile(MCXCPUWorker *w,size_t fieldidx){
+     float **tile=w->tiles+(fieldidx>>MCX_TILE_BITS);
+     if(*tile==NULL){
+          *tile=(float *)calloc(sizeof(float),w->tilelen);
+          if(*tile==NULL)
+               mcx_error(-3,"not enough host memory for the per-thread field tiles",__FILE__,__LINE__);
+          w->ntouched++;
+     }
+     return *tile;
+}
+
+/**
+   appends a detected photon to the page of this worker, full pages are
+   handed to the background writer, so the number of saved photons is not
+   limited by maxdetphoton
+*/
+static void cpu_savedetphoton(const MCXCPUDomain *dom,MCXCPUWorker *w,float weight,const MCXAO *ao_sums,
+                              const MCXAOSweep *ao_sweep,float *ppath,MCXpos *p0){
+      uint j,k=0;
+      const MCXParam *gcfg=&dom->param;
+      Modulation mod;
+      float *n_det;
+      j=cpu_finddetector(dom,p0);
+      if(j){
+#ifdef _OPENMP
+         #pragma omp atomic
+#endif
+	 (*dom->detected)++;
+	 if(w->detpage==NULL){
+	    w->detpage=mcx_detwriter_getpage(dom->detw);
+	    w->ndet=0;
+	 }
+	 n_det=w->detpage+(size_t)w->ndet*gcfg->reclen;
+	 *n_det++=j;
+	 *n_det++=weight;
+	 do{
+	    cpu_phasemodulation(dom,ao_sums,ao_sweep,k,&mod);
+	    *n_det++=mod.magnitude;
+	    *n_det++=mod.phi;
+	 }while(++k<gcfg->variantnum);
+	 for(j=0;j<gcfg->maxmedia;j++)
+	    n_det[j]=ppath[j];
+	 if(++w->ndet==dom->detw->pagelen){
+	    mcx_detwriter_submit(dom->detw,w->detpage,w->ndet);
+	    w->detpage=NULL;
+	 }
+      }
+}
+
+/**
+   accumulates the fluence of the current step to the private field tiles,
+   one deposit per variant and sideband
+*/
+static void cpu_deposit(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPUPhoton *ph,double *accumweight){
+     const MCXParam *gcfg=&dom->param;
+     size_t fieldidx;
+     float *tile,j0,j1;
+     uint k=0,n,bands;
+
+     if(ph->f.t>=ph->f.tnext){
+        MCXpos p=ph->p;
+        // if t is within the time window, which spans cfg->maxgate*cfg->tstep wide
+        if(gcfg->save2pt && ph->f.t>=gcfg->twin0 && ph->f.t<gcfg->twin1){
+             w->energyabsorbed+=p.w*ph->prop.mua;
+             // the field buffers are private to this worker, no atomics are needed
+             if(gcfg->skipradius2>EPS && (p.x-gcfg->ps.x)*(p.x-gcfg->ps.x)+(p.y-gcfg->ps.y)*(p.y-gcfg->ps.y)+
+                  (p.z-gcfg->ps.z)*(p.z-gcfg->ps.z)<=gcfg->skipradius2){
+                 *accumweight+=p.w*ph->prop.mua; // weight*absorption
+             }else{
+                 fieldidx=ph->idx1d+(size_t)(floorf((ph->f.t-gcfg->twin0)*gcfg->Rtstep))*gcfg->dimlen.z;
+                 do{  // one deposit per variant, the transport is shared by all of them
+                     cpu_phasemodulation(dom,&ph->ao_sums,&ph->ao_sweep,k,&ph->mod);
+                     tile=cpu_fieldtile(w,fieldidx)+(fieldidx&(MCX_TILE_LEN-1));
+                     mcx_besselj01(ph->mod.magnitude,&j0,&j1);
+                     for(bands=gcfg->sidebands,n=0;bands;bands>>=1,n++)
+                         if(bands&1){
+                             *tile+=p.w*mcx_aoweight(n,ph->mod.magnitude,j0,j1);
+                             tile+=MCX_TILE_LEN;
+                         }
+                     fieldidx+=gcfg->fieldstride;
+                 }while(++k<gcfg->variantnum);
+             }
+        }
+        ph->f.tnext+=gcfg->minaccumtime*ph->prop.n; // fluence is a temporal-integration, unit=s
+     }
+}
+
+/**
+   deposits of a straight step ending at ph->p in the DDA mode (-j), each
+   sampling time the step passed before tlim is traced back along v, see
+   savesegment() in mcx_core.cu
+*/
+static void cpu_depositstep(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPUPhoton *ph,float tlim,double *accumweight){
+     const MCXParam *gcfg=&dom->param;
+     MCXCPUPhoton q;
+     float back;
+
+     if(ph->f.tnext>ph->f.t)
+         return;
+     q=*ph;
+     while(ph->f.tnext<=ph->f.t && ph->f.tnext<tlim){
+         back=(ph->f.t-ph->f.tnext)/(ph->prop.n*gcfg->oneoverc0); // unit=grid
+         q.p.x=ph->p.x-ph->v.x*back;
+         q.p.y=ph->p.y-ph->v.y*back;
+         q.p.z=ph->p.z-ph->v.z*back;
+         q.p.w=ph->p.w*expf(ph->prop.mua*back);
+         q.f.t=q.f.tnext=ph->f.tnext;
+         if(q.p.x>=0.f&&q.p.y>=0.f&&q.p.z>=0.f&&q.p.x<gcfg->maxidx.x&&q.p.y<gcfg->maxidx.y&&q.p.z<gcfg->maxidx.z){
+             q.idx1d=((int)(floorf(q.p.z))*gcfg->dimlen.y+(int)(floorf(q.p.y))*gcfg->dimlen.x+(int)(floorf(q.p.x)));
+             cpu_deposit(dom,w,&q,accumweight);
+         }
+         ph->f.tnext+=gcfg->minaccumtime*ph->prop.n;
+     }
+}
+
+/*
+   the next photon a worker starts, its index or in a resumed window (-D) that of
+   its parked record; without -V each worker runs its own share, with -V it claims
+   MCX_CLAIM_LEN photons at a time from dom->photonpool; 0 once none is left
+*/
+static int cpu_claimphoton(const MCXCPUDomain *dom,MCXCPUWorker *w,uint *id){
+      uint start;
+
+      if(!dom->param.dynamic){
+          if(w->quota<=0)
+              return 0;
+          w->quota--;
+          *id=(dom->param.resume ? (uint)(w->parknext++) : w->nextid++);
+          return 1;
+      }
+      if(w->nextid>=w->claimend){
+#ifdef _OPENMP
+          #pragma omp atomic capture
+#endif
+          {start=dom->photonpool[0]; dom->photonpool[0]+=MCX_CLAIM_LEN;}
+          if(start>=dom->photonpool[1])
+              return 0;
+          w->nextid=start;
+          w->claimend=MIN(start+MCX_CLAIM_LEN,dom->photonpool[1]);
+      }
+      *id=w->nextid++;
+      return 1;
+}
+
+/*the parked record of index id, -D; with -V the indices run over the parked photons of all workers*/
+static const float *cpu_parkedrecord(const MCXCPUDomain *dom,const MCXCPUWorker *w,uint id){
+      int j=0;
+
+      if(!dom->param.dynamic)
+          return w->parkin+(size_t)id*dom->param.parkreclen;
+      while(id>=dom->parkstart[j+1])
+          j++;
+      return dom->workers[j].parkin+(size_t)(id-dom->parkstart[j])*dom->param.parkreclen;
+}
+
+/**
+   loads the next photon of a lane: a new one at the source, or in a resumed
+   time window (-D) the next parked photon; a resumed photon makes the deposit
+   that its last step owed to this window; the lane RNG t/tnew moves on to the
+   stream of the photon; the lane keeps its photon and w->drained is set once
+   cpu_claimphoton() has none left
+*/
+static void cpu_nextphoton(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPUPhoton *ph,RandType *t,RandType *tnew,
+        float ppath[],double *accumweight){
+      const MCXParam *gcfg=&dom->param;
+      uint id;
+
+      if(w->drained || !cpu_claimphoton(dom,w,&id)){
+         w->drained=1;
+         return;
+      }
+      if(gcfg->resume){
+         const float *rec=cpu_parkedrecord(dom,w,id);
+         MCXParked pk;
+         float ndone=ph->f.ndone;
+         memcpy(&pk,rec,sizeof(MCXParked));
+         ph->p=pk.p;
+         ph->v=pk.v;
+         ph->f=pk.f;
+         memcpy(&ph->photonid,&pk.f.ndone,sizeof(uint));
+         ph->f.ndone=ndone;
+         ph->ao_sums=pk.ao_sums;
+         ph->ao_sweep=pk.ao_sweep;
+         ph->mod.magnitude=0.f; ph->mod.phi=0.f;
+         if(gcfg->savedet)
+             memcpy(ppath,rec+sizeof(MCXParked)/sizeof(float),sizeof(float)*gcfg->maxmedia);
+         w->energyloss-=ph->p.w;  // booked as lost when it was parked
+         ph->idx1d=((int)(floorf(ph->p.z))*gcfg->dimlen.y+(int)(floorf(ph->p.y))*gcfg->dimlen.x+(int)(floorf(ph->p.x)));
+         ph->mediaid=(dom->media[ph->idx1d] & MED_MASK);
+         ph->prop=dom->prop[ph->mediaid];
+         cpu_loadaocoef(dom,ph->mediaid,ph->idx1d,&ph->aoc);
+         if(gcfg->dda)
+             cpu_depositstep(dom,w,ph,VERY_BIG,accumweight);
+         else
+             cpu_deposit(dom,w,ph,accumweight);
+         rand_photon_start(t,tnew,ph->photonid);
+         return;
+      }
+      ph->p=gcfg->ps;
+      ph->v.x=gcfg->c0.x; ph->v.y=gcfg->c0.y; ph->v.z=gcfg->c0.z; ph->v.nscat=gcfg->c0.w;
+      ph->f.pscat=0.f; ph->f.t=0.f; ph->f.tnext=gcfg->minaccumtime;
+      ph->mod.magnitude=0.f; ph->mod.phi=0.f;
+      memset(&ph->ao_sums,0,sizeof(MCXAO));
+      memset(&ph->ao_sweep,0,sizeof(MCXAOSweep));
+      ph->idx1d=gcfg->idx1dorig;
+      ph->mediaid=gcfg->mediaidorig;
+      ph->prop=dom->prop[ph->mediaid];
+      cpu_loadaocoef(dom,ph->mediaid,ph->idx1d,&ph->aoc);
+      ph->photonid=id;
+      rand_photon_start(t,tnew,ph->photonid);
+}
+
+static void cpu_launchnewphoton(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPUPhoton *ph,RandType *t,RandType *tnew,
+        uchar isdet,float ppath[],double *accumweight){
+      const MCXParam *gcfg=&dom->param;
+
+      w->energyloss+=ph->p.w;  // sum all the remaining energy
+
+      if(gcfg->savedet){
+         if(ph->mediaid==0 && isdet){
+	     cpu_savedetphoton(dom,w,ph->v.nscat,&ph->ao_sums,&ph->ao_sweep,ppath,&ph->p);
+         }
+	 cpu_clearpath(ppath,gcfg->maxmedia);
+      }
+      ph->f.ndone=ph->f.ndone+1;
+      w->ndone++;
+      cpu_nextphoton(dom,w,ph,t,tnew,ppath,accumweight);
+}
+
+/**
+   stores a photon that outlived the time window (-D) for the next window and
+   loads the next photon of the lane; the parked weight is booked as lost so
+   that the normalization of this window matches a relaunched run, the photon
+   index takes the place of f.ndone
+*/
+static void cpu_parkphoton(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPUPhoton *ph,RandType *t,RandType *tnew,
+        float ppath[],double *accumweight){
+      const MCXParam *gcfg=&dom->param;
+      MCXParked pk;
+      float *rec;
+
+      if(w->nparkout==w->parkoutcap){
+         w->parkoutcap=MAX(w->parkoutcap*2,1024);
+         w->parkout=(float *)realloc(w->parkout,sizeof(float)*gcfg->parkreclen*w->parkoutcap);
+         if(w->parkout==NULL)
+             mcx_error(-3,"not enough host memory for the parked photons",__FILE__,__LINE__);
+      }
+      rec=w->parkout+(w->nparkout++)*gcfg->parkreclen;
+      pk.p=ph->p;
+      pk.v=ph->v;
+      pk.f=ph->f;
+      memcpy(&pk.f.ndone,&ph->photonid,sizeof(uint));
+      pk.ao_sums=ph->ao_sums;
+      pk.ao_sweep=ph->ao_sweep;
+      memcpy(rec,&pk,sizeof(MCXParked));
+      w->energyloss+=ph->p.w;
+      if(gcfg->savedet){
+         memcpy(rec+sizeof(MCXParked)/sizeof(float),ppath,sizeof(float)*gcfg->maxmedia);
+         cpu_clearpath(ppath,gcfg->maxmedia);
+      }
+      cpu_nextphoton(dom,w,ph,t,tnew,ppath,accumweight);
+}
+
+/*a (cos,sin) pair from a row of the scattering angle tables (-Q), see scatlut() of the kernel*/
+static void cpu_scatlut(const float2 *table,float u,float *c,float *s){
+      float x=u*SCAT_LUT_LEN,r;
+      int i=MIN((int)x,SCAT_LUT_LEN-1);
+      float2 a=table[i],b=table[i+1];
+      x-=i;
+      *c=a.x+x*(b.x-a.x);
+      *s=a.y+x*(b.y-a.y);
+      r=1.f/sqrtf((*c)*(*c)+(*s)*(*s));
+      *c*=r;
+      *s*=r;
+}
+
+/**
+   scattering phase of one lane, this is the first half of the loop body of
+   mcx_main_loop(); it also loads the medium/pressure used by the next step
+*/
+static void cpu_lane_scatter(const MCXCPUDomain *dom,MCXCPULanes *L,int lane){
+     const MCXParam *gcfg=&dom->param;
+     const Medium *gproperty=dom->prop;
+     RandType *t=L->rt[lane],*tnew=L->rtnew[lane];
+     MCXCPUPhoton ph;
+     float cphi,sphi,theta,stheta,ctheta,tmp0,tmp1;
+     float xdiff,ydiff,zdiff,cosj_inc,sinj_inc;
+
+     if(L->pscat[lane]>0.f){  // still in the same jump, only refresh the medium of the current voxel
+          uchar mediaid=L->mediaid[lane];
+          L->n1[lane]=L->n[lane];
+          L->mua[lane]=gproperty[mediaid].mua; L->mus[lane]=gproperty[mediaid].mus;
+          L->g[lane]=gproperty[mediaid].g;     L->n[lane]=gproperty[mediaid].n;
+          cpu_loadaocoef(dom,mediaid,L->idx1d[lane],&ph.aoc);
+          cpu_lane_setaocoef(L,lane,&ph.aoc);
+          return;
+     }
+     cpu_lane_load(L,lane,&ph);
+
+     if(ph.f.pscat<=0.f) {  // if this photon has finished his current jump, get next scat length & angles
+          rand_need_more(t,tnew);
+          ph.f.pscat=rand_next_scatlen(t); // random scattering probability, unit-less
+
+          if(ph.p.w<1.f){ // if this is not my first jump
+               MCXdir v=ph.v;
+               Medium prop=ph.prop;
+               AOCoef aoc=ph.aoc;
+
+               if(gcfg->scatlut){  // both angles from the tables, row 0 is the azimuth, row mediaid+1 the medium
+                   cpu_scatlut(dom->scattable,rand_next_aangle(t),&cphi,&sphi);
+                   cpu_scatlut(dom->scattable+(ph.mediaid+1)*(SCAT_LUT_LEN+1),rand_next_zangle(t),&ctheta,&stheta);
+               }else{
+               tmp0=TWO_PI*rand_next_aangle(t); //next azimuth angle
+               sphi=sinf(tmp0);
+               cphi=cosf(tmp0);
+
+               //Henyey-Greenstein Phase Function, "Handbook of Optical
+               //Biomedical Diagnostics",2002,Chap3,p234, also see Boas2002
+               if(prop.g>EPS){
+                   tmp0=(1.f-prop.g*prop.g)/(1.f-prop.g+2.f*prop.g*rand_next_zangle(t));
+                   tmp0*=tmp0;
+                   tmp0=(1.f+prop.g*prop.g-tmp0)/(2.f*prop.g);
+                   tmp0=fmaxf(-1.f, fminf(1.f, tmp0));
+
+                   theta=acosf(tmp0);
+                   stheta=sinf(theta);
+                   ctheta=tmp0;
+               }else{
+                   theta=TWO_PI*rand_next_zangle(t);
+                   stheta=sinf(theta);
+                   ctheta=cosf(theta);
+               }
+               }
+
+               if( v.z>-1.f+EPS && v.z<1.f-EPS ) {
+                   tmp0=1.f-v.z*v.z;   //reuse tmp to minimize registers
+                   tmp1=1.f/sqrtf(tmp0);
+                   tmp1=stheta*tmp1;
+
+                   // phase modulations due to scatterer displacement
+                   xdiff = v.x - (tmp1*(v.x*v.z*cphi - v.y*sphi) + v.x*ctheta);
+                   ydiff = v.y - (tmp1*(v.y*v.z*cphi + v.x*sphi) + v.y*ctheta);
+                   zdiff = v.z - (-tmp1*tmp0*cphi + v.z*ctheta);
+
+                   cosj_inc = gcfg->aokj * prop.n * (aoc.Sx*xdiff + aoc.Sy*ydiff + aoc.Sz*zdiff);
+                   sinj_inc = gcfg->aosinj * prop.n;
+
+                   if(aoc.Ci!=0.f || aoc.Si!=0.f){
+                       ph.ao_sums.Pdcosj+=cosj_inc;
+                       ph.ao_sums.Pdsinj+=sinj_inc;
+                       if(gcfg->issweep){
+                           ph.ao_sweep.Pdcosjq+=gcfg->aokj * prop.n * (aoc.Cx*xdiff + aoc.Cy*ydiff + aoc.Cz*zdiff);
+                           ph.ao_sweep.Pdsinj0+=sinj_inc;
+                       }
+                   }
+                   ph.v.x=tmp1*(v.x*v.z*cphi - v.y*sphi) + v.x*ctheta;
+                   ph.v.y=tmp1*(v.y*v.z*cphi + v.x*sphi) + v.y*ctheta;
+                   ph.v.z=-tmp1*tmp0*cphi + v.z*ctheta;
+               }else{
+                   xdiff = v.x - stheta*cphi;
+                   ydiff = v.y - stheta*sphi;
+                   zdiff = (v.z>0.f)?(v.z-ctheta):(v.z+ctheta);
+
+                   cosj_inc = gcfg->aokj * prop.n * (aoc.Sx*xdiff + aoc.Sy*ydiff + aoc.Sz*zdiff);
+                   sinj_inc = gcfg->aokj * prop.n * (aoc.Cx*xdiff + aoc.Cy*ydiff + aoc.Cz*zdiff);
+
+                   if(aoc.Ci!=0.f || aoc.Si!=0.f){
+                       ph.ao_sums.Pdcosj+=cosj_inc;
+                       ph.ao_sums.Pdsinj+=sinj_inc;
+                       if(gcfg->issweep){
+                           ph.ao_sweep.Pdcosjq+=sinj_inc;
+                           ph.ao_sweep.Pdsinjq+=cosj_inc;
+                           ph.ao_sweep.Pdsinjr+=sinj_inc;
+                       }
+                   }
+                   ph.v.z=(v.z>0.f)?ctheta:-ctheta;
+                   ph.v.x=stheta*cphi;
+                   ph.v.y=stheta*sphi;
+               }
+               ph.v.nscat++;
+          }
+     }
+
+     ph.n1=ph.prop.n;
+     ph.prop=gproperty[ph.mediaid];
+     cpu_loadaocoef(dom,ph.mediaid,ph.idx1d,&ph.aoc);
+
+     cpu_lane_store(L,lane,&ph);
+}
+
+/**
+   free-path advance of all lanes: voxel step, attenuation and the
+   refractive-index modulation sums; branches of the GPU kernel are turned
+   into per-lane selects, inactive lanes are masked out
+*/
+MCX_SIMD_CLONES
+static void cpu_lane_advance(MCXCPULanes *L,const MCXParam *gcfg,int nlane){
+     int i;
+     const float minstep=gcfg->minstep, aoki=gcfg->aoki;
+     const float oneoverc0=gcfg->oneoverc0, minaccumtime=gcfg->minaccumtime;
+
+     memcpy(L->x0,L->px,sizeof(float)*nlane);
+     memcpy(L->y0,L->py,sizeof(float)*nlane);
+     memcpy(L->z0,L->pz,sizeof(float)*nlane);
+     memcpy(L->w0,L->pw,sizeof(float)*nlane);
+
+     if(gcfg->dda){  // step to the nearest voxel face, or to the scattering site if it comes first
+         #pragma omp simd
+         for(i=0;i<nlane;i++){
+              float x=L->px[i],y=L->py[i],z=L->pz[i],w=L->pw[i];
+              float vx=L->vx[i],vy=L->vy[i],vz=L->vz[i];
+              float pscat=L->pscat[i],t=L->t[i],mus=L->mus[i],n=L->n[i];
+              float hx,hy,hz,face,step,dn;
+              int ends,act=L->active[i];
+
+              hx=(vx>EPS||vx<-EPS)?(floorf(x)+(vx>0.f)-x)/vx:VERY_BIG;
+              hy=(vy>EPS||vy<-EPS)?(floorf(y)+(vy>0.f)-y)/vy:VERY_BIG;
+              hz=(vz>EPS||vz<-EPS)?(floorf(z)+(vz>0.f)-z)/vz:VERY_BIG;
+              face=fminf(fminf(hx,hy),hz);
+              step=pscat/mus;    // unit=grid
+              ends=(step<=face); //scattering ends in this voxel
+              step=ends ? step : face+DDA_NUDGE;  // the nudge keeps the next voxel index exact
+              dn=act ? aoki*n*step : 0.f;
+
+              L->px[i]=act ? x+vx*step : x;
+              L->py[i]=act ? y+vy*step : y;
+              L->pz[i]=act ? z+vz*step : z;
+              L->pw[i]=act ? w*expf(-L->mua[i]*step) : w;
+              L->Pncosi[i]+=dn*L->Ci[i];
+              L->Pnsini[i]+=dn*L->Si[i];
+              L->t[i]=act ? t+step*n*oneoverc0 : t; //propagation time (unit=s)
+              L->pscat[i]=act ? (ends ? SAME_VOXEL : pscat-step*mus) : pscat;
+              L->steplen[i]=step;
+              L->ddalen[i]=ends ? step : face;
+              L->ddaflip[i]=(face==hx ? 1.f : (face==hy ? 2.f : 3.f));
+         }
+         return;
+     }
+
+     #pragma omp simd
+     for(i=0;i<nlane;i++){
+          float x=L->px[i],y=L->py[i],z=L->pz[i],w=L->pw[i];
+          float pscat=L->pscat[i],t=L->t[i],mus=L->mus[i],n=L->n[i];
+          float len,step,atten,dn,dx,dy,dz;
+          int ends,act=L->active[i];
+
+          len=minstep*mus; //unitless (minstep=grid, mus=1/grid)
+          ends=(len>pscat);  //scattering ends in this voxel: mus*gcfg->minstep > s
+          step=pscat/mus;    // unit=grid
+          step=ends ? step : minstep;
+          atten=expf(-L->mua[i]*step); //mua=1/grid, step=grid
+          dn=act ? aoki*n*step : 0.f;  // the AO terms are zero outside of the acoustic field
+
+          // a full step moves by v as in the GPU kernel, a partial one by v*step
+          dx=ends ? L->vx[i]*step : L->vx[i];
+          dy=ends ? L->vy[i]*step : L->vy[i];
+          dz=ends ? L->vz[i]*step : L->vz[i];
+
+          L->px[i]=act ? x+dx : x;
+          L->py[i]=act ? y+dy : y;
+          L->pz[i]=act ? z+dz : z;
+          L->pw[i]=act ? w*atten : w;
+          L->Pncosi[i]+=dn*L->Ci[i];
+          L->Pnsini[i]+=dn*L->Si[i];
+          L->t[i]=act ? t+(ends ? step*n*oneoverc0 : minaccumtime*n) : t; //propagation time (unit=s)
+          L->pscat[i]=act ? (ends ? SAME_VOXEL : pscat-len) : pscat; //remaining probability: sum(s_i*mus_i), unit-less
+          L->steplen[i]=step;
+     }
+}
+
+/**
+   boundary handling, photon relaunch and field deposition of one lane, the
+   second half of the loop body of mcx_main_loop(); returns 1 if the lane
+   has completed a photon
+*/
+static int cpu_lane_boundary(const MCXCPUDomain *dom,MCXCPUWorker *w,MCXCPULanes *L,int lane,double *accumweight){
+     const MCXParam *gcfg=&dom->param;
+     const Medium *gproperty=dom->prop;
+     const uchar *media=dom->media;
+     RandType *t=L->rt[lane],*tnew=L->rtnew[lane];
+     float *ppath=w->ppath+lane*gcfg->maxmedia;
+     MCXCPUPhoton ph;
+     uint idx1dold;
+     uchar mediaidold;
+     float3 htime;
+     float len,cphi,sphi,stheta,ctheta,tmp0,tmp1;
+
+     uint idx1d;
+     uchar mediaid;
+     int hitbound;
+
+     if(gcfg->savedet) ppath[L->mediaid[lane]-1]+=L->steplen[lane]; //(unit=grid)
+
+     mediaidold=media[L->idx1d[lane]];
+     idx1dold=L->idx1d[lane];
+     idx1d=((int)(floorf(L->pz[lane]))*gcfg->dimlen.y+(int)(floorf(L->py[lane]))*gcfg->dimlen.x+(int)(floorf(L->px[lane])));
+     if(L->px[lane]<0||L->py[lane]<0||L->pz[lane]<0||L->px[lane]>=gcfg->maxidx.x||L->py[lane]>=gcfg->maxidx.y||L->pz[lane]>=gcfg->maxidx.z){
+         mediaid=0;
+     }else{
+         mediaid=(media[idx1d] & MED_MASK);
+     }
+     /*in the streaming mode the end of the window is not a boundary, the photon is parked below*/
+     hitbound=(mediaid==0||L->t[lane]>gcfg->tmax||(!gcfg->streamgate && L->t[lane]>gcfg->twin1)||(gcfg->dorefint && L->n1[lane]!=gproperty[mediaid].n));
+
+     if(!hitbound && L->t[lane]<L->tnext[lane] && L->t[lane]<=gcfg->twin1 && L->pw[lane]>=gcfg->minenergy){ // most steps end here, skip the scalar copy of the lane
+         L->idx1d[lane]=idx1d;
+         L->mediaid[lane]=mediaid;
+         return 0;
+     }
+
+     cpu_lane_load(L,lane,&ph);
+     ph.idx1d=idx1d;
+     ph.mediaid=mediaid;
+
+     // the whole DDA step lies in the medium of ph.prop, deposit it before the boundary changes prop or v
+     if(gcfg->dda)
+          cpu_depositstep(dom,w,&ph,(gcfg->streamgate ? gcfg->twin1 : VERY_BIG),accumweight);
+
+     // dealing with boundaries
+
+     //if it hits the boundary, exceeds the max time window or exits the domain, rebound or launch a new one
+     if(hitbound){
+          MCXpos p=ph.p,p0=ph.p0;
+          MCXdir v=ph.v;
+          float flipdir=0.f;
+
+          if(gcfg->dda) {
+              //the step ended on the face it crossed, no trial intersections are needed
+              flipdir=(ph.idx1d!=idx1dold ? L->ddaflip[lane] : 0.f);
+              htime.x=p0.x+L->ddalen[lane]*v.x; /*htime is the exact exit position*/
+              htime.y=p0.y+L->ddalen[lane]*v.y;
+              htime.z=p0.z+L->ddalen[lane]*v.z;
+          }else if(gcfg->doreflect) {
+            //time-of-flight to hit the wall in each direction
+            htime.x=(v.x>EPS||v.x<-EPS)?(floorf(p0.x)+(v.x>0.f)-p0.x)/v.x:VERY_BIG;
+            htime.y=(v.y>EPS||v.y<-EPS)?(floorf(p0.y)+(v.y>0.f)-p0.y)/v.y:VERY_BIG;
+            htime.z=(v.z>EPS||v.z<-EPS)?(floorf(p0.z)+(v.z>0.f)-p0.z)/v.z:VERY_BIG;
+            //get the direction with the smallest time-of-flight
+            tmp0=fminf(fminf(htime.x,htime.y),htime.z);
+            flipdir=(tmp0==htime.x?1.f:(tmp0==htime.y?2.f:(tmp0==htime.z&&ph.idx1d!=idx1dold)?3.f:0.f));
+
+            //move to the 1st intersection pt
+            tmp0*=JUST_ABOVE_ONE;
+            htime.x=floorf(p0.x+tmp0*v.x);
+            htime.y=floorf(p0.y+tmp0*v.y);
+            htime.z=floorf(p0.z+tmp0*v.z);
+
+            if(htime.x>=0&&htime.y>=0&&htime.z>=0&&htime.x<gcfg->maxidx.x&&htime.y<gcfg->maxidx.y&&htime.z<gcfg->maxidx.z
+                 &&media[(int)(htime.z*gcfg->dimlen.y+htime.y*gcfg->dimlen.x+htime.x)]==mediaidold){ //if the first vox is not air
+
+                 htime.x=(v.x>EPS||v.x<-EPS)?(floorf(p.x)+(v.x<0.f)-p.x)/(-v.x):VERY_BIG;
+                 htime.y=(v.y>EPS||v.y<-EPS)?(floorf(p.y)+(v.y<0.f)-p.y)/(-v.y):VERY_BIG;
+                 htime.z=(v.z>EPS||v.z<-EPS)?(floorf(p.z)+(v.z<0.f)-p.z)/(-v.z):VERY_BIG;
+                 tmp0=fminf(fminf(htime.x,htime.y),htime.z);
+                 tmp1=flipdir;   //save the previous ref. interface id
+                 flipdir=(tmp0==htime.x?1.f:(tmp0==htime.y?2.f:(tmp0==htime.z&&ph.idx1d!=idx1dold)?3.f:0.f));
+
+                 tmp0*=JUST_ABOVE_ONE;
+                 htime.x=p.x-tmp0*v.x; //move to the last intersection pt
+                 htime.y=p.y-tmp0*v.y;
+                 htime.z=p.z-tmp0*v.z;
+
+                 if(tmp1!=flipdir&&htime.x>=0&&htime.y>=0&&htime.z>=0&&
+                      floorf(htime.x)<gcfg->maxidx.x&&floorf(htime.y)<gcfg->maxidx.y&&floorf(htime.z)<gcfg->maxidx.z){
+                     if(media[(int)(floorf(htime.z)*gcfg->dimlen.y+floorf(htime.y)*gcfg->dimlen.x+floorf(htime.x))]!=mediaidold){ //this is an air voxel
+                         /*see mcx_main_loop() for the derivation of the remaining interface id*/
+                         flipdir=-tmp1-flipdir+6.f;
+
+                         htime.x=(v.x>EPS||v.x<-EPS)?(floorf(htime.x)+(v.x<0.f)-htime.x)/(-v.x):VERY_BIG;
+                         htime.y=(v.y>EPS||v.y<-EPS)?(floorf(htime.y)+(v.y<0.f)-htime.y)/(-v.y):VERY_BIG;
+                         htime.z=(v.z>EPS||v.z<-EPS)?(floorf(htime.z)+(v.z<0.f)-htime.z)/(-v.z):VERY_BIG;
+                         tmp1=fminf(fminf(htime.x,htime.y),htime.z);
+                         htime.x=p.x-(tmp0+tmp1)*v.x; /*htime is now the exact exit position*/
+                         htime.y=p.y-(tmp0+tmp1)*v.y;
+                         htime.z=p.z-(tmp0+tmp1)*v.z;
+                     }
+                 }
+            }else{
+              htime.x=p0.x+tmp0*v.x; /*htime is now the exact exit position*/
+              htime.y=p0.y+tmp0*v.y;
+              htime.z=p0.z+tmp0*v.z;
+            }
+          }else{
+              htime.x=p.x; htime.y=p.y; htime.z=p.z;
+          }
+
+          ph.prop=gproperty[ph.mediaid]; // optical property across the interface
+          cpu_loadaocoef(dom,ph.mediaid,ph.idx1d,&ph.aoc);
+
+          //if hit boundary within the time window and is n-mismatched, rebound
+
+          if(gcfg->doreflect&&ph.f.t<gcfg->tmax&&(gcfg->streamgate||ph.f.t<gcfg->twin1)&& flipdir>0.f && ph.n1!=ph.prop.n){
+              float Rtotal=1.f;
+              float n1=ph.n1, n2=ph.prop.n;
+
+              tmp0=n1*n1;
+              tmp1=n2*n2;
+              if(flipdir>=3.f) { //flip in z axis
+                 cphi=fabsf(v.z);
+                 sphi=v.x*v.x+v.y*v.y;
+              }else if(flipdir>=2.f){ //flip in y axis
+                 cphi=fabsf(v.y);
+                 sphi=v.x*v.x+v.z*v.z;
+              }else{ //flip in x axis
+                 cphi=fabsf(v.x);                //cos(si)
+                 sphi=v.y*v.y+v.z*v.z; //sin(si)^2
+              }
+              len=1.f-tmp0/tmp1*sphi;   //1-[n1/n2*sin(si)]^2 = cos(ti)^2
+
+              if(len>0.f) { // if not total internal reflection
+                 ctheta=tmp0*cphi*cphi+tmp1*len;
+                 stheta=2.f*n1*n2*cphi*sqrtf(len);
+                 Rtotal=(ctheta-stheta)/(ctheta+stheta);
+                 ctheta=tmp1*cphi*cphi+tmp0*len;
+                 Rtotal=(Rtotal+(ctheta-stheta)/(ctheta+stheta))*0.5f;
+              } // else, total internal reflection
+              if(Rtotal<1.f && rand_next_reflect(t)>Rtotal){ // do transmission
+                    if(ph.mediaid==0){ // transmission to external boundary
+                        ph.p.x=htime.x;ph.p.y=htime.y;ph.p.z=htime.z;ph.p.w=(gcfg->dda ? p.w : p0.w);
+                        cpu_launchnewphoton(dom,w,&ph,t,tnew,(mediaidold & DET_MASK),ppath,accumweight);
+                        cpu_lane_store(L,lane,&ph);
+                        return 1;
+                    }
+                    tmp0=n1/n2;
+                    if(flipdir>=3.f) { //transmit through z plane
+                       v.x=tmp0*v.x;
+                       v.y=tmp0*v.y;
+                    }else if(flipdir>=2.f){ //transmit through y plane
+                       v.x=tmp0*v.x;
+                       v.z=tmp0*v.z;
+                    }else{ //transmit through x plane
+                       v.y=tmp0*v.y;
+                       v.z=tmp0*v.z;
+                    }
+                    tmp0=1.f/sqrtf(v.x*v.x+v.y*v.y+v.z*v.z);
+                    ph.v.x=v.x*tmp0;
+                    ph.v.y=v.y*tmp0;
+                    ph.v.z=v.z*tmp0;
+              }else{ //do reflection
+                    if(flipdir>=3.f) { //flip in z axis
+                       ph.v.z=-v.z;
+                    }else if(flipdir>=2.f){ //flip in y axis
+                       ph.v.y=-v.y;
+                    }else{ //flip in x axis
+                       ph.v.x=-v.x;
+                    }
+                    if(gcfg->dda){  //back off the face into the old voxel, the weight keeps the absorption on the way
+                       tmp0=fmaxf(L->ddalen[lane]-DDA_NUDGE,0.f);
+                       ph.p.x=p0.x+tmp0*v.x; ph.p.y=p0.y+tmp0*v.y; ph.p.z=p0.z+tmp0*v.z;
+                    }else{
+                       ph.p=p0;   //move to the reflection point
+                    }
+                    ph.idx1d=idx1dold;
+                    ph.mediaid=(media[ph.idx1d] & MED_MASK);
+                    ph.prop=gproperty[ph.mediaid];
+                    cpu_loadaocoef(dom,ph.mediaid,ph.idx1d,&ph.aoc);
+                    ph.n1=ph.prop.n;
+              }
+          }else{  // launch a new photon
+              ph.p.x=htime.x;ph.p.y=htime.y;ph.p.z=htime.z;ph.p.w=(gcfg->dda ? p.w : p0.w);
+              cpu_launchnewphoton(dom,w,&ph,t,tnew,(mediaidold & DET_MASK),ppath,accumweight);
+              cpu_lane_store(L,lane,&ph);
+              return 1;
+          }
+     }
+
+     // the photon outlived the window, carry it over to the next one before its deposit
+     if(gcfg->streamgate && ph.f.t>gcfg->twin1){
+          cpu_parkphoton(dom,w,&ph,t,tnew,ppath,accumweight);
+          cpu_lane_store(L,lane,&ph);
+          return 1;
+     }
+
+     // Russian roulette (-e/-X): the expected weight is kept, a dropped packet is not booked as lost
+     if(ph.p.w<gcfg->minenergy){
+          rand_need_more(t,tnew);
+          if(rand_do_roulette(t)*gcfg->roulettesize<=1.f){
+               ph.p.w*=gcfg->roulettesize;
+          }else{
+               ph.p.w=0.f;
+               cpu_launchnewphoton(dom,w,&ph,t,tnew,0,ppath,accumweight);
+               cpu_lane_store(L,lane,&ph);
+               return 1;
+          }
+     }
+
+     // saving fluence to the memory, a DDA step (-j) has made its deposits, except those a resumed photon owes
+
+     if(gcfg->dda)
+          cpu_depositstep(dom,w,&ph,VERY_BIG,accumweight);
+     else
+          cpu_deposit(dom,w,&ph,accumweight);
+     cpu_lane_store(L,lane,&ph);
+     return 0;
+}
+
+/**
+   host version of mcx_main_loop(), one call per worker thread; the worker
+   runs nlane photons side by side and relaunches a lane until the photon
+   budget of this worker (the same as one GPU thread) is used up; a resumed
+   window (-D) runs the photons this worker parked in the previous one; with
+   -V the lanes take photons from the shared counter until the launch is done
+*/
+static void mcx_cpu_main_loop(const MCXCPUDomain *dom,MCXCPUWorker *w,int nphoton,int idx,int ophoton,int nlane){
+     const MCXParam *gcfg=&dom->param;
+     MCXCPULanes L;
+     MCXCPUPhoton ph;
+     int i,nactive=0;
+     double accumweight=0.0;
+
+     w->ndone=0;
+     w->accumweight=0.0;
+     w->parknext=0;
+     w->nextid=idx*nphoton+MIN(idx,ophoton);
+     w->claimend=w->nextid;
+     w->quota=(gcfg->resume ? (int)w->nparkin : (idx<ophoton?nphoton+1:nphoton));
+     w->drained=0;
+     if(gcfg->mediaidorig==0 || (!gcfg->dynamic && w->quota<=0))
+          return; // the initial position is not within the medium
+
+     memset(&L,0,sizeof(MCXCPULanes));
+     memset(&ph,0,sizeof(MCXCPUPhoton));
+
+     for(i=0;i<nlane;i++){
+          if(gcfg->savedet) cpu_clearpath(w->ppath+i*gcfg->maxmedia,gcfg->maxmedia);
+          gpu_rng_init(L.rt[i],L.rtnew[i],w->seed,i);
+          cpu_nextphoton(dom,w,&ph,L.rt[i],L.rtnew[i],w->ppath+i*gcfg->maxmedia,&accumweight);
+          if(w->drained)
+               break;
+          cpu_lane_store(&L,i,&ph);
+          L.active[i]=1;
+          nactive++;
+     }
+     nlane=i;
+     if(nlane==0)
+          return; // the other workers took all photons of this launch, -V
+
+     while(nactive>0){
+          for(i=0;i<nlane;i++)
+               if(L.active[i])
+                    cpu_lane_scatter(dom,&L,i);
+
+          cpu_lane_advance(&L,gcfg,nlane);
+
+          for(i=0;i<nlane;i++){
+               if(L.active[i] && cpu_lane_boundary(dom,w,&L,i,&accumweight) && w->drained){
+                    L.active[i]=0;
+                    nactive--;
+               }
+          }
+     }
+     w->accumweight=accumweight;
+
+     // report the state of the first lane
+     w->pos.x=L.px[0]; w->pos.y=L.py[0]; w->pos.z=L.pz[0]; w->pos.w=L.pw[0];
+     w->dir.x=L.vx[0]; w->dir.y=L.vy[0]; w->dir.z=L.vz[0]; w->dir.w=L.nscat[0];
+     w->len.x=L.pscat[0]; w->len.y=L.t[0]; w->len.z=(float)accumweight; w->len.w=(float)w->ndone;
+     w->ao.x=L.Pncosi[0]; w->ao.y=L.Pnsini[0]; w->ao.z=L.Pdcosj[0]; w->ao.w=L.Pdsinj[0];
+     cpu_lane_load(&L,0,&ph);
+     cpu_modulation(&ph.ao_sums,&ph.mod);
+     w->mod.x=ph.mod.magnitude; w->mod.y=ph.mod.phi;
+}
+/**
+   photons of chunk c of the nchunk launches a repetition of nrep photons is
+   split into (-K), the chunks differ by at most one photon
+*/
+static uint cpu_chunkphotons(uint nrep,uint c,uint nchunk){
+     return (uint)(((unsigned long long)(c+1)*nrep)/nchunk-((unsigned long long)c*nrep)/nchunk);
+}
+
+/**
+   writes the checkpoint of a completed launch (-K), see mcx_checkpoint.h;
+   the partly filled detected photon pages are handed to the writer first so
+   that the .mch file holds every photon counted so far
+*/
+static void cpu_savecheckpoint(const char *session,Checkpoint *ck,MCXCPUDomain *dom,MCXCPUWorker *workers,int nworker,size_t ntile){
+     FILE *fp;
+     size_t j;
+     uint cnt;
+     double energy[2];
+     int i;
+
+     if(dom->detw){
+          for(i=0;i<nworker;i++)
+               if(workers[i].detpage){
+                    mcx_detwriter_submit(dom->detw,workers[i].detpage,workers[i].ndet);
+                    workers[i].detpage=NULL;
+               }
+          ck->detsaved=mcx_detwriter_sync(dom->detw);
+     }
+     ck->nparkgroup=nworker;
+     fp=mcx_checkpoint_create(session,ck);
+     if(ck->iter){  // inside a window, the private tiles hold the repetitions so far
+          for(i=0;i<nworker;i++){
+               cnt=(uint)workers[i].ntouched;
+               mcx_checkpoint_write(fp,&cnt,sizeof(uint));
+               for(j=0;j<ntile;j++)
+                    if(workers[i].tiles[j]){
+                         cnt=(uint)j;
+                         mcx_checkpoint_write(fp,&cnt,sizeof(uint));
+                         mcx_checkpoint_write(fp,workers[i].tiles[j],sizeof(float)*workers[i].tilelen);
+                    }
+          }
+     }
+     for(i=0;i<nworker;i++){
+          energy[0]=workers[i].energyloss;
+          energy[1]=workers[i].energyabsorbed;
+          mcx_checkpoint_write(fp,energy,sizeof(double)*2);
+     }
+     for(i=0;i<nworker;i++){
+          cnt=(uint)workers[i].nparkout;
+          mcx_checkpoint_write(fp,&cnt,sizeof(uint));
+     }
+     for(i=0;i<nworker;i++)
+          mcx_checkpoint_write(fp,workers[i].parkout,sizeof(float)*ck->parkreclen*workers[i].nparkout);
+     mcx_checkpoint_commit(fp,session);
+}
+
+/**
+   reloads the sections written by cpu_savecheckpoint(), the parked photons
+   go to parkout as if the previous window had just ended
+*/
+static void cpu_loadcheckpoint(FILE *fp,const Checkpoint *ck,MCXCPUWorker *workers,int nworker,size_t ntile){
+     MCXCPUWorker *w;
+     uint cnt,k,idx;
+     double energy[2];
+     int i;
+
+     if(ck->iter){
+          for(i=0;i<nworker;i++){
+               w=workers+i;
+               mcx_checkpoint_read(fp,&cnt,sizeof(uint));
+               for(k=0;k<cnt;k++){
+                    mcx_checkpoint_read(fp,&idx,sizeof(uint));
+                    if(idx>=ntile)
+                         mcx_error(-2,"the checkpoint file is corrupted",__FILE__,__LINE__);
+                    mcx_checkpoint_read(fp,cpu_fieldtile(w,(size_t)idx<<MCX_TILE_BITS),sizeof(float)*w->tilelen);
+               }
+          }
+     }
+     for(i=0;i<nworker;i++){
+          mcx_checkpoint_read(fp,energy,sizeof(double)*2);
+          workers[i].energyloss=energy[0];
+          workers[i].energyabsorbed=energy[1];
+     }
+     for(i=0;i<nworker;i++){
+          mcx_checkpoint_read(fp,&cnt,sizeof(uint));
+          workers[i].nparkout=cnt;
+     }
+     for(i=0;i<nworker;i++){
+          w=workers+i;
+          if(w->nparkout>w->parkoutcap){
+               w->parkoutcap=w->nparkout;
+               w->parkout=(float *)realloc(w->parkout,sizeof(float)*ck->parkreclen*w->parkoutcap);
+               if(w->parkout==NULL)
+                    mcx_error(-3,"not enough host memory for the parked photons",__FILE__,__LINE__);
+          }
+          mcx_checkpoint_read(fp,w->parkout,sizeof(float)*ck->parkreclen*w->nparkout);
+     }
+}
+
+/**
+   host driver for the CPU engine, the work-flow is identical to
+   mcx_run_simulation() with threads replaced by OpenMP workers; isrc is the
+   source of the list being run, session the name of the checkpoint (-K), and
+   ckin the checkpoint this source is resumed from (-Z), NULL to start afresh
+*/
+static void mcx_cpu_run_source(Config *cfg,unsigned int isrc,const char *session,FILE *ckin,Checkpoint *ck,unsigned int *ckclock){
+
+     int i,iter,iter0,nworker=1,nlane,respin=(cfg->isstreamgate ? 1 : cfg->respin),nchunk,nlaunch;
+     unsigned int iwin,ckseed;
+     unsigned long long ndraw=0;
+     Checkpoint ckrun;
+     float  minstep=MIN(MIN(cfg->steps.x,cfg->steps.y),cfg->steps.z);
+     float  t;
+     float  scatlutmax=0.f;
+     double energyloss=0.0,energyabsorbed=0.0,energy[2];
+     int    threadphoton, oddphotons;
+     uint   photonpool[2]={0,0};  //next photon and photons of a launch, claimed by the workers with -V
+     size_t *parkstart;           //prefix sums of the parked photons of the workers, -V with -D
+     double busysum=0.0,busyspan=0.0,busymax,launch;  //worker busy times and nworker x the launch times, for the utilization
+
+     unsigned int photoncount=0,printnum;
+     unsigned int tic,tic0,tic1,toc=0;
+     size_t dimxyz=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z, fieldlen, varlen, tilelen, ntile, ntouched=0, j;
+     long   k;
+     float  Vvox,scale;
+     double eabsorp;
+     uint   detected=0,totaldetected=0;
+
+     float  *field;
+     float2 phase[MAX_PHASES];
+     float  freq[MAX_FREQS];
+     int    nband=mcx_sidebandnum(cfg);
+     MCXCPUWorker *workers;
+     MCXCPUDomain dom;
+     MCXParam *param=&dom.param;
+
+#ifdef _OPENMP
+     nworker=omp_get_max_threads();
+#endif
+     nlane=mcx_cpu_simdlanes();
+
+     memset(&dom,0,sizeof(MCXCPUDomain));
+     param->gridunit=cfg->unitinmm;
+     param->vsize=cfg->steps;
+     param->minstep=minstep;
+     param->tmax=cfg->tend;
+     param->oneoverc0=R_C0*cfg->unitinmm;
+     param->isrowmajor=cfg->isrowmajor;
+     param->save2pt=cfg->issave2pt;
+     param->doreflect=cfg->isreflect;
+     param->dorefint=cfg->isrefint;
+     param->savedet=cfg->issavedet;
+     param->Rtstep=1.f/cfg->tstep;
+     param->ps.x=cfg->srcpos.x; param->ps.y=cfg->srcpos.y; param->ps.z=cfg->srcpos.z; param->ps.w=1.f;
+     param->c0.x=cfg->srcdir.x; param->c0.y=cfg->srcdir.y; param->c0.z=cfg->srcdir.z; param->c0.w=0.f;
+     param->maxidx.x=cfg->dim.x; param->maxidx.y=cfg->dim.y; param->maxidx.z=cfg->dim.z;
+     param->cp0=cfg->crop0;
+     param->cp1=cfg->crop1;
+     param->minenergy=cfg->minenergy;
+     param->skipradius2=cfg->sradius*cfg->sradius;
+     param->minaccumtime=minstep*R_C0*cfg->unitinmm;
+     param->maxdetphoton=cfg->maxdetphoton;
+     param->maxmedia=cfg->medianum-1;
+     param->detnum=cfg->detnum;
+     param->dimlen.x=cfg->dim.x;
+     param->dimlen.y=cfg->dim.y*cfg->dim.x;
+     param->dimlen.z=dimxyz;
+     param->idx1dorig=((int)(floorf(cfg->srcpos.z))*param->dimlen.y+(int)(floorf(cfg->srcpos.y))*param->dimlen.x+(int)(floorf(cfg->srcpos.x)));
+     param->mediaidorig=(cfg->vol[param->idx1dorig] & MED_MASK);
+     param->acorig=cfg->acorig;
+     param->acdim=cfg->acdim;
+     param->acscale=(cfg->qpressure ? cfg->acscale : 0.f);
+     param->aotable=(cfg->aotable!=NULL);
+     param->aoki=cfg->unitinmm/1000.f*TWO_PI/(cfg->Ocon->lambda) * cfg->Ocon->nu / ((cfg->Acon->rho)*(cfg->Acon->va)*(cfg->Acon->va));
+     param->aokj=TWO_PI/(cfg->Ocon->lambda) / (TWO_PI*cfg->Acon->f*(cfg->Acon->rho)*(cfg->Acon->va));
+     param->aosinj=TWO_PI/(cfg->Ocon->lambda);
+     param->detgridorig=cfg->detgridorig;
+     param->detgridscale=cfg->detgridscale;
+     param->detgriddim=cfg->detgriddim;
+     param->phasenum=cfg->phasenum;
+     param->freqnum=cfg->freqnum;
+     param->issweep=(cfg->phasenum || cfg->freqnum);
+     param->variantnum=mcx_variantnum(cfg);
+     param->sidebands=cfg->sidebands;
+     param->fieldstride=dimxyz*cfg->maxgate;
+     param->bandstride=param->fieldstride*param->variantnum;
+     param->reclen=cfg->his.colcount;
+     param->streamgate=cfg->isstreamgate;
+     param->parkreclen=sizeof(MCXParked)/sizeof(float)+(cfg->issavedet ? ((param->maxmedia+3)&~3) : 0);  // same records as the GPU
+     param->roulettesize=cfg->roulettesize;
+     param->dda=cfg->isdda;
+     param->scatlut=cfg->isscatlut;
+     param->dynamic=cfg->isdynamic;
+     for(i=0;i<(int)cfg->phasenum;i++){
+          phase[i].x=cosf(cfg->phaselist[i]);
+          phase[i].y=sinf(cfg->phaselist[i]);
+     }
+     for(i=0;i<(int)cfg->freqnum;i++)
+          freq[i]=cfg->Acon->f/cfg->freqlist[i];  // aokj~1/f
+
+     dom.prop=cfg->prop;
+     dom.pressure=cfg->pressure;
+     dom.qpressure=cfg->qpressure;
+     dom.aotable=cfg->aotable;
+     dom.detpos=cfg->detpos;
+     dom.detgrid=cfg->detgrid;
+     if(cfg->isscatlut)
+          scatlutmax=mcx_buildscattable(cfg);
+     dom.scattable=cfg->scattable;
+     dom.media=cfg->vol;
+     dom.phase=phase;
+     dom.freq=freq;
+
+     /*with -K/-Z a repetition runs in nchunk launches, so that a checkpoint
+       can be saved inside a window, see cpu_chunkphotons()*/
+     nchunk=((cfg->checkpoint || cfg->isresume) ? MCX_CKPT_CHUNKS : 1);
+     threadphoton=cfg->nphoton/nworker/respin;
+     oddphotons=cfg->nphoton/respin-threadphoton*nworker;
+     varlen=param->bandstride;  // the fields of all variants of one sideband
+     fieldlen=varlen*nband;
+     tilelen=(size_t)MCX_TILE_LEN*nband;
+
+     field=(float *)calloc(sizeof(float),fieldlen);
+     workers=(MCXCPUWorker*)calloc(nworker,sizeof(MCXCPUWorker));
+     parkstart=(size_t*)calloc(nworker+1,sizeof(size_t));
+     ntile=(varlen+MCX_TILE_LEN-1)>>MCX_TILE_BITS;
+     for(i=0;i<nworker;i++){
+          workers[i].tiles=(float **)calloc(sizeof(float*),ntile);
+          workers[i].tilelen=tilelen;
+          workers[i].ppath=(float *)calloc(sizeof(float),MCX_SIMD_LANES*cfg->medianum);
+          if(workers[i].tiles==NULL)
+               mcx_error(-3,"not enough host memory for the per-thread field buffers",__FILE__,__LINE__);
+     }
+     /*each worker fills one page while the others are in flight, the pool
+       holds about maxdetphoton records in total*/
+     if(cfg->issavedet)
+          dom.detw=mcx_detwriter_reopen(cfg,MAX(cfg->maxdetphoton/(2*nworker),256),2*nworker,(ckin ? ck->detsaved : 0));
+     dom.detected=&detected;
+     dom.photonpool=photonpool;
+     dom.parkstart=parkstart;
+     dom.workers=workers;
+
+     Vvox=cfg->steps.x*cfg->steps.y*cfg->steps.z;
+
+     mcx_checkpoint_init(&ckrun,cfg,1,nworker,nlane,respin*nchunk,fieldlen,param->parkreclen);
+     if(ckin){
+          mcx_checkpoint_verify(ck,&ckrun);
+          if(ck->window==0 && ck->iter==0){  // saved at a source boundary, nothing to restore
+               fclose(ckin);
+               ckin=NULL;
+          }
+     }
+     ckseed=(cfg->seed>0 ? (unsigned int)cfg->seed : (unsigned int)time(0));
+     if(ckin){  // replay the host RNG up to the seeds of the next repetition
+          ckseed=ck->seed;
+          srand(ckseed);
+          for(;ndraw<ck->ndraw;ndraw++)
+               rand();
+          photoncount=ck->photoncount;
+          totaldetected=ck->detected;
+     }else{
+          srand(ckseed);
+     }
+
+     fprintf(cfg->flog,"\
+###############################################################################\n\
+#               Acousto-Optic Monte Carlo eXtreme (AO-MCX) -- CPU             #\n\
+#   Orig. Copyright (c) 2009-2012 Qianqian Fang <fangq@nmr.mgh.harvard.edu>   #\n\
+#    Martinos Center for Biomedical Imaging, Massachusetts General Hospital   #\n\
+#																			  #\n\
+#				  AO-MCX Created by Matt Adams <adamsm2@bu.edu>       		  #\n\
+#								Boston University							  #\n\
+#									   2013									  #\n\
+###############################################################################\n\
+$MCX-AOI $Rev:: 2 $ Last Commit $Date:: 2014-03-21 $ by $Author:: adamsm2$\n\
+###############################################################################\n");
+
+     tic=mcx_cpu_millis();
+     fprintf(cfg->flog,"- code name: [CPU MCX] running on [%d] CPU threads with [%d] SIMD lanes each\n",nworker,nlane);
+     fprintf(cfg->flog,"- compiled with: RNG [%s] with Seed Length [%d]\n",MCX_RNG_NAME,RAND_SEED_LEN);
+     fprintf(cfg->flog,"- this version CAN save photons at the detectors\n\n");
+     fprintf(cfg->flog,"threadph=%d oddphotons=%d np=%d nthread=%d repetition=%d\n",threadphoton,oddphotons,
+           cfg->nphoton,nworker,respin);
+     if(cfg->isstreamgate)
+          fprintf(cfg->flog,"streaming time gates: photons alive at the end of a window continue in the next\n");
+     if(cfg->minenergy>0.f)
+          fprintf(cfg->flog,"Russian roulette below weight %g, survivors carry x%g\n",cfg->minenergy,cfg->roulettesize);
+     if(cfg->isdda)
+          fprintf(cfg->flog,"voxel traversal: steps end at the next voxel face or scattering site\n");
+     if(cfg->isscatlut)
+          fprintf(cfg->flog,"scattering angle tables: %d entries per medium, max. cos(theta) error %.2e\n",SCAT_LUT_LEN+1,scatlutmax);
+     if(cfg->isdynamic)
+          fprintf(cfg->flog,"dynamic distribution: the threads claim the photons of a launch from a shared counter\n");
+     if(cfg->phasenum)
+          fprintf(cfg->flog,"ultrasound phase sweep: %u offsets per photon\n",cfg->phasenum);
+     if(cfg->freqnum)
+          fprintf(cfg->flog,"acoustic frequencies: %u per photon\n",cfg->freqnum);
+     if(cfg->sidebands!=0x3)
+          fprintf(cfg->flog,"sideband fields: %d per variant\n",nband);
+     if(ckin){
+          fprintf(cfg->flog,"resuming from %s.ckpt: time window %u, repetition %u chunk %u/%d, %u photons done\n",
+                session,ck->window+1,ck->iter/nchunk+1,ck->iter%nchunk+1,nchunk,ck->photoncount);
+          if(cfg->issave2pt && !cfg->exportfield0 && ck->window)
+               mcx_truncatefields(param->fieldstride,ck->window,cfg);  // drop the windows saved after the checkpoint
+     }
+     fprintf(cfg->flog,"init complete : %d ms\n",mcx_cpu_millis()-tic);
+
+     //simulate for all time-gates in maxgate groups per run
+     for(t=cfg->tstart,iwin=0;t<cfg->tend;t+=cfg->tstep*cfg->maxgate,iwin++){
+
+       if(ckin && iwin<ck->window)
+           continue;
+
+       param->twin0=t;
+       param->twin1=t+cfg->tstep*cfg->maxgate;
+       param->resume=(cfg->isstreamgate && t>cfg->tstart);
+
+       fprintf(cfg->flog,"lauching MCX simulation for time window [%.2ens %.2ens] ...\n"
+           ,param->twin0*1e9,param->twin1*1e9);
+
+       iter0=0;
+       if(ckin){  // the window the run was interrupted in
+           iter0=ck->iter;
+           cpu_loadcheckpoint(ckin,ck,workers,nworker,ntile);
+           fclose(ckin);
+           ckin=NULL;
+       }
+       for(i=0;i<nworker;i++){
+           MCXCPUWorker *w=workers+i;
+           if(iter0==0){
+               for(j=0;j<ntile;j++)
+                   if(w->tiles[j])
+                       memset(w->tiles[j],0,sizeof(float)*tilelen);
+               /*a streamed run keeps the loss tally, the parked weight moves between windows*/
+               if(!cfg->isstreamgate)
+                   w->energyloss=0.0;
+               w->energyabsorbed=0.0;
+           }
+           if(param->resume){  // the photons parked by the last window are the input of this one
+               float *buf=w->parkin;
+               size_t cap=w->parkincap;
+               w->parkin=w->parkout;    w->parkincap=w->parkoutcap;
+               w->parkout=buf;          w->parkoutcap=cap;
+               w->nparkin=w->nparkout;
+           }
+           w->nparkout=0;
+       }
+       for(i=0;i<nworker;i++)  // a resumed window pools the parked photons of all workers with -V
+           parkstart[i+1]=parkstart[i]+(param->resume ? workers[i].nparkin : 0);
+       photonpool[1]=(uint)parkstart[nworker];
+       nlaunch=(param->resume ? 1 : respin*nchunk);  // a resumed window (-D) runs its parked photons at once
+       eabsorp=(iter0 ? ck->eabsorp : 0.0);
+
+       //total number of repetition for the simulations, results will be accumulated to field
+       for(iter=iter0;iter<nlaunch;iter++){
+           detected=0;
+           if(!param->resume){
+               photonpool[1]=cpu_chunkphotons(cfg->nphoton/respin,iter%nchunk,nchunk);
+               threadphoton=photonpool[1]/nworker;
+               oddphotons=photonpool[1]-threadphoton*nworker;
+           }
+
+           for(i=0;i<nworker;i++){
+               MCXCPUWorker *w=workers+i;
+               w->pos=param->ps;
+               w->dir=param->c0;
+               w->len.x=0.f; w->len.y=0.f; w->len.z=0.f; w->len.w=0.f;
+               memset(&w->ao,0,sizeof(float4));
+               memset(&w->mod,0,sizeof(float2));
+               ndraw+=rand_launch_seeds(w->seed,nlane,ckseed,isrc,iwin*respin*nchunk+iter);
+           }
+
+           photonpool[0]=0;
+           launch=mcx_cpu_seconds();
+           tic0=mcx_cpu_millis();
+           if(nlaunch>respin)
+               fprintf(cfg->flog,"simulation run#%2d chunk %d/%d ... \t",iter/nchunk+1,iter%nchunk+1,nchunk);
+           else
+               fprintf(cfg->flog,"simulation run#%2d ... \t",iter+1);
+           fflush(cfg->flog);
+
+#ifdef _OPENMP
+           #pragma omp parallel for schedule(static,1)
+#endif
+           for(i=0;i<nworker;i++){
+               mcx_cpu_main_loop(&dom,workers+i,threadphoton,i,oddphotons,nlane);
+               workers[i].busy=mcx_cpu_seconds()-launch;
+           }
+
+           tic1=mcx_cpu_millis();
+           toc+=tic1-tic0;
+           for(i=0,busymax=0.0;i<nworker;i++){
+               busysum+=workers[i].busy;
+               busymax=MAX(busymax,workers[i].busy);
+           }
+           busyspan+=busymax*nworker;  // the launch lasts until the last worker is done
+           fprintf(cfg->flog,"kernel complete:  \t%d ms\nretrieving fields ... \t",tic1-tic);
+
+           cfg->his.totalphoton=0;
+           for(i=0;i<nworker;i++){
+               cfg->his.totalphoton+=workers[i].ndone;
+               eabsorp+=workers[i].accumweight;  // the accumulative absorpted energy near the source, of all repetitions
+           }
+           photoncount+=cfg->his.totalphoton;
+
+           if(cfg->issavedet){
+		fprintf(cfg->flog,"detected %d photons\t",detected);
+		totaldetected+=detected;
+           }
+           if(cfg->isstreamgate){
+               size_t nparked=0;
+               for(i=0;i<nworker;i++)
+                   nparked+=workers[i].nparkout;
+               fprintf(cfg->flog,"carried %lu photons over\t",(unsigned long)nparked);
+           }
+
+	   //handling the 2pt distributions
+           if(cfg->issave2pt && iter+1==nlaunch){
+               /*
+                  merge the private tiles with a pairwise tree over the workers,
+                  the summation order only depends on the thread count, so the
+                  output is bit-wise reproducible for a given seed
+               */
+#ifdef _OPENMP
+               #pragma omp parallel for schedule(dynamic,16)
+#endif
+               for(k=0;k<(long)ntile;k++){
+                   float *src[nworker];
+                   size_t base=(size_t)k<<MCX_TILE_BITS, len=MIN(varlen-base,MCX_TILE_LEN), m;
+                   int w,stride,b;
+                   for(w=0;w<nworker;w++)
+                       src[w]=workers[w].tiles[k];
+                   for(stride=1;stride<nworker;stride<<=1)
+                       for(w=0;w+stride<nworker;w+=stride<<1){
+                           if(src[w+stride]==NULL)
+                               continue;
+                           if(src[w]==NULL){ /*adding to zero is exact, reuse the tile*/
+                               src[w]=src[w+stride];
+                               continue;
+                           }
+                           for(m=0;m<tilelen;m++)
+                               src[w][m]+=src[w+stride][m];
+                       }
+                   for(b=0;b<nband;b++){
+                       if(src[0])
+                           memcpy(field+b*varlen+base,src[0]+b*MCX_TILE_LEN,len*sizeof(float));
+                       else
+                           memset(field+b*varlen+base,0,len*sizeof(float));
+                   }
+               }
+               fprintf(cfg->flog,"transfer complete:\t%d ms\n",mcx_cpu_millis()-tic);  fflush(cfg->flog);
+
+               if(cfg->isnormalized){
+                   fprintf(cfg->flog,"normalizing raw data ...\t");
+
+                   energy[0]=0.0;
+                   energy[1]=0.0;
+                   for(i=0;i<nworker;i++){
+                       energy[0]+=workers[i].energyloss;
+                       energy[1]+=workers[i].energyabsorbed;
+                   }
+                   eabsorp+=energy[1];
+                   scale=(cfg->nphoton-energy[0])/(cfg->nphoton*Vvox*cfg->tstep*eabsorp);
+                   if(cfg->unitinmm!=1.f)
+                       scale/=(cfg->unitinmm*cfg->unitinmm); /* Vvox (already in mm^3) * (Tstep) * (Eabsorp/U) */
+                   fprintf(cfg->flog,"normalization factor alpha=%f\n",scale);  fflush(cfg->flog);
+                   mcx_normalize(field,scale,fieldlen);
+               }
+               fprintf(cfg->flog,"data normalization complete : %d ms\n",mcx_cpu_millis()-tic);
+
+               if(cfg->exportfield0){ //you must allocate the buffer long enough
+                   mcx_exportfields(field,param->fieldstride,cfg);
+               }else{
+                   fprintf(cfg->flog,"saving data to file ...\t");
+                   mcx_savefields(field,param->fieldstride,t>cfg->tstart,cfg);
+                   fprintf(cfg->flog,"saving data complete : %d ms\n\n",mcx_cpu_millis()-tic);
+                   fflush(cfg->flog);
+               }
+           }
+           if(cfg->checkpoint && (iter+1<nlaunch || param->twin1<cfg->tend)
+                 && mcx_cpu_millis()-*ckclock>=cfg->checkpoint*1000u){
+               *ck=ckrun;
+               ck->isrc=isrc;
+               ck->window=(iter+1<nlaunch ? iwin : iwin+1);
+               ck->iter=(iter+1<nlaunch ? iter+1 : 0);
+               ck->seed=ckseed;
+               ck->ndraw=ndraw;
+               ck->photoncount=photoncount;
+               ck->detected=totaldetected;
+               ck->eabsorp=eabsorp;
+               cpu_savecheckpoint(session,ck,&dom,workers,nworker,ntile);
+               *ckclock=mcx_cpu_millis();
+               fprintf(cfg->flog,"checkpoint saved to %s.ckpt\n",session);
+           }
+       }
+     }
+
+     if(cfg->issavedet){
+          for(i=0;i<nworker;i++)
+               if(workers[i].detpage)
+                    mcx_detwriter_submit(dom.detw,workers[i].detpage,workers[i].ndet);
+          mcx_detwriter_close(dom.detw,cfg,photoncount,totaldetected);
+          fprintf(cfg->flog,"saved %u detected photons\n",cfg->his.savedphoton);
+     }
+
+     /*as in the GPU path, the energy tallies are reset per time window, only the last one is reported;
+       a streamed run reports the loss of the whole run*/
+     for(i=0;i<nworker;i++){
+           energyloss+=workers[i].energyloss;
+           energyabsorbed+=workers[i].energyabsorbed;
+     }
+
+     printnum=nworker<cfg->printnum?nworker:cfg->printnum;
+     for (i=0; i<printnum; i++) {
+           fprintf(cfg->flog,"% 4d[A% f % f % f]C%3d J%5d W% 8f(P%6.3f %6.3f %6.3f)T% 5.3e L% 5.3f %.0f\n", i,
+            workers[i].dir.x,workers[i].dir.y,workers[i].dir.z,(int)workers[i].len.w,(int)workers[i].dir.w,workers[i].pos.w,
+            workers[i].pos.x,workers[i].pos.y,workers[i].pos.z,workers[i].len.y,workers[i].len.x,(float)workers[i].seed[0]);
+     }
+     fprintf(cfg->flog,"simulated %d photons (%d) with %d CPU threads (repeat x%d)\nMCX simulation speed: %.2f photon/ms\n",
+             photoncount,cfg->nphoton,nworker,respin,(double)photoncount/(toc>0?toc:1)); fflush(cfg->flog);
+     fprintf(cfg->flog,"thread utilization: %.1f%% (mean/max time until a thread is done, %s distribution)\n",
+             100.0*busysum/(busyspan>0.0 ? busyspan : 1.0),(cfg->isdynamic ? "dynamic" : "static"));
+     fprintf(cfg->flog,"exit energy:%16.8e + absorbed energy:%16.8e = total: %16.8e\n",
+             energyloss,cfg->nphoton-energyloss,(float)cfg->nphoton);fflush(cfg->flog);
+     for(i=0;i<nworker;i++)
+          ntouched+=workers[i].ntouched;
+     fprintf(cfg->flog,"per-thread field tiles: %.2f MB (%lu of %lu tiles), dense per-thread copies: %.2f MB, output fields: %.2f MB\n",
+             ntouched*(double)tilelen*sizeof(float)/1048576.0,(unsigned long)ntouched,(unsigned long)(ntile*nworker),
+             nworker*(double)fieldlen*sizeof(float)/1048576.0,(double)fieldlen*sizeof(float)/1048576.0);
+     fflush(cfg->flog);
+
+     if(cfg->checkpoint && isrc+1<cfg->srcnum && mcx_cpu_millis()-*ckclock>=cfg->checkpoint*1000u){
+          *ck=ckrun;  // the next source starts afresh
+          ck->isrc=isrc+1;
+          mcx_checkpoint_commit(mcx_checkpoint_create(session,ck),session);
+          *ckclock=mcx_cpu_millis();
+     }
+
+     for(i=0;i<nworker;i++){
+          for(j=0;j<ntile;j++)
+               free(workers[i].tiles[j]);
+          free(workers[i].tiles);
+          free(workers[i].ppath);
+          free(workers[i].parkin);
+          free(workers[i].parkout);
+     }
+     free(workers);
+     free(parkstart);
+     free(field);
+}
+
+/**
+   runs the current source, or every source of the list (-W) on the loaded
+   domain, each into its own session
+*/
+void mcx_cpu_run_simulation(Config *cfg){
+     char session[MAX_SESSION_LENGTH];
+     unsigned int isrc=0,ckclock=mcx_cpu_millis();
+     Checkpoint ck;
+     FILE *ckin=NULL;
+
+     strncpy(session,cfg->session,MAX_SESSION_LENGTH);
+     if(cfg->isresume){
+          ckin=mcx_checkpoint_open(session,&ck);
+          isrc=ck.isrc;
+     }
+     if(cfg->srcnum==0){
+          mcx_cpu_run_source(cfg,0,session,ckin,&ck,&ckclock);
+     }else{
+          for(;isrc<cfg->srcnum;isrc++){
+               mcx_setsource(cfg,isrc,session);
+               fprintf(cfg->flog,"source %u of %u at [%f %f %f], saving to %s\n",isrc+1,cfg->srcnum,
+                     cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z,cfg->session);
+               mcx_cpu_run_source(cfg,isrc,session,ckin,&ck,&ckclock);
+               ckin=NULL;
+          }
+          strncpy(cfg->session,session,MAX_SESSION_LENGTH);
+     }
+     if(cfg->checkpoint || cfg->isresume)
+          mcx_checkpoint_remove(session);  // the run is complete
+}
@@ -0,0 +1,16 @@
+#ifndef _MCEXTREME_CPU_ENGINE_H
+#define _MCEXTREME_CPU_ENGINE_H
+
+#include "mcx_utils.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+void mcx_cpu_run_simulation(Config *cfg);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/*******************************************************************************
+**
+**  Acousto-Optic MCX (AO-MCX) - Matt Adams <adamsm2@bu.edu>
+**
+**	Written based on:
+**  Monte Carlo eXtreme (MCX)  - GPU accelerated 3D Monte Carlo transport simulation
+**  Author: Qianqian Fang <fangq at nmr.mgh.harvard.edu>
+**
+**  mcx_detwriter.c: background writer of the detected photon (.mch) file
+**
+**  License: GNU General Public License v3, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "mcx_detwriter.h"
+
+static void *mcx_detwriter_thread(void *arg){
+     DetWriter *w=(DetWriter *)arg;
+     int id;
+     unsigned int n;
+
+     pthread_mutex_lock(&w->lock);
+     for(;;){
+          while(w->qlen==0 && !w->closing)
+               pthread_cond_wait(&w->cond,&w->lock);
+          if(w->qlen==0)
+               break;
+          id=w->queue[w->qhead];
+          n=w->nrec[id];
+          pthread_mutex_unlock(&w->lock);
+
+          /*only this thread touches the file and the export buffer*/
+          if(w->fp){
+               if(fwrite(w->pages[id],sizeof(float)*w->reclen,n,w->fp)!=n)
+                    mcx_error(-2,"can not save data to disk",__FILE__,__LINE__);
+               w->saved+=n;
+          }else if(w->saved<w->maxexport){
+               if(n>w->maxexport-w->saved)
+                    n=w->maxexport-w->saved;
+               memcpy(w->exportbuf+w->saved*w->reclen,w->pages[id],sizeof(float)*w->reclen*n);
+               w->saved+=n;
+          }
+
+          pthread_mutex_lock(&w->lock);
+          w->qhead=(w->qhead+1)%w->npage;
+          w->qlen--;
+          w->freelist[w->nfree++]=id;
+          pthread_cond_broadcast(&w->cond);
+     }
+     pthread_mutex_unlock(&w->lock);
+     return NULL;
+}
+
+/**
+   with saved>0, continues the .mch file of an interrupted run (-Z) after
+   its first saved records, the ones written after the checkpoint are dropped
+*/
+static DetWriter *mcx_detwriter_start(Config *cfg,unsigned int pagelen,int npage,unsigned long long saved){
+     DetWriter *w=(DetWriter *)calloc(1,sizeof(DetWriter));
+     char name[MAX_PATH_LENGTH];
+     int i;
+
+     w->his=cfg->his;
+     w->reclen=cfg->his.colcount;
+     w->pagelen=(pagelen>0 ? pagelen : 1);
+     w->npage=(npage>1 ? npage : 2);
+     if(cfg->exportdetected){
+          w->exportbuf=cfg->exportdetected;
+          w->maxexport=cfg->maxdetphoton;
+     }else if(saved){
+          sprintf(name,"%s.mch",cfg->session);
+          mcx_truncatefile(name,sizeof(History)+(long long)saved*w->reclen*sizeof(float));
+          if((w->fp=fopen(name,"r+b"))==NULL)
+               mcx_error(-2,"can not save data to disk",__FILE__,__LINE__);
+          fseek(w->fp,0,SEEK_END);
+          w->saved=saved;
+     }else{
+          sprintf(name,"%s.mch",cfg->session);
+          if((w->fp=fopen(name,"wb"))==NULL)
+               mcx_error(-2,"can not save data to disk",__FILE__,__LINE__);
+          fwrite(&w->his,sizeof(History),1,w->fp);  /*placeholder, patched at close*/
+     }
+     w->pages=(float **)calloc(w->npage,sizeof(float *));
+     w->nrec=(unsigned int *)calloc(w->npage,sizeof(unsigned int));
+     w->queue=(int *)calloc(w->npage,sizeof(int));
+     w->freelist=(int *)calloc(w->npage,sizeof(int));
+     for(i=0;i<w->npage;i++){
+          w->pages[i]=(float *)malloc(sizeof(float)*w->reclen*w->pagelen);
+          if(w->pages[i]==NULL)
+               mcx_error(-3,"not enough host memory for the detected photon pages",__FILE__,__LINE__);
+          w->freelist[w->nfree++]=w->npage-1-i;
+     }
+     pthread_mutex_init(&w->lock,NULL);
+     pthread_cond_init(&w->cond,NULL);
+     if(pthread_create(&w->thread,NULL,mcx_detwriter_thread,w))
+          mcx_error(-3,"can not start the detected photon writer",__FILE__,__LINE__);
+     return w;
+}
+
+DetWriter *mcx_detwriter_open(Config *cfg,unsigned int pagelen,int npage){
+     return mcx_detwriter_start(cfg,pagelen,npage,0);
+}
+
+DetWriter *mcx_detwriter_reopen(Config *cfg,unsigned int pagelen,int npage,unsigned long long saved){
+     return mcx_detwriter_start(cfg,pagelen,npage,saved);
+}
+
+/**
+   waits until the submitted pages are on disk, returns the number of
+   records in the file, see mcx_checkpoint.h
+*/
+unsigned long long mcx_detwriter_sync(DetWriter *w){
+     pthread_mutex_lock(&w->lock);
+     while(w->qlen>0)
+          pthread_cond_wait(&w->cond,&w->lock);
+     pthread_mutex_unlock(&w->lock);
+     if(w->fp)
+          fflush(w->fp);
+     return w->saved;
+}
+
+float *mcx_detwriter_getpage(DetWriter *w){
+     float *page;
+     pthread_mutex_lock(&w->lock);
+     while(w->nfree==0)
+          pthread_cond_wait(&w->cond,&w->lock);
+     page=w->pages[w->freelist[--w->nfree]];
+     pthread_mutex_unlock(&w->lock);
+     return page;
+}
+
+void mcx_detwriter_submit(DetWriter *w,float *page,unsigned int nrec){
+     int id;
+     for(id=0;id<w->npage;id++)
+          if(w->pages[id]==page)
+               break;
+     pthread_mutex_lock(&w->lock);
+     if(nrec==0){  /*nothing to write, give the page back*/
+          w->freelist[w->nfree++]=id;
+     }else{
+          w->nrec[id]=nrec;
+          w->queue[(w->qhead+w->qlen)%w->npage]=id;
+          w->qlen++;
+     }
+     pthread_cond_broadcast(&w->cond);
+     pthread_mutex_unlock(&w->lock);
+}
+
+/**
+   drains the queue and writes the final header; cfg->his receives the
+   totals of the whole run
+*/
+void mcx_detwriter_close(DetWriter *w,Config *cfg,unsigned int totalphoton,unsigned int detected){
+     int i;
+
+     pthread_mutex_lock(&w->lock);
+     w->closing=1;
+     pthread_cond_broadcast(&w->cond);
+     pthread_mutex_unlock(&w->lock);
+     pthread_join(w->thread,NULL);
+
+     w->his.unitinmm=cfg->unitinmm;
+     w->his.totalphoton=totalphoton;
+     w->his.detected=detected;
+     w->his.savedphoton=(unsigned int)w->saved;
+     if(w->fp){
+          fseek(w->fp,0,SEEK_SET);
+          fwrite(&w->his,sizeof(History),1,w->fp);
+          fclose(w->fp);
+     }
+     cfg->his=w->his;
+
+     pthread_mutex_destroy(&w->lock);
+     pthread_cond_destroy(&w->cond);
+     for(i=0;i<w->npage;i++)
+          free(w->pages[i]);
+     free(w->pages);
+     free(w->nrec);
+     free(w->queue);
+     free(w->freelist);
+     free(w);
+}
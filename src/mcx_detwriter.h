@@ -0,0 +1,54 @@
+#ifndef _MCEXTREME_DETWRITER_H
+#define _MCEXTREME_DETWRITER_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "mcx_utils.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+   streaming writer of the detected photon (.mch) file: the simulation fills
+   pages of pagelen records and submits them, a background thread appends
+   full pages to the file while transport continues; the pool holds npage
+   pages, mcx_detwriter_getpage() blocks when all of them are in flight.
+   The file has a single History block, savedphoton/detected/totalphoton
+   are patched at mcx_detwriter_close(); mcx_detwriter_reopen() continues
+   the file of an interrupted run (-Z). When Config.exportdetected is set,
+   the pages are copied to that buffer (up to maxdetphoton records) instead.
+*/
+typedef struct MCXDetWriter{
+	FILE *fp;                 /*the .mch file, NULL when exporting to memory*/
+	float *exportbuf;         /*Config.exportdetected*/
+	History his;
+	unsigned int reclen;      /*floats per record*/
+	unsigned int pagelen;     /*records per page*/
+	unsigned int maxexport;   /*records that fit in exportbuf*/
+	int npage;
+	float **pages;
+	unsigned int *nrec;       /*records in each queued page*/
+	int *queue;               /*ring of full pages, npage long*/
+	int qhead,qlen;
+	int *freelist;
+	int nfree;
+	int closing;
+	unsigned long long saved; /*records written so far*/
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+} DetWriter;
+
+DetWriter *mcx_detwriter_open(Config *cfg,unsigned int pagelen,int npage);
+DetWriter *mcx_detwriter_reopen(Config *cfg,unsigned int pagelen,int npage,unsigned long long saved);
+unsigned long long mcx_detwriter_sync(DetWriter *w);
+float *mcx_detwriter_getpage(DetWriter *w);
+void mcx_detwriter_submit(DetWriter *w,float *page,unsigned int nrec);
+void mcx_detwriter_close(DetWriter *w,Config *cfg,unsigned int totalphoton,unsigned int detected);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
@@ -18,10 +18,26 @@
 **	Changes from MCX are marked with //MTA
 *******************************************************************************/
 
+#if !defined(_WIN32) && !defined(WIN32)
+  #define _POSIX_C_SOURCE 200112L  /*mmap, fstat*/
+  #define MCX_USE_MMAP
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#ifdef MCX_USE_MMAP
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+#else
+  #include <io.h>
+#endif
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
 #include "mcx_utils.h"
 #include "mcx_const.h"
 #include "mcx_shapes.h"
@@ -40,14 +56,15 @@
 //MTA. These are the tags for the command line options.
 // It may be good to add an option to perform an optical simulation only w/o acoustics
 const char shortopt[]={'h','i','f','n','t','T','s','a','g','b','B','z','u','H','P',
-                 'd','r','S','p','e','U','R','l','L','I','o','G','M','A','E','v','\0'};
+                 'd','r','S','p','e','U','R','l','L','I','o','G','M','A','E','v','c','q','k','W','x','J','F','D','K','Z','X','j','Q','V','\0'};
 const char *fullopt[]={"--help","--interactive","--input","--photon",
                  "--thread","--blocksize","--session","--array",
                  "--gategroup","--reflect","--reflectin","--srcfrom0",
                  "--unitinmm","--maxdetphoton","--shapes","--savedet",
                  "--repeat","--save2pt","--printlen","--minenergy",
                  "--normalize","--skipradius","--log","--listgpu",
-                 "--printgpu","--root","--gpu","--dumpmask","--autopilot","--seed","--version",""};
+                 "--printgpu","--root","--gpu","--dumpmask","--autopilot","--seed","--version","--cpu","--quantacoustic","--aotable","--srclist","--phasesweep","--sidebands","--acfreq","--streamgate",
+                 "--checkpoint","--resume","--roulette","--dda","--scatlut","--dynamic",""};
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -78,11 +95,24 @@ void mcx_initcfg(Config *cfg){
 	 cfg->Ocon=NULL;		//MTA
      cfg->prop=NULL;
 	 cfg->detpos=NULL;
+     cfg->detgrid=NULL;
+     cfg->srcnum=0;
+     cfg->srclist=NULL;
+     cfg->phasenum=0;
+     cfg->phaselist=NULL;
+     cfg->freqnum=0;
+     cfg->freqlist=NULL;
+     cfg->sidebands=0x3;  /*carrier and first sideband, <session>_0/1.mc2*/
      cfg->vol=NULL;
+     cfg->volmaplen=0;
+     cfg->isvolmapped=0;
      cfg->pressure=NULL;	//MTA
+     memset(&cfg->acorig,0,sizeof(uint3));
+     memset(&cfg->acdim,0,sizeof(uint3));
      cfg->session[0]='\0';
      cfg->printnum=0;
      cfg->minenergy=0.f;
+     cfg->roulettesize=10.f;
      cfg->flog=stdout;
      cfg->sradius=0.f;
      cfg->rootpath[0]='\0';
@@ -92,6 +122,19 @@ void mcx_initcfg(Config *cfg){
      cfg->isdumpmask=0;
      cfg->maxdetphoton=1000000;
      cfg->autopilot=0;
+     cfg->iscpu=0;
+     cfg->isquantac=0;
+     cfg->qpressure=NULL;
+     cfg->acscale=0.f;
+     cfg->isaotable=0;
+     cfg->aotable=NULL;
+     cfg->isstreamgate=0;
+     cfg->isdda=0;
+     cfg->isscatlut=0;
+     cfg->scattable=NULL;
+     cfg->isdynamic=0;
+     cfg->checkpoint=0;
+     cfg->isresume=0;
      cfg->seed=0;
      cfg->exportfield0=NULL;
      cfg->exportfield1=NULL;
@@ -114,9 +157,16 @@ void mcx_clearcfg(Config *cfg){
 		free(cfg->Ocon);	//MTA
 	 if(cfg->detnum)
      	free(cfg->detpos);
+     free(cfg->detgrid);
+     free(cfg->srclist);
+     free(cfg->phaselist);
+     free(cfg->freqlist);
      if(cfg->dim.x && cfg->dim.y && cfg->dim.z)
-        free(cfg->vol);
+        mcx_releasevolume(cfg);
 		free(cfg->pressure);	//MTA
+		free(cfg->qpressure);
+		free(cfg->aotable);
+     free(cfg->scattable);
 		
      mcx_initcfg(cfg);
 }
@@ -146,6 +196,104 @@ void mcx_savedata(float *dat, int len, int doappend, char *suffix, Config *cfg,
      fclose(fp);
 }
 
+/**
+   saves the sideband fields of a run: field holds one block per sideband of
+   the set (-J), each block holds the variants of all phases (-x) and
+   frequencies (-F), the one of the k-th phase and q-th frequency starting at
+   (k*max(freqnum,1)+q)*fieldlen. The n-th sideband goes to <session>_n.mc2,
+   prefixed by ph<k>_ and f<q>_ when there is a sweep
+*/
+void mcx_savefields(float *field, int fieldlen, int doappend, Config *cfg){
+     char name[64];
+     unsigned int bands,n,k,q;
+     int len;
+     for(bands=cfg->sidebands,n=0;bands;bands>>=1,n++){
+          if(!(bands&1))
+               continue;
+          for(k=0;k<MAX(cfg->phasenum,1);k++)
+               for(q=0;q<MAX(cfg->freqnum,1);q++){
+                    len=0;
+                    if(cfg->phasenum)
+                         len+=sprintf(name+len,"ph%u_",k);
+                    if(cfg->freqnum)
+                         len+=sprintf(name+len,"f%u_",q);
+                    sprintf(name+len,"%u",n);
+                    mcx_savedata(field,fieldlen,doappend,"mc2",cfg,name);
+                    field+=fieldlen;
+               }
+     }
+}
+
+/**
+   cuts a file back to len bytes, drops the output written after the
+   checkpoint a run is resumed from
+*/
+void mcx_truncatefile(const char *name,long long len){
+     FILE *fp=fopen(name,"r+b");
+#ifdef MCX_USE_MMAP
+     if(fp==NULL || ftruncate(fileno(fp),(off_t)len))
+#else
+     if(fp==NULL || _chsize_s(_fileno(fp),len))
+#endif
+          mcx_error(-2,"can not truncate the output file",__FILE__,__LINE__);
+     fclose(fp);
+}
+
+/**
+   cuts the files written by mcx_savefields() back to the first nwin time
+   windows of fieldlen floats each
+*/
+void mcx_truncatefields(int fieldlen, unsigned int nwin, Config *cfg){
+     char name[64],fname[MAX_PATH_LENGTH];
+     unsigned int bands,n,k,q;
+     int len;
+     for(bands=cfg->sidebands,n=0;bands;bands>>=1,n++){
+          if(!(bands&1))
+               continue;
+          for(k=0;k<MAX(cfg->phasenum,1);k++)
+               for(q=0;q<MAX(cfg->freqnum,1);q++){
+                    len=0;
+                    if(cfg->phasenum)
+                         len+=sprintf(name+len,"ph%u_",k);
+                    if(cfg->freqnum)
+                         len+=sprintf(name+len,"f%u_",q);
+                    sprintf(name+len,"%u",n);
+                    sprintf(fname,"%s_%s.mc2",cfg->session,name);
+                    mcx_truncatefile(fname,(long long)fieldlen*nwin*sizeof(float));
+               }
+     }
+}
+
+/**
+   copies the first two sidebands of the set, all variants each, to
+   exportfield0/exportfield1; with the default set these are J0^2 and 2*J1^2
+*/
+void mcx_exportfields(float *field, int fieldlen, Config *cfg){
+     size_t len=(size_t)fieldlen*mcx_variantnum(cfg);
+     memcpy(cfg->exportfield0,field,len*sizeof(float));
+     if(cfg->exportfield1 && mcx_sidebandnum(cfg)>1)
+          memcpy(cfg->exportfield1,field+len,len*sizeof(float));
+}
+
+/**
+   number of sideband fields per variant, one per bit of Config.sidebands
+*/
+int mcx_sidebandnum(Config *cfg){
+     unsigned int bands;
+     int n=0;
+     for(bands=cfg->sidebands;bands;bands>>=1)
+          n+=(bands&1);
+     return n;
+}
+
+/**
+   number of modulations carried by a photon, one per phase offset and
+   acoustic frequency
+*/
+int mcx_variantnum(Config *cfg){
+     return MAX(cfg->phasenum,1)*MAX(cfg->freqnum,1);
+}
+
 //MTA. This just prints the simulation log in the command window. 
 void mcx_printlog(Config *cfg, char *str){
      if(cfg->flog>0){ /*stdout is 1*/
@@ -245,7 +393,6 @@ void mcx_writeconfig(char *fname, Config *cfg){
 
 //MTA. Configures simulation domain based on volume bin file (eg. semi60x60x60.bin).
 void mcx_prepdomain(char *op_filename, char *ac_filename, Config *cfg){
-     int idx1d;
      if(op_filename[0] || cfg->vol){
         if(cfg->vol==NULL){
 	    	mcx_loadvolume(op_filename,cfg);
@@ -253,6 +400,7 @@ void mcx_prepdomain(char *op_filename, char *ac_filename, Config *cfg){
                   int status;
      		  	  Grid3D grid={&(cfg->vol),&(cfg->dim),{1.f,1.f,1.f},cfg->isrowmajor};
         	  	  if(cfg->issrcfrom0) memset(&(grid.orig.x),0,sizeof(float3));
+		  			mcx_privatevolume(cfg);
 		  			status=mcx_parse_shapestring(&grid,cfg->shapedata);
 		  		  if(status){
 		      		MCX_ERROR(status,mcx_last_shapeerror());
@@ -263,16 +411,52 @@ void mcx_prepdomain(char *op_filename, char *ac_filename, Config *cfg){
 	 if(ac_filename[0] || cfg->pressure){
         if(cfg->pressure==NULL){
 	     mcx_loadacoustics(ac_filename,cfg);
+		}else if(cfg->acdim.x==0){
+	     cfg->acdim=cfg->dim; /*a buffer passed in by the caller spans the whole domain*/
+	     if(cfg->isrowmajor){
+	          cfg->acdim.x=cfg->dim.z;
+	          cfg->acdim.z=cfg->dim.x;
+	     }
 		}
+		if(cfg->isrowmajor)
+	     mcx_convertacoustics2col(cfg);
+		if(cfg->isquantac && cfg->pressure)
+	     mcx_quantizeacoustics(cfg);
+		if(cfg->isaotable && (cfg->pressure || cfg->qpressure))
+	     mcx_buildaotable(cfg);
 	 }
 	
 	if(cfg->isrowmajor){
 		/*from here on, the array is always col-major*/
-		mcx_convertrow2col(&(cfg->vol), &(cfg->dim));
+		if(cfg->volmaplen){
+			/*transpose straight out of the file mapping, or permute the private mapping in place*/
+			unsigned char *newvol=(unsigned char*)malloc(cfg->volmaplen);
+			if(newvol){
+				mcx_transpose3d(newvol,cfg->vol,cfg->dim,sizeof(unsigned char));
+				mcx_releasevolume(cfg);
+				cfg->vol=newvol;
+			}else
+				mcx_transpose3d(NULL,cfg->vol,cfg->dim,sizeof(unsigned char));
+		}else
+			mcx_convertrow2col(&(cfg->vol), &(cfg->dim));
 		cfg->isrowmajor=0;
 	}
-	if(cfg->issavedet)
+	if(cfg->issavedet){
 		mcx_maskdet(cfg);
+		mcx_builddetgrid(cfg);
+	}
+	mcx_prepsource(cfg);
+     }else{
+     	mcx_error(-4,"one must specify a binary volume file in order to run the simulation",__FILE__,__LINE__);
+     }
+}
+
+/**
+   checks that the source is inside of the volume; a source in a background
+   voxel is moved along its direction until it enters the domain
+*/
+void mcx_prepsource(Config *cfg){
+     int idx1d;
 	if(cfg->srcpos.x<0.f || cfg->srcpos.y<0.f || cfg->srcpos.z<0.f || 
 		cfg->srcpos.x>=cfg->dim.x || cfg->srcpos.y>=cfg->dim.y || cfg->srcpos.z>=cfg->dim.z)
 		mcx_error(-4,"source position is outside of the volume",__FILE__,__LINE__);
@@ -294,11 +478,194 @@ void mcx_prepdomain(char *op_filename, char *ac_filename, Config *cfg){
 		}
 		printf("fixing source position to (%f %f %f)\n",cfg->srcpos.x,cfg->srcpos.y,cfg->srcpos.z);
 	}
+}
+
+
+/**
+   reads the source list of the batch mode (-W): a JSON file holding an
+   array of {"Pos":[x,y,z],"Dir":[x,y,z]} objects (or such an array named
+   "Sources"), or a text file with one "x y z [dx dy dz]" source per line;
+   a missing direction is that of the input file. Positions follow the
+   origin convention of the input file (-z). Every source is checked and,
+   if needed, moved into the domain here, so the batch never stops halfway
+*/
+void mcx_loadsrclist(char *fname, Config *cfg){
+     FILE *fp;
+     char *buf;
+     long len;
+     uint i,n=0,maxsrc=16;
+     float3 pos0=cfg->srcpos,dir0=cfg->srcdir,*list;
+
+     if((fp=fopen(fname,"rb"))==NULL)
+          mcx_error(-2,"can not open the source list file",__FILE__,__LINE__);
+     fseek(fp,0,SEEK_END);
+     len=ftell(fp);
+     rewind(fp);
+     buf=(char *)calloc(len+1,1);
+     if(len>0 && fread(buf,len,1,fp)!=1)
+          mcx_error(-2,"reading the source list file is terminated",__FILE__,__LINE__);
+     fclose(fp);
+
+     list=(float3 *)malloc(sizeof(float3)*2*maxsrc);
+     if(buf[strspn(buf," \t\r\n")]=='[' || buf[strspn(buf," \t\r\n")]=='{'){
+          cJSON *root=cJSON_Parse(buf),*src,*pos,*dir;
+          if(root==NULL)
+               mcx_error(-9,"invalid JSON source list",__FILE__,__LINE__);
+          src=(root->type==cJSON_Array) ? root->child : cJSON_GetObjectItem(root,"Sources");
+          if(src && src->type==cJSON_Array)
+               src=src->child;
+          for(;src;src=src->next){
+               pos=cJSON_GetObjectItem(src,"Pos");
+               dir=cJSON_GetObjectItem(src,"Dir");
+               if(pos==NULL || cJSON_GetArraySize(pos)<3)
+                    mcx_error(-9,"every source in the list needs a 3-element Pos",__FILE__,__LINE__);
+               if(n==maxsrc)
+                    list=(float3 *)realloc(list,sizeof(float3)*2*(maxsrc*=2));
+               list[2*n].x=pos->child->valuedouble;
+               list[2*n].y=pos->child->next->valuedouble;
+               list[2*n].z=pos->child->next->next->valuedouble;
+               list[2*n+1]=dir0;
+               if(dir && cJSON_GetArraySize(dir)>=3){
+                    list[2*n+1].x=dir->child->valuedouble;
+                    list[2*n+1].y=dir->child->next->valuedouble;
+                    list[2*n+1].z=dir->child->next->next->valuedouble;
+               }
+               n++;
+          }
+          cJSON_Delete(root);
      }else{
-     	mcx_error(-4,"one must specify a binary volume file in order to run the simulation",__FILE__,__LINE__);
+          char *line=strtok(buf,"\n");
+          for(;line;line=strtok(NULL,"\n")){
+               float3 pos,dir=dir0;
+               int nval=sscanf(line,"%f %f %f %f %f %f",&pos.x,&pos.y,&pos.z,&dir.x,&dir.y,&dir.z);
+               if(nval<=0)
+                    continue;   /*blank or comment line*/
+               if(nval!=3 && nval!=6)
+                    mcx_error(-2,"a source list line must be \"x y z\" or \"x y z dx dy dz\"",__FILE__,__LINE__);
+               if(n==maxsrc)
+                    list=(float3 *)realloc(list,sizeof(float3)*2*(maxsrc*=2));
+               list[2*n]=pos;
+               list[2*n+1]=dir;
+               n++;
+          }
+     }
+     free(buf);
+     if(n==0)
+          mcx_error(-2,"the source list is empty",__FILE__,__LINE__);
+
+     for(i=0;i<n;i++){
+          cfg->srcpos=list[2*i];
+          cfg->srcdir=list[2*i+1];
+          if(!cfg->issrcfrom0){
+               cfg->srcpos.x--;cfg->srcpos.y--;cfg->srcpos.z--; /*convert to C index, grid center*/
+          }
+          if(cfg->vol)
+               mcx_prepsource(cfg);
+          list[2*i]=cfg->srcpos;
+     }
+     cfg->srcpos=pos0;
+     cfg->srcdir=dir0;
+     free(cfg->srclist);
+     cfg->srclist=list;
+     cfg->srcnum=n;
+}
+
+/**
+   makes the isrc-th source of the list the current one, the output of the
+   run goes to the session "<session>_src<isrc+1>"
+*/
+void mcx_setsource(Config *cfg, uint isrc, const char *session){
+     cfg->srcpos=cfg->srclist[2*isrc];
+     cfg->srcdir=cfg->srclist[2*isrc+1];
+     if(cfg->sradius>0.f){
+     	cfg->crop0.x=(uint)MAX(cfg->srcpos.x-cfg->sradius,0.f);
+     	cfg->crop0.y=(uint)MAX(cfg->srcpos.y-cfg->sradius,0.f);
+     	cfg->crop0.z=(uint)MAX(cfg->srcpos.z-cfg->sradius,0.f);
+     	cfg->crop1.x=MIN((uint)(cfg->srcpos.x+cfg->sradius),cfg->dim.x-1);
+     	cfg->crop1.y=MIN((uint)(cfg->srcpos.y+cfg->sradius),cfg->dim.y-1);
+     	cfg->crop1.z=MIN((uint)(cfg->srcpos.z+cfg->sradius),cfg->dim.z-1);
      }
+     snprintf(cfg->session,MAX_SESSION_LENGTH,"%s_src%u",session,isrc+1);
 }
 
+/**
+   parses the phase offsets of -x: a single integer N gives N offsets evenly
+   spaced over a period (360*k/N degrees), otherwise a comma separated list
+   of offsets in degrees, e.g. "0,45,90" or "30." for a single offset
+*/
+void mcx_parsephases(char *str, Config *cfg){
+     char *p=str,*end;
+     unsigned int n=0,k;
+     float list[MAX_PHASES];
+
+     if(strpbrk(str,",.eE")==NULL){
+          n=atoi(str);
+          if(n<1 || n>MAX_PHASES)
+               MCX_ERROR(-1,"the number of phases of a sweep must be between 1 and MAX_PHASES");
+          for(k=0;k<n;k++)
+               list[k]=TWO_PI*k/n;
+     }else{
+          while(*p){
+               if(n>=MAX_PHASES)
+                    MCX_ERROR(-1,"too many phase offsets, increase MAX_PHASES");
+               list[n]=strtod(p,&end)*(TWO_PI/360.f);
+               if(end==p)
+                    MCX_ERROR(-1,"incorrect phase offset list");
+               n++;
+               p=end+strspn(end,", ");
+          }
+     }
+     free(cfg->phaselist);
+     cfg->phaselist=(float *)malloc(sizeof(float)*n);
+     memcpy(cfg->phaselist,list,sizeof(float)*n);
+     cfg->phasenum=n;
+}
+
+/**
+   parses the acoustic frequencies of -F, a comma separated list in Hz, values
+   below 1e3 are in MHz as Acon.f of the input file, e.g. "1.1,2.2,3.3"
+*/
+void mcx_parsefreqs(char *str, Config *cfg){
+     char *p=str,*end;
+     unsigned int n=0;
+     float list[MAX_FREQS];
+
+     while(*p){
+          if(n>=MAX_FREQS)
+               MCX_ERROR(-1,"too many acoustic frequencies, increase MAX_FREQS");
+          list[n]=strtod(p,&end);
+          if(end==p || list[n]<=0.f)
+               MCX_ERROR(-1,"incorrect acoustic frequency list");
+          if(list[n]<1e3)
+               list[n]*=1e6;
+          n++;
+          p=end+strspn(end,", ");
+     }
+     free(cfg->freqlist);
+     cfg->freqlist=(float *)malloc(sizeof(float)*n);
+     memcpy(cfg->freqlist,list,sizeof(float)*n);
+     cfg->freqnum=n;
+}
+
+/**
+   parses the sideband orders of -J, a comma separated list, e.g. "0,1,2,3";
+   0 is the carrier J0^2, n>0 the n-th sideband 2*Jn^2
+*/
+void mcx_parsesidebands(char *str, Config *cfg){
+     char *p=str,*end;
+     long n;
+
+     cfg->sidebands=0;
+     while(*p){
+          n=strtol(p,&end,10);
+          if(end==p || n<0 || n>31)
+               MCX_ERROR(-1,"incorrect sideband list, the orders must be between 0 and 31");
+          cfg->sidebands|=1u<<n;
+          p=end+strspn(end,", ");
+     }
+     if(cfg->sidebands==0)
+          MCX_ERROR(-1,"the sideband list is empty");
+}
 
 //MTA. This sets the input parameters for the simulation.
 void mcx_loadconfig(FILE *in, Config *cfg){
@@ -405,9 +772,9 @@ void mcx_loadconfig(FILE *in, Config *cfg){
      comm=fgets(comment,MAX_PATH_LENGTH,in);
 
      if(cfg->sradius>0.f){
-     	cfg->crop0.x=MAX((uint)(cfg->srcpos.x-cfg->sradius),0);
-     	cfg->crop0.y=MAX((uint)(cfg->srcpos.y-cfg->sradius),0);
-     	cfg->crop0.z=MAX((uint)(cfg->srcpos.z-cfg->sradius),0);
+     	cfg->crop0.x=(uint)MAX(cfg->srcpos.x-cfg->sradius,0.f);
+     	cfg->crop0.y=(uint)MAX(cfg->srcpos.y-cfg->sradius,0.f);
+     	cfg->crop0.z=(uint)MAX(cfg->srcpos.z-cfg->sradius,0.f);
      	cfg->crop1.x=MIN((uint)(cfg->srcpos.x+cfg->sradius),cfg->dim.x-1);
      	cfg->crop1.y=MIN((uint)(cfg->srcpos.y+cfg->sradius),cfg->dim.y-1);
      	cfg->crop1.z=MIN((uint)(cfg->srcpos.z+cfg->sradius),cfg->dim.z-1);
@@ -504,7 +871,9 @@ void mcx_loadconfig(FILE *in, Config *cfg){
      mcx_prepdomain(op_filename,ac_filename,cfg);
      cfg->his.maxmedia=cfg->medianum-1; /*skip media 0*/
      cfg->his.detnum=cfg->detnum;
-     cfg->his.colcount=cfg->medianum+3;  //MTA
+     cfg->his.phasenum=cfg->phasenum;
+     cfg->his.freqnum=cfg->freqnum;
+     cfg->his.colcount=cfg->medianum+1+2*mcx_variantnum(cfg);  //MTA one magnitude/phase pair per phase and frequency
 }
 
 // JSON NOT UPDATED FOR AO-MCX!!!
@@ -621,9 +990,9 @@ int mcx_loadjson(cJSON *root, Config *cfg){
 	if(val && cfg->issrcfrom0==0) cfg->issrcfrom0=val->valueint;
 
 	if(cfg->sradius>0.f){
-     	   cfg->crop0.x=MAX((uint)(cfg->srcpos.x-cfg->sradius),0);
-     	   cfg->crop0.y=MAX((uint)(cfg->srcpos.y-cfg->sradius),0);
-     	   cfg->crop0.z=MAX((uint)(cfg->srcpos.z-cfg->sradius),0);
+     	   cfg->crop0.x=(uint)MAX(cfg->srcpos.x-cfg->sradius,0.f);
+     	   cfg->crop0.y=(uint)MAX(cfg->srcpos.y-cfg->sradius,0.f);
+     	   cfg->crop0.z=(uint)MAX(cfg->srcpos.z-cfg->sradius,0.f);
      	   cfg->crop1.x=MIN((uint)(cfg->srcpos.x+cfg->sradius),cfg->dim.x-1);
      	   cfg->crop1.y=MIN((uint)(cfg->srcpos.y+cfg->sradius),cfg->dim.y-1);
      	   cfg->crop1.z=MIN((uint)(cfg->srcpos.z+cfg->sradius),cfg->dim.z-1);
@@ -728,7 +1097,9 @@ int mcx_loadjson(cJSON *root, Config *cfg){
      //mcx_prepdomain(filename,FOO,cfg);
      cfg->his.maxmedia=cfg->medianum-1; /*skip media 0*/
      cfg->his.detnum=cfg->detnum;
-     cfg->his.colcount=cfg->medianum+3; /*column count=maxmedia+2*/  //MTA
+     cfg->his.phasenum=cfg->phasenum;
+     cfg->his.freqnum=cfg->freqnum;
+     cfg->his.colcount=cfg->medianum+1+2*mcx_variantnum(cfg); /*column count=maxmedia+2+2*phases*freqs*/  //MTA
      return 0;
 }
 
@@ -759,14 +1130,91 @@ void mcx_saveconfig(FILE *out, Config *cfg){
 }
  
 //MTA. This sets up the simulation domain based on the volume binary file (eg. semi60x60x60.bin).
+/*
+   maps the first len bytes of an input file; the mapping is private, so the
+   pages stay shared in the page cache between all simulations using the same
+   file until a process writes to them (e.g. mcx_maskdet). Without mmap the
+   file is read into a malloc buffer and *ismapped is set to 0. Returns NULL
+   if the file is too short.
+*/
+static void *mcx_mapfile(FILE *fp,size_t len,char *ismapped){
+     void *buf;
+#ifdef MCX_USE_MMAP
+     struct stat st;
+#endif
+     *ismapped=0;
+#ifdef MCX_USE_MMAP
+     if(fstat(fileno(fp),&st)!=0 || (size_t)st.st_size<len)
+          return NULL;
+     buf=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_PRIVATE,fileno(fp),0);
+     if(buf!=MAP_FAILED){
+          *ismapped=1;
+          return buf;
+     }
+#endif
+     buf=malloc(len);
+     if(buf && fread(buf,1,len,fp)!=len){
+          free(buf);
+          buf=NULL;
+     }
+     return buf;
+}
+
+/*
+   releases a buffer returned by mcx_mapfile(), only real mappings are unmapped
+*/
+static void mcx_unmapfile(void *buf,size_t len,char ismapped){
+#ifdef MCX_USE_MMAP
+     if(ismapped){
+          munmap(buf,len);
+          return;
+     }
+#endif
+     free(buf);
+}
+
+/*
+   frees cfg->vol, whether it is a file mapping or a malloc buffer
+*/
+void mcx_releasevolume(Config *cfg){
+     if(cfg->volmaplen)
+          mcx_unmapfile(cfg->vol,cfg->volmaplen,cfg->isvolmapped);
+     else
+          free(cfg->vol);
+     cfg->vol=NULL;
+     cfg->volmaplen=0;
+     cfg->isvolmapped=0;
+}
+
+/*
+   replaces a mapped volume by a malloc copy, must be called before the
+   volume is resized or freed by the shape rasterizer or mcx_convertrow2col()
+*/
+void mcx_privatevolume(Config *cfg){
+     unsigned char *vol;
+     if(cfg->volmaplen==0)
+          return;
+     vol=(unsigned char*)malloc(cfg->volmaplen);
+     if(vol==NULL)
+          mcx_error(-3,"not enough host memory for the volume",__FILE__,__LINE__);
+     memcpy(vol,cfg->vol,cfg->volmaplen);
+     mcx_unmapfile(cfg->vol,cfg->volmaplen,cfg->isvolmapped);
+     cfg->vol=vol;
+     cfg->volmaplen=0;
+     cfg->isvolmapped=0;
+}
+
 void mcx_loadvolume(char *filename,Config *cfg){
-     unsigned int i,datalen,res;
+     long i;
+     size_t datalen;
+     unsigned char maxid=0;
      FILE *fp;
      
      if(strstr(filename,".json")!=NULL){
          int status;
          Grid3D grid={&(cfg->vol),&(cfg->dim),{1.f,1.f,1.f},cfg->isrowmajor};
 	 if(cfg->issrcfrom0) memset(&(grid.orig.x),0,sizeof(float3));
+         mcx_privatevolume(cfg);
          status=mcx_load_jsonshapes(&grid,filename);
 	 if(status){
 	     MCX_ERROR(status,mcx_last_shapeerror());
@@ -777,30 +1225,48 @@ void mcx_loadvolume(char *filename,Config *cfg){
      if(fp==NULL){
      	     mcx_error(-5,"the specified binary volume file does not exist",__FILE__,__LINE__);
      }
-     if(cfg->vol){
-     	     free(cfg->vol);
-     	     cfg->vol=NULL;
-     }
-     datalen=cfg->dim.x*cfg->dim.y*cfg->dim.z;
-     cfg->vol=(unsigned char*)malloc(sizeof(unsigned char)*datalen);
-     res=fread(cfg->vol,sizeof(unsigned char),datalen,fp);
+     if(cfg->vol)
+     	     mcx_releasevolume(cfg);
+     datalen=(size_t)cfg->dim.x*cfg->dim.y*cfg->dim.z;
+     cfg->vol=(unsigned char*)mcx_mapfile(fp,datalen,&cfg->isvolmapped);
      fclose(fp);
-     if(res!=datalen){
+     if(cfg->vol==NULL){
      	 mcx_error(-6,"file size does not match specified dimensions",__FILE__,__LINE__);
      }
-     for(i=0;i<datalen;i++){
-         if(cfg->vol[i]>=cfg->medianum)
-            mcx_error(-6,"medium index exceeds the specified medium types",__FILE__,__LINE__);
+     cfg->volmaplen=datalen;
+#ifdef _OPENMP
+     #pragma omp parallel for reduction(max:maxid)
+#endif
+     for(i=0;i<(long)datalen;i++){
+         if(cfg->vol[i]>maxid)
+            maxid=cfg->vol[i];
      }
+     if(maxid>=cfg->medianum)
+         mcx_error(-6,"medium index exceeds the specified medium types",__FILE__,__LINE__);
 }
 
 // MTA This entire sub-function was written by me
+/*
+   the acoustics file stores Px, Py, Pz and USphase as 4 consecutive planar
+   volumes; only the bounding box of the voxels with a non-zero pressure vector
+   is kept in cfg->pressure, voxels outside of the box have no acoustic field.
+   the file is mapped, not copied, and both the bounding box search and the
+   planar-to-interleaved transpose run in parallel over the z-slices
+*/
 void mcx_loadacoustics(char *filename,Config *cfg){
-     unsigned int i,j,k,index,datalen,res;
+     size_t dimxy,datalen,boxlen;
+     long k;
+     unsigned int lox,loy,loz,hix=0,hiy=0,hiz=0;
+     uint3 dim=cfg->dim;
+     float *planes;
+     char ismapped;
      FILE *fp;
-     
-     unsigned int current_pos=0;
-     
+
+     if(cfg->isrowmajor){ /*scan the file in its own order, see mcx_convertacoustics2col()*/
+        dim.x=cfg->dim.z;
+        dim.z=cfg->dim.x;
+     }
+
      fp=fopen(filename,"rb");
      if(fp==NULL){
      	     mcx_error(-5,"the specified binary acoustics file does not exist",__FILE__,__LINE__);
@@ -809,135 +1275,474 @@ void mcx_loadacoustics(char *filename,Config *cfg){
      	     free(cfg->pressure);
      	     cfg->pressure=NULL;
      }
-     
-     datalen=cfg->dim.x*cfg->dim.y*cfg->dim.z;
-     float * my_data = (float *)malloc(datalen*4*sizeof(float));
-     cfg->pressure = (Acoustics*)malloc(datalen*sizeof(Acoustics));
-     
-     res=fread( my_data, sizeof(float), datalen*4, fp);
-     if(res!=datalen*4){
+
+     dimxy=(size_t)dim.x*dim.y;
+     datalen=dimxy*dim.z;
+     planes=(float *)mcx_mapfile(fp,datalen*4*sizeof(float),&ismapped);
+     fclose(fp);
+     if(planes==NULL){
      	 mcx_error(-6,"file size does not match specified dimensions",__FILE__,__LINE__);
      }
-     
-     for( k =0; k < cfg->dim.z; ++k){
-		for( j =0; j < cfg->dim.y; ++j){
-			for( i =0; i < cfg->dim.x; ++i){
-					index =  cfg->dim.x*cfg->dim.y*k + cfg->dim.x*j + i;
-					cfg->pressure[current_pos].Px = my_data[index];
-	 				cfg->pressure[current_pos].Py = my_data[datalen + index];
-					cfg->pressure[current_pos].Pz = my_data[datalen*2 + index];
-					cfg->pressure[current_pos].USphase = my_data[datalen*3 + index];
-					
-					/*if(i<10 && j==0 && k==0)
-						printf("%f\t%f\t%f\t%f\n", cfg->pressure[current_pos].Px, cfg->pressure[current_pos].Py, cfg->pressure[current_pos].Pz, cfg->pressure[current_pos].USphase );*/
-											
-					current_pos = current_pos+1;
-				}
-			}
-		} 
-     
-     fclose(fp);
-     
-     free(my_data);
-     
-     /*for(i=0;i<datalen;i++){
-         if(sqrtf(cfg->pressure[i].Px*cfg->pressure[i].Px+cfg->pressure[i].Py*cfg->pressure[i].Py+cfg->pressure[i].Pz*cfg->pressure[i].Pz)<0.01f)
-            mcx_error(-6,"cfg->pressure isn't set properly",__FILE__,__LINE__);
-     }*/
+
+     /*pass 1: find the bounding box of the insonified voxels*/
+     lox=dim.x; loy=dim.y; loz=dim.z;
+#ifdef _OPENMP
+     #pragma omp parallel for schedule(dynamic) reduction(min:lox,loy,loz) reduction(max:hix,hiy,hiz)
+#endif
+     for(k=0;k<(long)(3*dim.z);k++){
+        const float *slice=planes+k*dimxy;
+        unsigned int i,j,z=k%dim.z;
+        for(j=0;j<dim.y;j++)
+           for(i=0;i<dim.x;i++){
+              if(slice[j*dim.x+i]!=0.f){
+                 lox=MIN(lox,i); hix=MAX(hix,i+1);
+                 loy=MIN(loy,j); hiy=MAX(hiy,j+1);
+                 loz=MIN(loz,z); hiz=MAX(hiz,z+1);
+              }
+           }
+     }
+     if(hix==0){ /*no acoustic field at all*/
+        memset(&cfg->acorig,0,sizeof(uint3));
+        memset(&cfg->acdim,0,sizeof(uint3));
+        mcx_unmapfile(planes,datalen*4*sizeof(float),ismapped);
+        return;
+     }
+     cfg->acorig.x=lox; cfg->acorig.y=loy; cfg->acorig.z=loz;
+     cfg->acdim.x=hix-lox;
+     cfg->acdim.y=hiy-loy;
+     cfg->acdim.z=hiz-loz;
+     boxlen=(size_t)cfg->acdim.x*cfg->acdim.y*cfg->acdim.z;
+
+     /*pass 2: interleave the 4 planes of the box, one x-row at a time*/
+     cfg->pressure=(Acoustics*)malloc(boxlen*sizeof(Acoustics));
+     if(cfg->pressure==NULL)
+        mcx_error(-3,"not enough host memory for the acoustic field",__FILE__,__LINE__);
+#ifdef _OPENMP
+     #pragma omp parallel for schedule(static)
+#endif
+     for(k=0;k<(long)(cfg->acdim.z*cfg->acdim.y);k++){
+        size_t src=(k/cfg->acdim.y+loz)*dimxy+(k%cfg->acdim.y+loy)*dim.x+lox;
+        Acoustics *dst=cfg->pressure+k*cfg->acdim.x;
+        unsigned int i;
+        for(i=0;i<cfg->acdim.x;i++){
+           dst[i].Px=planes[src+i];
+           dst[i].Py=planes[datalen+src+i];
+           dst[i].Pz=planes[2*datalen+src+i];
+           dst[i].USphase=planes[3*datalen+src+i];
+        }
+     }
+     mcx_unmapfile(planes,datalen*4*sizeof(float),ismapped);
+}
+
+/*
+   convert cfg->pressure to the 8-byte AcousticsQ records: Px/Py/Pz share one
+   scale so that the largest component maps to 32767, the phase is wrapped to
+   [0,2*pi) and stored in 1/65536 turns. the float buffer is released.
+*/
+void mcx_quantizeacoustics(Config *cfg){
+     size_t i,c,len=(size_t)cfg->acdim.x*cfg->acdim.y*cfg->acdim.z;
+     float pmax=0.f,perr=0.f,phierr=0.f,val,phi,*src;
+     short *dst;
+     long turn;
+
+     if(cfg->qpressure){
+     	     free(cfg->qpressure);
+     	     cfg->qpressure=NULL;
+     }
+     for(i=0;i<len;i++){
+         pmax=MAX(pmax,fabs(cfg->pressure[i].Px));
+         pmax=MAX(pmax,fabs(cfg->pressure[i].Py));
+         pmax=MAX(pmax,fabs(cfg->pressure[i].Pz));
+     }
+     cfg->acscale=(pmax>0.f) ? pmax/32767.f : 1.f;
+     cfg->qpressure=(AcousticsQ*)malloc(MAX(len,1)*sizeof(AcousticsQ));
+     if(cfg->qpressure==NULL)
+        mcx_error(-3,"not enough host memory for the acoustic field",__FILE__,__LINE__);
+
+     src=(float *)cfg->pressure;
+     dst=(short *)cfg->qpressure;
+     for(i=0;i<len;i++){
+        for(c=0;c<3;c++){
+           dst[c]=(short)lrintf(src[c]/cfg->acscale);
+           perr=MAX(perr,fabs(dst[c]*cfg->acscale-src[c]));
+        }
+        turn=lrintf(src[3]*(65536.f/TWO_PI));
+        ((unsigned short *)dst)[3]=(unsigned short)(turn & 0xFFFF);
+        phi=((unsigned short *)dst)[3]*(TWO_PI/65536.f);
+        val=fmodf(fabs(phi-src[3]),TWO_PI);
+        phierr=MAX(phierr,MIN(val,TWO_PI-val));
+        src+=4;
+        dst+=4;
+     }
+     free(cfg->pressure);
+     cfg->pressure=NULL;
+     fprintf(cfg->flog,"acoustic field quantized to 16 bits: step %e, max pressure error %e (%.2e of max), max phase error %e rad\n",
+          cfg->acscale,perr,(pmax>0.f ? perr/pmax : 0.f),phierr);
+}
+
+/*
+   fold one acoustic record into the terms used by the transport loops:
+   the scattering term (P/|P|).d*|P|*sin(phase) becomes (P*sin(phase)).d and
+   the refractive index term |P|*cos/sin(phase) is stored directly. voxels
+   where no pressure component exceeds EPS do not modulate and stay zero
+*/
+void mcx_aocoef(const Acoustics *pressure, AOCoef *coef){
+     float Pmag,sphase,cphase;
+     if(pressure->Px>EPS || pressure->Py>EPS || pressure->Pz>EPS){
+         Pmag=sqrtf(pressure->Px*pressure->Px + pressure->Py*pressure->Py + pressure->Pz*pressure->Pz);
+         sphase=sinf(pressure->USphase);
+         cphase=cosf(pressure->USphase);
+         coef->Sx=pressure->Px*sphase; coef->Sy=pressure->Py*sphase; coef->Sz=pressure->Pz*sphase;
+         coef->Cx=pressure->Px*cphase; coef->Cy=pressure->Py*cphase; coef->Cz=pressure->Pz*cphase;
+         coef->Ci=Pmag*cphase;
+         coef->Si=-Pmag*sphase;
+     }else{
+         memset(coef,0,sizeof(AOCoef));
+     }
+}
+
+/*
+   precompute the AO terms of every voxel in the acoustic box; the table is
+   twice the size of the float field, the source buffers are released
+*/
+void mcx_buildaotable(Config *cfg){
+     size_t i,len=(size_t)cfg->acdim.x*cfg->acdim.y*cfg->acdim.z;
+     Acoustics p;
+
+     free(cfg->aotable);
+     cfg->aotable=(AOCoef*)malloc(MAX(len,1)*sizeof(AOCoef));
+     if(cfg->aotable==NULL)
+        mcx_error(-3,"not enough host memory for the AO coefficient table",__FILE__,__LINE__);
+     for(i=0;i<len;i++){
+        if(cfg->qpressure){
+           p.Px=cfg->qpressure[i].Px*cfg->acscale;
+           p.Py=cfg->qpressure[i].Py*cfg->acscale;
+           p.Pz=cfg->qpressure[i].Pz*cfg->acscale;
+           p.USphase=cfg->qpressure[i].USphase*(TWO_PI/65536.f);
+        }else
+           p=cfg->pressure[i];
+        mcx_aocoef(&p,cfg->aotable+i);
+     }
+     free(cfg->pressure);
+     free(cfg->qpressure);
+     cfg->pressure=NULL;
+     cfg->qpressure=NULL;
+}
+
+#define MCX_TWO_PI_D   6.283185307179586
+
+/*the polar angle of mcx_main_loop() at the uniform number u, in double precision*/
+static void mcx_scatangle(double g,double u,double *c,double *s){
+     double tmp;
+     if(g>EPS){
+        tmp=(1.0-g*g)/(1.0-g+2.0*g*u);
+        *c=MAX(-1.0,MIN(1.0,(1.0+g*g-tmp*tmp)/(2.0*g)));
+        *s=sqrt(1.0-(*c)*(*c));
+     }else{
+        *c=cos(MCX_TWO_PI_D*u);
+        *s=sin(MCX_TWO_PI_D*u);
+     }
+}
+
+/*
+   (cos,sin) of the scattering angles at the uniform numbers i/SCAT_LUT_LEN
+   for -Q: row 0 holds the azimuth 2*pi*u, row m+1 the Henyey-Greenstein
+   polar angle of medium m, sampled as in mcx_main_loop() (2*pi*u for g<=EPS).
+   The engines interpolate two neighbouring entries and put the pair back on
+   the unit circle; returns the largest error of the polar cosine against the
+   analytic sampling, taken halfway between the entries
+*/
+float mcx_buildscattable(Config *cfg){
+     unsigned int i,m,rowlen=SCAT_LUT_LEN+1;
+     double c,s,c0,s0,u,r,maxerr=0.0;
+     float2 *row;
+
+     free(cfg->scattable);
+     cfg->scattable=(float2*)malloc(sizeof(float2)*rowlen*(cfg->medianum+1));
+     if(cfg->scattable==NULL)
+        mcx_error(-3,"not enough host memory for the scattering angle tables",__FILE__,__LINE__);
+     for(i=0;i<rowlen;i++){
+        cfg->scattable[i].x=(float)cos(MCX_TWO_PI_D*i/SCAT_LUT_LEN);
+        cfg->scattable[i].y=(float)sin(MCX_TWO_PI_D*i/SCAT_LUT_LEN);
+     }
+     for(m=0;m<cfg->medianum;m++){
+        row=cfg->scattable+(m+1)*rowlen;
+        for(i=0;i<rowlen;i++){
+           mcx_scatangle(cfg->prop[m].g,(double)i/SCAT_LUT_LEN,&c,&s);
+           row[i].x=(float)c;
+           row[i].y=(float)s;
+        }
+        for(i=0;i<SCAT_LUT_LEN;i++){
+           u=(i+0.5)/SCAT_LUT_LEN;
+           mcx_scatangle(cfg->prop[m].g,u,&c0,&s0);
+           c=0.5*(row[i].x+row[i+1].x);
+           s=0.5*(row[i].y+row[i+1].y);
+           r=sqrt(c*c+s*s);
+           if(r>0.0)
+              maxerr=MAX(maxerr,fabs(c/r-c0));
+        }
+     }
+     return (float)maxerr;
+}
+
+#define MCX_TRANSPOSE_TILE  32
+
+/*
+   moves voxel (x,y,z) of a row-major array (z fastest) to the col-major
+   position (x fastest); dim is the col-major size. The out-of-place path
+   walks 32x32 (x,z) tiles of every y-plane in parallel, so both the source
+   rows and the destination rows of a tile stay in cache. With dst==NULL,
+   src is permuted in place by following the permutation cycles, this needs
+   one bit per voxel instead of a second array but runs on a single thread.
+*/
+void mcx_transpose3d(void *dst,void *src,uint3 dim,size_t elemsize){
+     size_t len=(size_t)dim.x*dim.y*dim.z;
+     long t,ntx=(dim.x+MCX_TRANSPOSE_TILE-1)/MCX_TRANSPOSE_TILE,ntz=(dim.z+MCX_TRANSPOSE_TILE-1)/MCX_TRANSPOSE_TILE;
+
+     if(len==0)
+          return;
+     if(dst){
+#ifdef _OPENMP
+          #pragma omp parallel for schedule(dynamic,4)
+#endif
+          for(t=0;t<(long)dim.y*ntx*ntz;t++){
+               size_t y=t/(ntx*ntz), x0=(t/ntz)%ntx*MCX_TRANSPOSE_TILE, z0=t%ntz*MCX_TRANSPOSE_TILE;
+               size_t x1=MIN(x0+MCX_TRANSPOSE_TILE,dim.x), z1=MIN(z0+MCX_TRANSPOSE_TILE,dim.z), x, z;
+               for(x=x0;x<x1;x++){
+                    size_t is=(x*dim.y+y)*dim.z, id=y*dim.x+x;
+                    if(elemsize==1){
+                         for(z=z0;z<z1;z++)
+                              ((unsigned char *)dst)[z*dim.x*dim.y+id]=((unsigned char *)src)[is+z];
+                    }else if(elemsize==sizeof(Acoustics)){
+                         for(z=z0;z<z1;z++)
+                              ((Acoustics *)dst)[z*dim.x*dim.y+id]=((Acoustics *)src)[is+z];
+                    }else{
+                         for(z=z0;z<z1;z++)
+                              memcpy((char *)dst+(z*dim.x*dim.y+id)*elemsize,(char *)src+(is+z)*elemsize,elemsize);
+                    }
+               }
+          }
+     }else{
+          unsigned char *done=(unsigned char *)calloc((len+7)>>3,1);
+          char *buf=(char *)src, *tmp=(char *)malloc(elemsize);
+          size_t start,cur,prev;
+          if(done==NULL || tmp==NULL)
+               mcx_error(-3,"not enough host memory for the volume conversion",__FILE__,__LINE__);
+          for(start=0;start<len;start++){
+               if(done[start>>3] & (1<<(start&7)))
+                    continue;
+               memcpy(tmp,buf+start*elemsize,elemsize);
+               for(cur=start;;cur=prev){
+                    /*the col-major position cur receives the row-major element prev*/
+                    prev=((cur%dim.x)*dim.y+(cur/dim.x)%dim.y)*dim.z+cur/((size_t)dim.x*dim.y);
+                    done[cur>>3]|=(1<<(cur&7));
+                    if(prev==start)
+                         break;
+                    memcpy(buf+cur*elemsize,buf+prev*elemsize,elemsize);
+               }
+               memcpy(buf+cur*elemsize,tmp,elemsize);
+          }
+          free(tmp);
+          free(done);
+     }
 }
 
+/*
+   converts the row-major label volume to col-major, in place if a second
+   volume does not fit in memory
+*/
 void  mcx_convertrow2col(unsigned char **vol, uint3 *dim){
-     uint x,y,z;
-     unsigned int dimxy,dimyz;
      unsigned char *newvol=NULL;
           
      if(*vol==NULL || dim->x==0 || dim->y==0 || dim->z==0){
      	return;
      }     
      newvol=(unsigned char*)malloc(sizeof(unsigned char)*dim->x*dim->y*dim->z);
-     dimxy=dim->x*dim->y;
-     dimyz=dim->y*dim->z;
-     for(x=0;x<dim->x;x++)
-      for(y=0;y<dim->y;y++)
-       for(z=0;z<dim->z;z++){
-       		newvol[z*dimxy+y*dim->x+x]=*vol[x*dimyz+y*dim->z+z];
-       }
+     if(newvol==NULL){
+          mcx_transpose3d(NULL,*vol,*dim,sizeof(unsigned char));
+          return;
+     }
+     mcx_transpose3d(newvol,*vol,*dim,sizeof(unsigned char));
      free(*vol);
      *vol=newvol;
 }
 
+/*
+   converts the acoustic box of a row-major input to col-major; until then
+   acorig/acdim are in the reversed (z,y,x) order of the row-major file
+*/
+void mcx_convertacoustics2col(Config *cfg){
+     uint3 dim={cfg->acdim.z,cfg->acdim.y,cfg->acdim.x};
+     Acoustics *newp;
+
+     if(cfg->pressure && dim.x*dim.y*dim.z>0){
+          newp=(Acoustics*)malloc(sizeof(Acoustics)*dim.x*dim.y*dim.z);
+          if(newp){
+               mcx_transpose3d(newp,cfg->pressure,dim,sizeof(Acoustics));
+               free(cfg->pressure);
+               cfg->pressure=newp;
+          }else
+               mcx_transpose3d(NULL,cfg->pressure,dim,sizeof(Acoustics));
+     }
+     cfg->acdim=dim;
+     dim=cfg->acorig;
+     cfg->acorig.x=dim.z;
+     cfg->acorig.z=dim.x;
+}
+
+
+/**
+   the sample points of one axis of the detector search, grouped by voxel:
+   the original search stepped through the cube around a detector at 0.5
+   voxel and tested each sample, here the samples of an axis that fall in
+   the same voxel are merged and only the one closest to the detector is
+   kept, which is the one that decides the sphere test. mark is the voxel
+   that receives the mask bit, test the voxel whose surface flag is read
+   ((int)(s+1.f)-1, the index the padded volume used to be read with, it
+   differs from mark only by float rounding). Returns the group count.
+*/
+static int mcx_detaxis(float center,float radius,uint len,int *mark,int *test,float *off){
+     float s,is;
+     int n=0,m,t;
+     for(s=-radius-1.f;s<=radius+1.f;s+=0.5f){
+          is=s+center;
+          if(is<0||is>=len)
+               continue;
+          m=(int)is;
+          t=(int)(is+1.f)-1;
+          if(n>0 && mark[n-1]==m && test[n-1]==t){
+               if(fabsf(s)<fabsf(off[n-1]))
+                    off[n-1]=s;
+               continue;
+          }
+          mark[n]=m;
+          test[n]=t;
+          off[n++]=s;
+     }
+     return n;
+}
 
 //MTA. This function determines which boundary voxels are used as "detectors" (given a detector input)
 void  mcx_maskdet(Config *cfg){
-     uint d,dx,dy,dz,idx1d,zi,yi,c,count;
-     float x,y,z,ix,iy,iz,rx,ry,rz,d2,mind2,d2max;
-     unsigned char *padvol;
-     const float corners[8][3]={{0.f,0.f,0.f},{1.f,0.f,0.f},{0.f,1.f,0.f},{0.f,0.f,1.f},
-                                {1.f,1.f,0.f},{1.f,0.f,1.f},{0.f,1.f,1.f},{1.f,1.f,1.f}};
-     
-     dx=cfg->dim.x+2;
-     dy=cfg->dim.y+2;
-     dz=cfg->dim.z+2;
-     
-     /*handling boundaries in a volume search is tedious, I first pad vol by a layer of zeros,
-       then I don't need to worry about boundaries any more*/
+     uint d,*count;
+     int zi,yi,nx=cfg->dim.x,ny=cfg->dim.y,nz=cfg->dim.z;
+     size_t slice=(size_t)nx*ny;
+     unsigned char *surf,*row;
 
-     padvol=(unsigned char*)calloc(dx*dy,dz);
+     /**
+        a voxel is on the interface (or the bounding box) if it is not
+        background and at least one of its 26 neighbours is, outside of the
+        volume counts as background. The flags are computed once for the
+        whole volume as a separable 3x3x3 erosion of the non-background
+        voxels: surf[] first receives the x/y erosion of each slice, which
+        is then eroded along z row by row, row[] marks the x-rows holding
+        any surface voxel so that the detector queries skip them
+     */
+     surf=(unsigned char*)malloc(slice*nz);
+     row=(unsigned char*)calloc(ny,nz);
+     #pragma omp parallel
+     {
+        unsigned char *ex=(unsigned char*)malloc(slice+nx),*prev=ex+slice;
+        unsigned char *in,*out,*up,*down;
+        int xi,k;
 
-     for(zi=1;zi<=cfg->dim.z;zi++)
-        for(yi=1;yi<=cfg->dim.y;yi++)
-	        memcpy(padvol+zi*dy*dx+yi*dx+1,cfg->vol+(zi-1)*cfg->dim.y*cfg->dim.x+(yi-1)*cfg->dim.x,cfg->dim.x);
+        #pragma omp for schedule(static)
+        for(zi=0;zi<nz;zi++){
+           in=cfg->vol+zi*slice;
+           out=surf+zi*slice;
+           for(k=0;k<(int)slice;k+=nx){      /*erosion along x*/
+              ex[k]=0;
+              ex[k+nx-1]=0;
+              for(xi=1;xi<nx-1;xi++)
+                 ex[k+xi]=(in[k+xi-1]!=0)&(in[k+xi]!=0)&(in[k+xi+1]!=0);
+           }
+           memset(out,0,nx);                  /*erosion along y*/
+           memset(out+slice-nx,0,nx);
+           for(k=nx;k<(int)slice-nx;k++)
+              out[k]=ex[k-nx]&ex[k]&ex[k+nx];
+        }
+        #pragma omp for schedule(static)
+        for(yi=0;yi<ny;yi++){
+           memset(prev,0,nx);
+           for(zi=0;zi<nz;zi++){              /*erosion along z, then the complement*/
+              out=surf+zi*slice+(size_t)yi*nx;
+              in=cfg->vol+zi*slice+(size_t)yi*nx;
+              down=(zi+1<nz) ? out+slice : NULL;
+              for(xi=0;xi<nx;xi++){
+                 unsigned char c=out[xi];
+                 up=prev+xi;
+                 out[xi]=(in[xi]!=0) & !(*up & c & (down ? down[xi] : 0));
+                 *up=c;
+                 row[zi*ny+yi]|=out[xi];
+              }
+           }
+        }
+        free(ex);
+     }
 
      /**
         The goal here is to find a set of voxels for each 
 	detector so that the intersection between a sphere
 	of R=cfg->detradius,c0=cfg->detpos[d] and the object 
-	surface (or bounding box) is fully covered.
+	surface (or bounding box) is fully covered. The detectors only
+	read surf[] and set bit 7 of vol, so they are processed in parallel
      */
+     count=(uint*)calloc(cfg->detnum+1,sizeof(uint));
+     #pragma omp parallel for schedule(dynamic)
      for(d=0;d<cfg->detnum;d++){                             /*loop over each detector*/
-        count=0;
-        d2max=(cfg->detpos[d].w+1.7321f)*(cfg->detpos[d].w+1.7321f);
-        for(z=-cfg->detpos[d].w-1.f;z<=cfg->detpos[d].w+1.f;z+=0.5f){   /*search in a cube with edge length 2*R+3*/
-           iz=z+cfg->detpos[d].z;
-           for(y=-cfg->detpos[d].w-1.f;y<=cfg->detpos[d].w+1.f;y+=0.5f){
-              iy=y+cfg->detpos[d].y;
-              for(x=-cfg->detpos[d].w-1.f;x<=cfg->detpos[d].w+1.f;x+=0.5f){
-	         ix=x+cfg->detpos[d].x;
-
-		 if(iz<0||ix<0||iy<0||ix>=cfg->dim.x||iy>=cfg->dim.y||iz>=cfg->dim.z||
-		    x*x+y*y+z*z > (cfg->detpos[d].w+1.f)*(cfg->detpos[d].w+1.f))
-		     continue;
-		 mind2=VERY_BIG;
+        float4 p=cfg->detpos[d];
+        float d2,mind2,rx,ry,rz,r1=(p.w+1.f)*(p.w+1.f),d2max=(p.w+1.7321f)*(p.w+1.7321f);
+        int len=(int)(4.f*p.w)+8,gx,gy,gz,ngx,ngy,ngz,c;
+        int *mark=(int*)malloc(sizeof(int)*len*6),*test=mark+len*3;
+        float *off=(float*)malloc(sizeof(float)*len*3);
+        const float corners[8][3]={{0.f,0.f,0.f},{1.f,0.f,0.f},{0.f,1.f,0.f},{0.f,0.f,1.f},
+                                   {1.f,1.f,0.f},{1.f,0.f,1.f},{0.f,1.f,1.f},{1.f,1.f,1.f}};
+
+        /*search in a cube with edge length 2*R+3, one group per voxel and axis*/
+        ngx=mcx_detaxis(p.x,p.w,nx,mark,test,off);
+        ngy=mcx_detaxis(p.y,p.w,ny,mark+len,test+len,off+len);
+        ngz=mcx_detaxis(p.z,p.w,nz,mark+2*len,test+2*len,off+2*len);
+        for(gz=0;gz<ngz;gz++){
+           float z=off[2*len+gz];
+           int tz=test[2*len+gz];
+           if(tz>=nz) continue;
+           for(gy=0;gy<ngy;gy++){
+              float y=off[len+gy];
+              int ty=test[len+gy];
+              if(ty>=ny || !row[tz*ny+ty]) continue;
+              for(gx=0;gx<ngx;gx++){
+                 float x=off[gx];
+                 int tx=test[gx];
+                 if(tx>=nx || !surf[tz*slice+(size_t)ty*nx+tx] || x*x+y*y+z*z > r1)
+                     continue;
+                 mind2=VERY_BIG;
                  for(c=0;c<8;c++){ /*test each corner of a voxel*/
-			rx=(int)ix-cfg->detpos[d].x+corners[c][0];
-			ry=(int)iy-cfg->detpos[d].y+corners[c][1];
-			rz=(int)iz-cfg->detpos[d].z+corners[c][2];
-			d2=rx*rx+ry*ry+rz*rz;
-		 	if(d2>d2max){ /*R+sqrt(3) to make sure the circle is fully corvered*/
-				mind2=VERY_BIG;
-		     		break;
-			}
-			if(d2<mind2) mind2=d2;
-		 }
-		 if(mind2==VERY_BIG || mind2>=cfg->detpos[d].w*cfg->detpos[d].w) continue;
-		 idx1d=((int)(iz+1.f)*dy*dx+(int)(iy+1.f)*dx+(int)(ix+1.f)); /*1.f comes from the padded layer*/
-
-		 if(padvol[idx1d])  /*looking for a voxel on the interface or bounding box*/
-                  if(!(padvol[idx1d+1]&&padvol[idx1d-1]&&padvol[idx1d+dx]&&padvol[idx1d-dx]&&padvol[idx1d+dy*dx]&&padvol[idx1d-dy*dx]&&
-		     padvol[idx1d+dx+1]&&padvol[idx1d+dx-1]&&padvol[idx1d-dx+1]&&padvol[idx1d-dx-1]&&
-		     padvol[idx1d+dy*dx+1]&&padvol[idx1d+dy*dx-1]&&padvol[idx1d-dy*dx+1]&&padvol[idx1d-dy*dx-1]&&
-		     padvol[idx1d+dy*dx+dx]&&padvol[idx1d+dy*dx-dx]&&padvol[idx1d-dy*dx+dx]&&padvol[idx1d-dy*dx-dx]&&
-		     padvol[idx1d+dy*dx+dx+1]&&padvol[idx1d+dy*dx+dx-1]&&padvol[idx1d+dy*dx-dx+1]&&padvol[idx1d+dy*dx-dx-1]&&
-		     padvol[idx1d-dy*dx+dx+1]&&padvol[idx1d-dy*dx+dx-1]&&padvol[idx1d-dy*dx-dx+1]&&padvol[idx1d-dy*dx-dx-1])){
-		          cfg->vol[((int)iz*cfg->dim.y*cfg->dim.x+(int)iy*cfg->dim.x+(int)ix)]|=(1<<7);/*set the highest bit to 1*/
-                          count++;
-	          }
-	       }
-	   }
+                     rx=mark[gx]-p.x+corners[c][0];
+                     ry=mark[len+gy]-p.y+corners[c][1];
+                     rz=mark[2*len+gz]-p.z+corners[c][2];
+                     d2=rx*rx+ry*ry+rz*rz;
+                     if(d2>d2max){ /*R+sqrt(3) to make sure the circle is fully corvered*/
+                         mind2=VERY_BIG;
+                         break;
+                     }
+                     if(d2<mind2) mind2=d2;
+                 }
+                 if(mind2==VERY_BIG || mind2>=p.w*p.w) continue;
+                 #pragma omp atomic
+                 cfg->vol[mark[2*len+gz]*slice+(size_t)mark[len+gy]*nx+mark[gx]]|=(1<<7);/*set the highest bit to 1*/
+                 count[d]++;
+              }
+           }
         }
-        if(cfg->issavedet && count==0)
-              fprintf(stderr,"MCX WARNING: detector %d is not located on an interface, please check coordinates.\n",d+1);
+        free(mark);
+        free(off);
      }
+     for(d=0;d<cfg->detnum;d++)
+        if(cfg->issavedet && count[d]==0)
+              fprintf(stderr,"MCX WARNING: detector %d is not located on an interface, please check coordinates.\n",d+1);
+     free(count);
+     free(surf);
+     free(row);
      /**
          To test the results, you should use -M to dump the det-mask, load 
 	 it in matlab, and plot the interface containing the detector with
@@ -956,10 +1761,89 @@ void  mcx_maskdet(Config *cfg){
 	 	mcx_error(-10,"can not save mask file",__FILE__,__LINE__);
 	 }
 	 fclose(fp);
-         free(padvol);
 	 exit(0);
      }
-     free(padvol);
+}
+
+#define MCX_DETGRID_PAD      0.5f     /*grid units added around each detector sphere*/
+#define MCX_DETGRID_MAXCELL  (1<<20)  /*the cell size is doubled until the grid fits*/
+
+static uint mcx_detcell(float pos,float scale,uint len){
+     pos*=scale;
+     return (pos<=0.f) ? 0 : MIN((uint)pos,len-1);
+}
+
+/**
+   builds the detector lookup grid used by finddetector: a uniform grid
+   over the bounding box of all detector spheres, each cell lists, in
+   ascending order, the detectors whose padded bounding box overlaps it.
+   A photon leaving through a DET_MASK voxel only tests the detectors of
+   its cell, which gives the same first match as scanning all detectors;
+   a point outside of the grid is not in any detector. detgrid[c] and
+   detgrid[c+1] are the first and last+1 entries of cell c in detgrid[].
+*/
+void mcx_builddetgrid(Config *cfg){
+     uint d,i,x,y,z,ncell,total,*cursor;
+     float cell,wmax=0.f;
+     float3 lo={VERY_BIG,VERY_BIG,VERY_BIG},hi={-VERY_BIG,-VERY_BIG,-VERY_BIG};
+     uint3 *range;
+
+     free(cfg->detgrid);
+     cfg->detgrid=NULL;
+     if(cfg->detnum==0)
+          return;
+     for(d=0;d<cfg->detnum;d++){
+          float4 p=cfg->detpos[d];
+          lo.x=MIN(lo.x,p.x-p.w-MCX_DETGRID_PAD); hi.x=MAX(hi.x,p.x+p.w+MCX_DETGRID_PAD);
+          lo.y=MIN(lo.y,p.y-p.w-MCX_DETGRID_PAD); hi.y=MAX(hi.y,p.y+p.w+MCX_DETGRID_PAD);
+          lo.z=MIN(lo.z,p.z-p.w-MCX_DETGRID_PAD); hi.z=MAX(hi.z,p.z+p.w+MCX_DETGRID_PAD);
+          wmax=MAX(wmax,p.w);
+     }
+     /*a cell about the size of a detector holds a few of them at most*/
+     for(cell=MAX(1.f,2.f*wmax);;cell*=2.f){
+          cfg->detgriddim.x=(uint)((hi.x-lo.x)/cell)+1;
+          cfg->detgriddim.y=(uint)((hi.y-lo.y)/cell)+1;
+          cfg->detgriddim.z=(uint)((hi.z-lo.z)/cell)+1;
+          if((double)cfg->detgriddim.x*cfg->detgriddim.y*cfg->detgriddim.z<=MCX_DETGRID_MAXCELL)
+               break;
+     }
+     ncell=cfg->detgriddim.x*cfg->detgriddim.y*cfg->detgriddim.z;
+     cfg->detgridorig=lo;
+     cfg->detgridscale=1.f/cell;
+
+     /*cell range of each detector: range[2*d] the first, range[2*d+1] the last cell*/
+     range=(uint3*)malloc(sizeof(uint3)*cfg->detnum*2);
+     cursor=(uint*)calloc(ncell+1,sizeof(uint));
+     total=0;
+     for(d=0;d<cfg->detnum;d++){
+          float4 p=cfg->detpos[d];
+          float r=p.w+MCX_DETGRID_PAD;
+          range[2*d].x  =mcx_detcell(p.x-r-lo.x,cfg->detgridscale,cfg->detgriddim.x);
+          range[2*d].y  =mcx_detcell(p.y-r-lo.y,cfg->detgridscale,cfg->detgriddim.y);
+          range[2*d].z  =mcx_detcell(p.z-r-lo.z,cfg->detgridscale,cfg->detgriddim.z);
+          range[2*d+1].x=mcx_detcell(p.x+r-lo.x,cfg->detgridscale,cfg->detgriddim.x);
+          range[2*d+1].y=mcx_detcell(p.y+r-lo.y,cfg->detgridscale,cfg->detgriddim.y);
+          range[2*d+1].z=mcx_detcell(p.z+r-lo.z,cfg->detgridscale,cfg->detgriddim.z);
+          for(z=range[2*d].z;z<=range[2*d+1].z;z++)
+            for(y=range[2*d].y;y<=range[2*d+1].y;y++)
+              for(x=range[2*d].x;x<=range[2*d+1].x;x++){
+                  cursor[(z*cfg->detgriddim.y+y)*cfg->detgriddim.x+x]++;
+                  total++;
+              }
+     }
+     cfg->detgrid=(uint*)malloc(sizeof(uint)*(ncell+1+total));
+     cfg->detgrid[0]=ncell+1;
+     for(i=0;i<ncell;i++){
+          cfg->detgrid[i+1]=cfg->detgrid[i]+cursor[i];
+          cursor[i]=cfg->detgrid[i];
+     }
+     for(d=0;d<cfg->detnum;d++)   /*ascending d keeps the first-match order of the linear scan*/
+          for(z=range[2*d].z;z<=range[2*d+1].z;z++)
+            for(y=range[2*d].y;y<=range[2*d+1].y;y++)
+              for(x=range[2*d].x;x<=range[2*d+1].x;x++)
+                  cfg->detgrid[cursor[(z*cfg->detgriddim.y+y)*cfg->detgriddim.x+x]++]=d;
+     free(cursor);
+     free(range);
 }
 
 //MTA. I'm really not sure what's going on here.
@@ -1006,6 +1890,10 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
      int i=1,isinteractive=1,issavelog=0;
      char filename[MAX_PATH_LENGTH]={0};
      char logfile[MAX_PATH_LENGTH]={0};
+     char srclist[MAX_PATH_LENGTH]={0};
+     char phases[MAX_PATH_LENGTH]={0};
+     char freqs[MAX_PATH_LENGTH]={0};
+     char bands[MAX_PATH_LENGTH]={0};
      float np=0.f;
 //MTA. Outputs text with instructions detailing how to use MCX
      if(argc<=1){
@@ -1125,10 +2013,59 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
                      case 'v':
                                 mcx_version(cfg);
 				break;
+                     case 'c':
+                                i=mcx_readarg(argc,argv,i,&(cfg->iscpu),"char");
+                                break;
+                     case 'q':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isquantac),"char");
+                                break;
+                     case 'k':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isaotable),"char");
+                                break;
+                     case 'W':
+                                i=mcx_readarg(argc,argv,i,srclist,"string");
+                                break;
+                     case 'x':
+                                i=mcx_readarg(argc,argv,i,phases,"string");
+                                mcx_parsephases(phases,cfg);
+                                break;
+                     case 'J':
+                                i=mcx_readarg(argc,argv,i,bands,"string");
+                                mcx_parsesidebands(bands,cfg);
+                                break;
+                     case 'F':
+                                i=mcx_readarg(argc,argv,i,freqs,"string");
+                                mcx_parsefreqs(freqs,cfg);
+                                break;
+                     case 'D':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isstreamgate),"char");
+                                break;
+                     case 'K':
+                                i=mcx_readarg(argc,argv,i,&(cfg->checkpoint),"int");
+                                break;
+                     case 'Z':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isresume),"char");
+                                break;
+                     case 'X':
+                                i=mcx_readarg(argc,argv,i,&(cfg->roulettesize),"float");
+                                if(cfg->roulettesize<=1.f)
+                                     MCX_ERROR(-1,"the roulette multiplier (-X) must be larger than 1");
+                                break;
+                     case 'j':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isdda),"char");
+                                break;
+                     case 'Q':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isscatlut),"char");
+                                break;
+                     case 'V':
+                                i=mcx_readarg(argc,argv,i,&(cfg->isdynamic),"char");
+                                break;
 		}
 	    }
 	    i++;
      }
+     if(cfg->minenergy*cfg->roulettesize>=1.f)  // a survivor would be back at the launch weight of an unscattered packet
+          MCX_ERROR(-1,"a packet surviving the roulette must stay below the launch weight, use -e*-X < 1");
      if(issavelog && cfg->session){
           sprintf(logfile,"%s.log",cfg->session);
           cfg->flog=fopen(logfile,"wt");
@@ -1143,6 +2080,12 @@ void mcx_parsecmd(int argc, char* argv[], Config *cfg){
 	  }else{
      	     mcx_readconfig(filename,cfg);
 	  }
+	  if(srclist[0])
+	     mcx_loadsrclist(srclist,cfg);
+	  /*the GPU saves a checkpoint only between two launches of the kernel*/
+	  if(cfg->checkpoint && !cfg->iscpu && (cfg->respin<=1 || cfg->isstreamgate)
+	        && (cfg->tend-cfg->tstart)/cfg->tstep<=cfg->maxgate+0.5f)
+	     fprintf(stderr,"MCX WARNING: -K saves no checkpoint for a single repetition of a single gate group on the GPU, use -r/-g to split the run or the CPU engine\n");
      }
 }
 
@@ -1179,18 +2122,53 @@ where possible parameters include (the first item in [] is the default value)\n\
  -T [64|int]   (--blocksize)   thread number per block\n\
  -A [0|int]    (--autopilot)   auto thread config:1 dedicated GPU;2 non-dedic.\n\
  -G [0|int]    (--gpu)         specify which GPU to use, list GPU by -L; 0 auto\n\
+ -c [0|1]      (--cpu)         1 to run on all CPU cores (OMP_NUM_THREADS)\n\
+ -q [0|1]      (--quantacoustic) 1 to store the acoustic field in 16-bit ints\n\
+ -k [0|1]      (--aotable)     1 to precompute per-voxel AO terms (2x memory)\n\
+ -W file       (--srclist)     run every source of a list (JSON or text) on the\n\
+                               same domain, output to <session>_src<n>\n\
+ -x phases     (--phasesweep)  ultrasound phase offsets in one run: N for N\n\
+                               even steps, or a list in degrees \"0,90,180\";\n\
+                               output to <session>_ph<k>_n.mc2, and one\n\
+                               magnitude/phase pair per offset in the .mch\n\
+ -J [0,1|list] (--sidebands)   sideband orders to save, n to <session>_n.mc2:\n\
+                               J0^2 for 0, 2*Jn^2 for n>0, e.g. \"0,1,2,3\"\n\
+ -F freqs      (--acfreq)      acoustic frequencies sharing one transport, in\n\
+                               Hz or MHz (<1e3), output to <session>_f<q>_n\n\
  -r [1|int]    (--repeat)      number of repetitions\n\
+ -D [0|1]      (--streamgate)  1 to carry the photons alive at the end of a\n\
+                               gate group (-g) over to the next one instead of\n\
+                               relaunching them, all groups in one pass; -r is\n\
+                               ignored\n\
+ -K [0|int]    (--checkpoint)  save the state of the run to <session>.ckpt\n\
+                               every int seconds, at the end of a repetition\n\
+                               or gate group (GPU, use -r/-g to set the\n\
+                               granularity) or of 1/16 of a repetition (CPU)\n\
+ -Z [0|1]      (--resume)      1 to continue from <session>.ckpt, with the same\n\
+                               command line as the interrupted run\n\
  -a [0|1]      (--array)       1 for C array (row-major); 0 for Matlab array\n\
  -z [0|1]      (--srcfrom0)    1 volume coord. origin [0 0 0]; 0 use [1 1 1]\n\
  -g [1|int]    (--gategroup)   number of time gates per run\n\
  -b [1|0]      (--reflect)     1 to reflect photons at ext. boundary;0 to exit\n\
  -B [0|1]      (--reflectin)   1 to reflect photons at int. boundary; 0 do not\n\
  -R [0.|float] (--skipradius)  cached zone radius from source to use atomics\n\
+ -e [0.|float] (--minenergy)   packets below this weight play Russian roulette,\n\
+                               0 to propagate them until they exit\n\
+ -X [10.|float](--roulette)    a packet survives the roulette with probability\n\
+                               1/X and carries X times its weight\n\
+ -j [0|1]      (--dda)         1 to step to the next voxel face or scattering\n\
+                               site instead of fixed unit steps\n\
+ -Q [0|1]      (--scatlut)     1 to sample the scattering angles from per-medium\n\
+                               lookup tables instead of acosf/sincosf\n\
+ -V [0|1]      (--dynamic)     1 to let the threads claim photons from a shared\n\
+                               counter, 0 for a fixed share per thread\n\
  -u [1.|float] (--unitinmm)    defines the length unit for the grid edge\n\
  -U [1|0]      (--normalize)   1 to normalize flux to unitary; 0 save raw\n\
  -d [1|0]      (--savedet)     1 to save photon info at detectors; 0 not save\n\
  -M [0|1]      (--dumpmask)    1 to dump detector volume masks; 0 do not save\n\
- -H [1000000]  (--maxdetphoton)max number of detected photons\n\
+ -H [1000000]  (--maxdetphoton)detected photon buffer per launch, a full buffer\n\
+                               is saved and the launch continued; the .mch file\n\
+                               is written in the background and is not limited by it\n\
  -S [1|0]      (--save2pt)     1 to save the flux field; 0 do not save\n\
  -E [0|int]    (--seed)        set random-number-generator seed, -1 to generate\n\
  -h            (--help)        print this message\n\
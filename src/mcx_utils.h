@@ -36,6 +36,30 @@ typedef struct MCXAcoustics{
 	float USphase;
 } Acoustics;
 
+/*
+   quantized acoustic record, 8 bytes per voxel: the pressure components are
+   int16 with a per-volume scale (Config.acscale), the phase is an angle in
+   units of 2*pi/65536
+*/
+typedef struct MCXAcousticsQ{
+	short Px;
+	short Py;
+	short Pz;
+	unsigned short USphase;
+} AcousticsQ;
+
+/*
+   per-voxel AO terms folded from Acoustics by mcx_aocoef(), the transport
+   loops only multiply them by the constants in MCXParam (aoki/aokj); all
+   zero for voxels where no pressure component exceeds EPS
+*/
+typedef struct MCXAOCoef{
+	float Sx,Sy,Sz;   // P*sin(USphase), scatterer displacement terms
+	float Ci;         // |P|*cos(USphase), refractive index term
+	float Cx,Cy,Cz;   // P*cos(USphase)
+	float Si;         // -|P|*sin(USphase)
+} AOCoef;
+
 //MTA new structure
 typedef struct MCXAconstants{
 	float rho;		// mass density of medium 
@@ -60,7 +84,9 @@ typedef struct MCXHistoryHeader{
 	unsigned int  detected;
 	unsigned int  savedphoton;
 	float unitinmm;
-	int reserved[7];
+	unsigned int  phasenum;   /*ultrasound phases of a sweep, 0: one modulation pair per record*/
+	unsigned int  freqnum;    /*acoustic frequencies, pairs per record=max(phasenum,1)*max(freqnum,1)*/
+	int reserved[5];
 } History;
 
 
@@ -93,7 +119,24 @@ typedef struct MCXConfig{
 	Oconstants *Ocon;		// AO constants MTA
 	Medium *prop;     /*optical property mapping table*/
 	Acoustics *pressure;		/*Pointer to the voxel-dependent acoustic variables*/
+	uint3 acorig;     /*first voxel of the bounding box of the non-zero acoustic field*/
+	uint3 acdim;      /*size of the acoustic bounding box, pressure[] only stores this box*/
+	AcousticsQ *qpressure;  /*quantized acoustic field, replaces pressure when isquantac is set*/
+	float acscale;    /*pressure represented by one int16 step in qpressure*/
+	AOCoef *aotable;  /*precomputed per-voxel AO terms, replaces pressure/qpressure when isaotable is set*/
+	float2 *scattable;    /*(cos,sin) tables of the azimuth and of the polar angle of each medium, see mcx_buildscattable()*/
 	float4 *detpos;   /*detector positions and radius, overwrite detradius*/
+	unsigned int srcnum;  /*number of sources in the batch list, 0 for a single run*/
+	float3 *srclist;      /*position and direction of each source of the batch, -W*/
+	uint *detgrid;    /*detector lookup grid: first/last+1 entry of each cell, followed by the detector indices*/
+	float3 detgridorig;   /*lower corner of the lookup grid in grid unit*/
+	float detgridscale;   /*lookup cells per grid unit*/
+	uint3 detgriddim;     /*lookup cells along x/y/z*/
+	unsigned int phasenum;  /*number of ultrasound phase offsets of the sweep, 0 for none*/
+	float *phaselist;       /*phase offsets added to USphase, in radians, -x*/
+	unsigned int freqnum;   /*number of acoustic frequencies sharing the transport, 0 for Acon.f only*/
+	float *freqlist;        /*acoustic frequencies in Hz, -F*/
+	unsigned int sidebands; /*bit n set: save the n-th sideband to <session>_n.mc2, -J*/
 
 	unsigned int maxgate;        /*simultaneous recording gates*/
 	unsigned int respin;         /*number of repeatitions*/
@@ -101,6 +144,8 @@ typedef struct MCXConfig{
 	int gpuid;          /*the ID of the GPU to use, starting from 1, 0 for auto*/
 
 	unsigned char *vol; /*pointer to the volume*/
+	size_t volmaplen;   /*non-zero if vol holds the unmodified volume file*/
+	char isvolmapped;   /*1 if vol is a private mapping of the file, 0 if it was read into a malloc buffer*/
 	char session[MAX_SESSION_LENGTH]; /*session id, a string*/
 	char isrowmajor;    /*1 for C-styled array in vol, 0 for matlab-styled array*/
 	char isreflect;     /*1 for reflecting photons at boundary,0 for exiting*/
@@ -113,7 +158,17 @@ typedef struct MCXConfig{
     char issrcfrom0;    /*1 do not subtract 1 from src/det positions, 0 subtract 1*/
     char isdumpmask;    /*1 dump detector mask; 0 not*/
 	char autopilot;     /*1 optimal setting for dedicated card, 2, for non dedicated card*/
+	char iscpu;         /*1 to run the multi-threaded CPU engine instead of the GPU kernel*/
+	char isquantac;     /*1 to store the acoustic field as 16-bit integers, 0 as float*/
+	char isaotable;     /*1 to precompute the per-voxel AO terms before the simulation*/
+	char isstreamgate;  /*1 to resume the photons alive at the end of a gate group in the next one*/
+	char isresume;      /*1 to continue the run from <session>.ckpt, -Z*/
+	char isdda;         /*1 to trace the photons voxel face by voxel face, 0 in fixed steps, -j*/
+	char isscatlut;     /*1 to sample the scattering angles from scattable, 0 with acosf/sincosf, -Q*/
+	char isdynamic;     /*1 to hand out the photons of a launch from a shared counter, 0 a fixed share per thread, -V*/
+	unsigned int checkpoint; /*seconds between checkpoints, 0 for none, -K*/
     float minenergy;    /*minimum energy to propagate photon*/
+	float roulettesize; /*weight multiplier of a photon surviving the Russian roulette below minenergy*/
 	float unitinmm;     /*defines the length unit in mm for grid*/
     FILE *flog;         /*stream handle to print log information*/
     History his;        /*header info of the history file*/
@@ -130,6 +185,10 @@ extern "C" {
 
 //MTA.
 void mcx_savedata(float *dat, int len, int doappend, char *suffix, Config *cfg, char *fieldnum);
+void mcx_savefields(float *field, int fieldlen, int doappend, Config *cfg);
+void mcx_truncatefields(int fieldlen, unsigned int nwin, Config *cfg);
+void mcx_truncatefile(const char *name,long long len);
+void mcx_exportfields(float *field, int fieldlen, Config *cfg);
 void mcx_error(const int id,const char *msg,const char *file,const int linenum);
 void mcx_loadconfig(FILE *in, Config *cfg);
 void mcx_saveconfig(FILE *in, Config *cfg);
@@ -140,14 +199,31 @@ void mcx_clearcfg(Config *cfg);
 void mcx_parsecmd(int argc, char* argv[], Config *cfg);
 void mcx_usage(char *exename);
 void mcx_loadvolume(char *filename,Config *cfg);
+void mcx_releasevolume(Config *cfg);
+void mcx_privatevolume(Config *cfg);
 void mcx_loadacoustics(char *filename,Config *cfg);	//MTA
+void mcx_quantizeacoustics(Config *cfg);
+void mcx_aocoef(const Acoustics *pressure, AOCoef *coef);
+void mcx_buildaotable(Config *cfg);
+float mcx_buildscattable(Config *cfg);
 void mcx_normalize(float field[], float scale, int fieldlen);
 int  mcx_readarg(int argc, char *argv[], int id, void *output,const char *type);
 void mcx_printlog(Config *cfg, char *str);
 int  mcx_remap(char *opt);
 void mcx_maskdet(Config *cfg);
+void mcx_builddetgrid(Config *cfg);
+void mcx_prepsource(Config *cfg);
+void mcx_loadsrclist(char *fname, Config *cfg);
+void mcx_setsource(Config *cfg, uint isrc, const char *session);
+void mcx_parsephases(char *str, Config *cfg);
+void mcx_parsefreqs(char *str, Config *cfg);
+void mcx_parsesidebands(char *str, Config *cfg);
+int  mcx_sidebandnum(Config *cfg);
+int  mcx_variantnum(Config *cfg);
 void mcx_version(Config *cfg);
 void mcx_convertrow2col(unsigned char **vol, uint3 *dim);
+void mcx_transpose3d(void *dst,void *src,uint3 dim,size_t elemsize);
+void mcx_convertacoustics2col(Config *cfg);
 int  mcx_loadjson(cJSON *root, Config *cfg);
 
 #ifdef MCX_CONTAINER
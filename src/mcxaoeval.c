@@ -0,0 +1,256 @@
+/*******************************************************************************
+**
+**  Acousto-Optic MCX (AO-MCX) - Matt Adams <adamsm2@bu.edu>
+**
+**  mcxaoeval.c: native replacement of the detector part of
+**               utils/AOI_MCX_Eval.m, streams an AO-MCX .mch file record by
+**               record and reduces the per-detector AO signals in parallel
+**
+**  Each record of the .mch file holds the detector id, the number of
+**  scattering events, the modulation depth and phase and maxmedia partial
+**  pathlengths (grid unit). For every photon the tool computes
+**
+**      E  = exp(-sum_m mua_m*ppath_m*unitinmm)
+**      E0 = E*J0(depth)^2,  E1 = 2*E*J1(depth)^2
+**      AC = 4*exp(-PRCabs*Lc)*exp(TWMre*Lc)*sin(TWMim*Lc)*E/Ad*J1(depth)*cos(phase)
+**      DC = 2*exp(-PRCabs*Lc)*(exp(TWMre*Lc)*cos(TWMim*Lc)-1)*E/Ad*(J0(depth)-1)
+**
+**  and sums them per detector; Intensity/Intensity0/Intensity1 are divided
+**  by the detector area and all sums by the total launched photon number,
+**  exactly as AOI_MCX_Eval.m does. Files of a phase sweep (-x) or of several
+**  acoustic frequencies (-F) hold one depth/phase pair per phase offset and
+**  frequency, the table then has one row per detector, phase and frequency
+**
+**  License: GNU General Public License v3, see LICENSE.txt for details
+**
+*******************************************************************************/
+
+#define _GNU_SOURCE          /* j0f/j1f are GNU extensions of libm */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+#include "mcx_utils.h"
+#include "mcx_bessel.h"
+
+#define AOEVAL_CHUNK   (1<<20)  /*records read and reduced per pass*/
+
+enum TAOSignal {sigIntensity, sigIntensity0, sigIntensity1, sigAC, sigDC, sigDepth, sigCount, sigLen};
+
+/*PRC constants of AOI_MCX_Eval.m*/
+typedef struct AOEvalParam{
+	float prcabs;   /*absorption coefficient of the crystal (1/cm)*/
+	float twmre;    /*real part of the two wave mixing coefficient (1/cm)*/
+	float twmim;    /*imaginary part of the two wave mixing coefficient (1/cm)*/
+	float lc;       /*crystal optical path length (cm)*/
+	float ad;       /*detector area (cm^2)*/
+} AOEvalParam;
+
+static void aoeval_usage(char *exename){
+     printf("\
+usage: %s <param1> <param2> ... session.mch mua_1 [mua_2 ...]\n\
+where possible parameters include (the first item in [] is the default value)\n\
+ -o output     (--output)      save the per-detector table to a file [stdout]\n\
+ -A area       (--area)        detector area in cm^2 [pi*0.25^2]\n\
+ -a prcabs     (--prcabs)      PRC crystal absorption coefficient in 1/cm [1.8]\n\
+ -r twm        (--twmreal)     real part of the two wave mixing coeff. in 1/cm [0.5]\n\
+ -i twm        (--twmimag)     imaginary part of the two wave mixing coeff. in 1/cm [0]\n\
+ -l length     (--crystal)     crystal optical path length in cm [0.7]\n\
+ -h            (--help)        print this message\n\
+the absorption coefficients (1/mm) are given in the order of the medium\n\
+indices, one per medium of the simulation\n\
+example:\n\
+       %s -o det.txt run1.mch 0.005 0.01\n",exename,exename);
+}
+
+static int aoeval_getoption(const char *arg,const char *shortopt,const char *longopt){
+     return strcmp(arg,shortopt)==0 || strcmp(arg,longopt)==0;
+}
+
+/**
+   reduce n records of one chunk into sums[detnum*sigLen]
+*/
+static void aoeval_reduce(const float *rec,int n,const History *his,const float *mua,
+                          const AOEvalParam *prc,double *sums){
+     int i,nth=1;
+     double **partial;
+     unsigned int npair=(his->phasenum ? his->phasenum : 1)*(his->freqnum ? his->freqnum : 1);
+     unsigned int len=his->detnum*npair*sigLen;
+     float acscale=4.f*expf(-prc->prcabs*prc->lc)*expf(prc->twmre*prc->lc)*sinf(prc->twmim*prc->lc)/prc->ad;
+     float dcscale=2.f*expf(-prc->prcabs*prc->lc)*(expf(prc->twmre*prc->lc)*cosf(prc->twmim*prc->lc)-1.f)/prc->ad;
+
+#ifdef _OPENMP
+     nth=omp_get_max_threads();
+#endif
+     partial=(double **)calloc(nth,sizeof(double *));
+
+#pragma omp parallel
+{
+     int tid=0,m;
+     unsigned int k;
+     double *acc;
+#ifdef _OPENMP
+     tid=omp_get_thread_num();
+#endif
+     acc=partial[tid]=(double *)calloc(len,sizeof(double));
+
+#pragma omp for schedule(static)
+     for(i=0;i<n;i++){
+          const float *r=rec+(size_t)i*his->colcount;
+          unsigned int det=(unsigned int)r[0];
+          float b0,b1,ener=0.f;
+
+          if(det<1 || det>his->detnum)
+              continue;
+          for(m=0;m<(int)his->maxmedia;m++)
+              ener-=mua[m]*r[2+2*npair+m];
+          ener=expf(ener*his->unitinmm);
+
+          for(k=0;k<npair;k++){
+              const float *mod=r+2+2*k;  /*depth and phase of the k-th offset/frequency*/
+              double *d=acc+((det-1)*npair+k)*sigLen;
+              mcx_besselj01(mod[0],&b0,&b1);
+              d[sigIntensity]+=ener;
+              d[sigIntensity0]+=ener*b0*b0;
+              d[sigIntensity1]+=2.f*ener*b1*b1;
+              d[sigAC]+=acscale*ener*b1*cosf(mod[1]);
+              d[sigDC]+=dcscale*ener*(b0-1.f);
+              d[sigDepth]+=mod[0];
+              d[sigCount]+=1.0;
+          }
+     }
+}
+     for(i=0;i<nth;i++){
+          unsigned int j;
+          for(j=0;j<len;j++)
+              sums[j]+=partial[i][j];
+          free(partial[i]);
+     }
+     free(partial);
+}
+
+int main(int argc, char *argv[]){
+     char *mchfile=NULL,*outfile=NULL;
+     float *mua=NULL,*rec=NULL;
+     int i,nmua=0;
+     unsigned int detnum=0,maxmedia=0,colcount=0,phasenum=0,freqnum=0,npair=1;
+     double totalphoton=0.,savedphoton=0.,*sums=NULL;
+     AOEvalParam prc={1.8f,0.5f,0.f,0.7f,(float)(M_PI*0.25*0.25)};
+     History his;
+     FILE *fp,*out=stdout;
+
+     for(i=1;i<argc;i++){
+          if(argv[i][0]=='-' && mchfile==NULL){
+              if(aoeval_getoption(argv[i],"-h","--help")){
+                  aoeval_usage(argv[0]);
+                  return 0;
+              }
+              if(i+1>=argc){
+                  fprintf(stderr,"option %s needs a value\n",argv[i]);
+                  return 1;
+              }
+              if(aoeval_getoption(argv[i],"-o","--output"))       outfile=argv[++i];
+              else if(aoeval_getoption(argv[i],"-A","--area"))    prc.ad=atof(argv[++i]);
+              else if(aoeval_getoption(argv[i],"-a","--prcabs"))  prc.prcabs=atof(argv[++i]);
+              else if(aoeval_getoption(argv[i],"-r","--twmreal")) prc.twmre=atof(argv[++i]);
+              else if(aoeval_getoption(argv[i],"-i","--twmimag")) prc.twmim=atof(argv[++i]);
+              else if(aoeval_getoption(argv[i],"-l","--crystal")) prc.lc=atof(argv[++i]);
+              else{
+                  fprintf(stderr,"unknown option %s\n",argv[i]);
+                  return 1;
+              }
+          }else if(mchfile==NULL){
+              mchfile=argv[i];
+              mua=(float *)calloc(argc,sizeof(float));
+          }else{
+              mua[nmua++]=atof(argv[i]);
+          }
+     }
+     if(mchfile==NULL || nmua==0){
+          aoeval_usage(argv[0]);
+          return 1;
+     }
+     if((fp=fopen(mchfile,"rb"))==NULL){
+          fprintf(stderr,"can not open %s\n",mchfile);
+          return 2;
+     }
+
+     /*a .mch file is a sequence of blocks, each a History header followed
+       by savedphoton records of colcount floats*/
+     while(fread(&his,sizeof(History),1,fp)==1){
+          unsigned int left;
+          if(memcmp(his.magic,"MCXH",4)!=0)
+              break;
+          if(his.version!=1){
+              fprintf(stderr,"version higher than 1 is not supported\n");
+              return 2;
+          }
+          if(sums==NULL){
+              detnum=his.detnum;
+              maxmedia=his.maxmedia;
+              colcount=his.colcount;
+              phasenum=his.phasenum;
+              freqnum=his.freqnum;
+              npair=(phasenum ? phasenum : 1)*(freqnum ? freqnum : 1);
+              if(nmua!=(int)maxmedia){
+                  fprintf(stderr,"%s has %u media, but %d absorption coefficients were given\n",mchfile,maxmedia,nmua);
+                  return 1;
+              }
+              if(colcount<maxmedia+2+2*npair){
+                  fprintf(stderr,"%s is not an AO-MCX detected photon file\n",mchfile);
+                  return 2;
+              }
+              sums=(double *)calloc(detnum*npair*sigLen,sizeof(double));
+              rec=(float *)malloc(sizeof(float)*colcount*AOEVAL_CHUNK);
+          }else if(his.detnum!=detnum || his.maxmedia!=maxmedia || his.colcount!=colcount || his.phasenum!=phasenum || his.freqnum!=freqnum){
+              fprintf(stderr,"mcxaoeval can only process data generated from a single session\n");
+              return 2;
+          }
+          totalphoton+=his.totalphoton;
+          savedphoton+=his.savedphoton;
+          for(left=his.savedphoton;left>0;){
+              unsigned int n=(left>AOEVAL_CHUNK) ? AOEVAL_CHUNK : left;
+              if(fread(rec,sizeof(float)*colcount,n,fp)!=n){
+                  fprintf(stderr,"%s is truncated\n",mchfile);
+                  return 2;
+              }
+              aoeval_reduce(rec,n,&his,mua,&prc,sums);
+              left-=n;
+          }
+     }
+     fclose(fp);
+     if(sums==NULL){
+          fprintf(stderr,"can not find a MCX history data block in %s\n",mchfile);
+          return 2;
+     }
+
+     if(outfile && (out=fopen(outfile,"wt"))==NULL){
+          fprintf(stderr,"can not save data to %s\n",outfile);
+          return 2;
+     }
+     fprintf(out,"%% %s: %.0f photons launched, %.0f detected photons saved\n",mchfile,totalphoton,savedphoton);
+     fprintf(out,"%% det\t%s%sIntensity\tIntensity0\tIntensity1\tPRC_AC\tPRC_DC\tMeanDepth\tCount\n",
+         phasenum ? "phase\t" : "",freqnum ? "freq\t" : "");
+     for(i=0;i<(int)(detnum*npair);i++){
+          double *d=sums+i*sigLen;
+          fprintf(out,"%d\t",i/npair+1);
+          if(phasenum)
+              fprintf(out,"%d\t",(i%npair)/(freqnum ? freqnum : 1));
+          if(freqnum)
+              fprintf(out,"%d\t",i%freqnum);
+          fprintf(out,"%e\t%e\t%e\t%e\t%e\t%e\t%.0f\n",
+              d[sigIntensity]/prc.ad/totalphoton,d[sigIntensity0]/prc.ad/totalphoton,
+              d[sigIntensity1]/prc.ad/totalphoton,d[sigAC]/totalphoton,d[sigDC]/totalphoton,
+              (d[sigCount]>0.) ? d[sigDepth]/d[sigCount] : 0.,d[sigCount]);
+     }
+     if(out!=stdout)
+          fclose(out);
+     free(sums);
+     free(rec);
+     free(mua);
+     return 0;
+}
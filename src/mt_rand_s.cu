@@ -162,6 +162,9 @@ mt19937sc(int loops, uint* result, uint* seeds)
 __device__ void gpu_rng_init(char t[RAND_BUF_LEN], char tnew[RAND_BUF_LEN],uint *n_seed,int idx){
     mt19937si(n_seed+idx*RAND_SEED_LEN,idx);
 }
+// one stream per block, a new photon continues it
+__device__ void rand_photon_start(char t[RAND_BUF_LEN],char tnew[RAND_BUF_LEN],uint photonid){
+}
 // transform into [0,1] random number
 __device__ float rand_uniform01(uint ran){
     return (ran*R_MAX_MT_RAND);
@@ -190,4 +193,18 @@ __device__ float rand_do_roulette(RandType t[RAND_BUF_LEN]){
 __device__ void rand_need_more(RandType t[RAND_BUF_LEN],RandType tbuf[RAND_BUF_LEN]){
     // do nothing
 }
+
+// host side: draws the seeds of one launch of nthread threads, returns the number of rand() values used
+static unsigned int rand_launch_seeds(uint seed[],uint nthread,uint runseed,uint src,uint launch){
+    uint i;
+    for(i=0;i<nthread*RAND_SEED_LEN;i++)
+        seed[i]=rand();
+    return nthread*RAND_SEED_LEN;
+}
+// host side: new seeds for a relaunch of the same repetition, without using rand()
+static inline void rand_relaunch_seeds(uint seed[],uint nthread){
+    uint i;
+    for(i=0;i<nthread*RAND_SEED_LEN;i++)
+        seed[i]=(seed[i]*1103515245u+12345u)%((uint)RAND_MAX+1u);
+}
 #endif
@@ -0,0 +1,114 @@
+/*********************************************************************
+*A counter-based Random Number Generator, Philox4x32-10              *
+*                                                                    *
+*  J. K. Salmon, M. A. Moraes, R. O. Dror and D. E. Shaw, "Parallel  *
+*  Random Numbers: As Easy as 1, 2, 3", Proc. SC'11, 2011            *
+*                                                                    *
+*  every photon draws from its own stream: the counter is            *
+*  (draw, photon index, launch, 0) and the key (seed, source), so    *
+*  the numbers of a photon do not depend on the thread that runs it  *
+*  and no warm-up is needed                                          *
+*                                                                    *
+*********************************************************************/
+
+#ifndef _MCEXTREME_PHILOX_RAND_H
+#define _MCEXTREME_PHILOX_RAND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define MCX_RNG_NAME       "Philox4x32-10"
+
+#define RAND_BUF_LEN       6        //t: 4 numbers of the last block; tnew: 4 counter words, 2 key words
+#define RAND_SEED_LEN      3        //seed, source and launch index, the same for all threads
+#define PHILOX_M0          0xD2511F53u
+#define PHILOX_M1          0xCD9E8D57u
+#define PHILOX_W0          0x9E3779B9u
+#define PHILOX_W1          0xBB67AE85u
+#define PHILOX_ROUNDS      10
+#define R_MAX_PHILOX       1.1920928955078125e-7f   //1/2^23
+#define R_HALF_PHILOX      5.9604644775390625e-8f   //1/2^24
+
+typedef uint RandType;
+
+// one block of 4 numbers from the counter ctr[0..3] and the key ctr[4..5]
+__device__ void philox_block(RandType out[4],const RandType ctr[RAND_BUF_LEN]){
+    RandType c0=ctr[0],c1=ctr[1],c2=ctr[2],c3=ctr[3],k0=ctr[4],k1=ctr[5],tmp;
+    unsigned long long p0,p1;
+    int i;
+    for(i=0;i<PHILOX_ROUNDS;i++){
+        p0=(unsigned long long)PHILOX_M0*c0;
+        p1=(unsigned long long)PHILOX_M1*c2;
+        tmp=(RandType)(p1>>32)^c1^k0;
+        c1=(RandType)p1;
+        c2=(RandType)(p0>>32)^c3^k1;
+        c3=(RandType)p0;
+        c0=tmp;
+        k0+=PHILOX_W0;
+        k1+=PHILOX_W1;
+    }
+    out[0]=c0; out[1]=c1; out[2]=c2; out[3]=c3;
+}
+// the next block of the photon's stream
+__device__ void rand_need_more(RandType t[RAND_BUF_LEN],RandType tnew[RAND_BUF_LEN]){
+    philox_block(t,tnew);
+    tnew[0]++;
+}
+// the launch index and key are passed as seeds, see rand_launch_seeds()
+__device__ void gpu_rng_init(RandType t[RAND_BUF_LEN], RandType tnew[RAND_BUF_LEN],uint *n_seed,int idx){
+    tnew[0]=0;
+    tnew[1]=0;
+    tnew[2]=n_seed[idx*RAND_SEED_LEN+2];
+    tnew[3]=0;
+    tnew[4]=n_seed[idx*RAND_SEED_LEN];
+    tnew[5]=n_seed[idx*RAND_SEED_LEN+1];
+}
+// switches to the stream of a photon, its first block is ready for a reflection test before the first scattering
+__device__ void rand_photon_start(RandType t[RAND_BUF_LEN],RandType tnew[RAND_BUF_LEN],uint photonid){
+    tnew[0]=0;
+    tnew[1]=photonid;
+    rand_need_more(t,tnew);
+}
+// transform into (0,1) random number, the 23 upper bits centered in their interval
+__device__ float rand_uniform01(RandType v){
+    return (v>>9)*R_MAX_PHILOX+R_HALF_PHILOX;
+}
+// generate [0,1] random number for the next scattering length
+__device__ float rand_next_scatlen(RandType t[RAND_BUF_LEN]){
+    return -logf(rand_uniform01(t[0]));
+}
+// generate [0,1] random number for the next arimuthal angle
+__device__ float rand_next_aangle(RandType t[RAND_BUF_LEN]){
+    return rand_uniform01(t[1]);
+}
+// generate random number for the next zenith angle
+__device__ float rand_next_zangle(RandType t[RAND_BUF_LEN]){
+    return rand_uniform01(t[2]);
+}
+// generate random number for reflection test
+__device__ float rand_next_reflect(RandType t[RAND_BUF_LEN]){
+    return rand_uniform01(t[3]);
+}
+// generate random number for the Russian roulette
+__device__ float rand_do_roulette(RandType t[RAND_BUF_LEN]){
+    return rand_uniform01(t[0]);
+}
+
+/*
+   host side: the seeds of one launch of nthread threads, all threads share
+   the key, the photon index selects the stream; no rand() value is used
+*/
+static unsigned int rand_launch_seeds(uint seed[],uint nthread,uint runseed,uint src,uint launch){
+    uint i;
+    for(i=0;i<nthread;i++){
+        seed[i*RAND_SEED_LEN]=runseed;
+        seed[i*RAND_SEED_LEN+1]=src;
+        seed[i*RAND_SEED_LEN+2]=launch;
+    }
+    return 0;
+}
+// host side: a relaunch of the same repetition keeps the seeds, its photons have their own streams
+static inline void rand_relaunch_seeds(uint seed[],uint nthread){
+}
+#endif
@@ -12,6 +12,11 @@ function [cwfluence0,cwfluence1,header,det,PRC,Intensity,Intensity0,Intensity1,A
 % Important Note: The PRC signal here is missing the background signal
 % level here! Is important for noise!
 %
+% For large .mch files, the detector part (Intensity, Intensity0,
+% Intensity1, PRC) can be computed without loading the file with the
+% native tool, built by "make aoeval" in src/:
+%     mcxaoeval fname.mch absorptions(1) absorptions(2) ...
+%
 % Matt Adams
 % 9/25/13
 
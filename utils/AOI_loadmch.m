@@ -13,8 +13,10 @@ function [data, headerstruct]=AOI_loadmch(fname,format)
 %        data:   the output detected photon data array
 %                data has header.medium+2 columns, the first column is the 
 %                ID of the detector; the 2nd column is the number of 
-%                scattering events for a detected photon; the remaining 
-%                columns are the partial path lengths (in mm) for each medium type
+%                scattering events for a detected photon; then the magnitude
+%                and phase of the modulation, one pair per phase offset of
+%                a sweep (-x); the remaining columns are the partial path
+%                lengths (in mm) for each medium type
 %        header: file header info, a structure has the following fields
 %                [version,medianum,detnum,recordnum,totalphoton,
 %                 detectedphoton,savedphoton,lengthunit]
@@ -44,10 +46,11 @@ while(~feof(fid))
 	if(hd(1)~=1) error('version higher than 1 is not supported'); end
 	unitmm=fread(fid,1,'float32');
 	junk=fread(fid,7,'uint');
+	nphase=max(junk(1),1)*max(junk(2),1);   %MTA phase sweep (-x) and frequencies (-F): one magnitude/phase pair per offset and frequency
 	
 	dat=fread(fid,hd(7)*hd(4),format);          %MTA Changed 6/20/12 (added +1 to hd(4)) 
 	dat=reshape(dat,[hd(4),hd(7)])';            %MTA Changed 6/20/12 (added +1 to hd(4)) 
-	dat(:,5:end)=dat(:,5:end)*unitmm;
+	dat(:,3+2*nphase:end)=dat(:,3+2*nphase:end)*unitmm;
 	data=[data;dat];
 	if(isempty(header))
 		header=[hd;unitmm]';
@@ -0,0 +1,43 @@
+function report=AOI_quantcheck(fref,fquant,dim)
+%AOI_QUANTCHECK compares an AO-MCX run that used the 16-bit acoustic field
+%(-q 1) against a full precision run with the same seed and photon number
+%
+%    report=AOI_quantcheck(fref,fquant,dim)
+%
+% fref and fquant are the session names of the float and the quantized
+% runs, dim is the [nx,ny,nz,nt] dimension of the .mc2 output
+%
+% The acoustic field does not change the photon paths, so with the same
+% seed both runs detect the same photons in the same order and the
+% modulation depth can be compared photon by photon
+%
+% report contains the relative L2 and max errors of field0/field1 and the
+% mean/max absolute difference of the modulation depth and phase in .mch
+
+for k=0:1
+    ref=loadmc2([fref '_' num2str(k) '.mc2'],dim);
+    quant=loadmc2([fquant '_' num2str(k) '.mc2'],dim);
+    report.field(k+1).l2err=norm(ref(:)-quant(:))/norm(ref(:));
+    report.field(k+1).maxerr=max(abs(ref(:)-quant(:)))/max(abs(ref(:)));
+end
+
+detref=AOI_loadmch([fref '.mch']);
+detquant=AOI_loadmch([fquant '.mch']);
+if(size(detref,1)~=size(detquant,1))
+    warning('the two runs detected different photons, skip the .mch comparison');
+    return;
+end
+dmag=abs(detref(:,3)-detquant(:,3));
+dphi=abs(angle(exp(1i*(detref(:,4)-detquant(:,4)))));
+report.moddepth.meanerr=mean(dmag);
+report.moddepth.maxerr=max(dmag);
+report.moddepth.relerr=mean(dmag)/max(mean(abs(detref(:,3))),eps);
+report.modphase.meanerr=mean(dphi);
+report.modphase.maxerr=max(dphi);
+
+fprintf(1,'field0: rel. L2 error %e, max error %e\n',report.field(1).l2err,report.field(1).maxerr);
+fprintf(1,'field1: rel. L2 error %e, max error %e\n',report.field(2).l2err,report.field(2).maxerr);
+fprintf(1,'modulation depth: mean error %e (%e relative), max error %e\n',...
+    report.moddepth.meanerr,report.moddepth.relerr,report.moddepth.maxerr);
+fprintf(1,'modulation phase: mean error %e rad, max error %e rad\n',...
+    report.modphase.meanerr,report.modphase.maxerr);